@@ -0,0 +1,214 @@
+#ifndef BATCHKERNEL
+#define BATCHKERNEL
+
+#include <cstring>
+#include <cstdint>
+#include <batchwalker.hpp>
+
+/**
+ * Step kernel of batchWalker
+ *
+ * Advances every lane in [0, n) that is still walking, n a multiple of BATCH_VECTOR, and returns the
+ * number of lanes in [0, n) that are no longer walking. It is compiled in its own file with -mavx512f
+ * and only called when the CPU supports it. Narrower instruction sets split the 64 bit lane
+ * arithmetic up enough that particle1d is as fast
+ */
+int stepLanesAvx512( batchWalker::lanes &L, const batchWalker::constants &c, const int n );
+
+namespace {
+
+const int64_t ALIVE = static_cast<int64_t>( particleStatus::alive );
+
+// Vectors of width 64 bit lanes. Comparisons give masks of 0 or -1 in each lane
+template<int width>
+struct laneTypes
+{
+    typedef double real __attribute__((vector_size( 8 * width )));
+    typedef int64_t integer __attribute__((vector_size( 8 * width )));
+    typedef uint64_t word __attribute__((vector_size( 8 * width )));
+};
+
+template<typename V, typename T>
+inline V load( const T *p )
+{
+    V v;
+    std::memcpy( &v, p, sizeof(v) );
+    return v;
+}
+
+template<typename V, typename T>
+inline void store( T *p, const V &v )
+{
+    std::memcpy( p, &v, sizeof(v) );
+}
+
+// xoshiro256ss::next on every lane. The multiplications by 5 and 9 are shifts and adds, which every
+// instruction set has for 64 bit lanes
+template<typename laneWord>
+inline laneWord xoshiroNext( laneWord &s0, laneWord &s1, laneWord &s2, laneWord &s3 )
+{
+    const laneWord m = (s1 << 2) + s1;
+    const laneWord r = (m << 7) | (m >> 57);
+    const laneWord result = (r << 3) + r;
+    const laneWord t = s1 << 17;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = (s3 << 45) | (s3 >> 19);
+    return result;
+}
+
+/**
+ * particle1d::step for width lanes at a time, with branches turned into masked selects
+ *
+ * A group of lanes stays in registers for steps steps, and lanes that stop partway through idle.
+ * Each lane draws from its own xoshiro256ss state in the same order as particle1d, so a lane
+ * walks exactly like particle1d<xoshiro256ss> does
+ */
+template<int width, int steps>
+int stepLanes( batchWalker::lanes &L, const batchWalker::constants &c, const int n )
+{
+    typedef typename laneTypes<width>::real laneReal;
+    typedef typename laneTypes<width>::integer laneInt;
+    typedef typename laneTypes<width>::word laneWord;
+
+    const laneInt zero = {};
+    const laneInt windowStatus = zero + static_cast<int64_t>( particleStatus::window );
+    const laneInt sourceStatus = zero + static_cast<int64_t>( particleStatus::source );
+    const laneInt cellStatus = zero + static_cast<int64_t>( particleStatus::cell );
+    const laneInt pipeStatus = zero + static_cast<int64_t>( particleStatus::pipe );
+    const laneInt fullBuffer = zero + 64;
+    const laneInt cellExitThreshold = zero + static_cast<int64_t>( c.cellExitThreshold );
+    const laneInt changeMfp = zero - static_cast<int64_t>( c.changeMfp );
+    const laneReal fillTime = laneReal{} + c.fillTime;
+    const laneReal stepSize2 = laneReal{} + c.stepSize2;
+    const double exitSide = c.sourceLeftCellRight ? -1. : 1.;      // Side of the cell the pipe is on
+
+    int stopped = 0;
+    for (int l = 0; l < n; l += width)
+    {
+        laneReal location = load<laneReal>( L.location + l );
+        laneReal t = load<laneReal>( L.t + l );
+        laneReal dt = load<laneReal>( L.dt + l );
+        laneReal mfp = load<laneReal>( L.mfp + l );
+        const laneReal exitDt = load<laneReal>( L.exitDt + l );
+        const laneReal cellExitLifetime = load<laneReal>( L.cellExitLifetime + l );
+        laneInt cellThreshold = load<laneInt>( L.cellThreshold + l );
+        laneWord s0 = load<laneWord>( L.s0 + l ), s1 = load<laneWord>( L.s1 + l );
+        laneWord s2 = load<laneWord>( L.s2 + l ), s3 = load<laneWord>( L.s3 + l );
+        laneWord bits = load<laneWord>( L.bits + l );
+        laneInt bitsLeft = load<laneInt>( L.bitsLeft + l );
+        laneInt status = load<laneInt>( L.status + l );
+        laneInt totalSteps = load<laneInt>( L.totalSteps + l );
+        laneInt windowHits = load<laneInt>( L.windowHits + l );
+        laneInt cellRejections = load<laneInt>( L.cellRejections + l );
+        laneInt cellExits = load<laneInt>( L.cellExits + l );
+        laneInt pipeSteps = load<laneInt>( L.pipeSteps + l );
+
+        for (int k = 0; k < steps; k++)
+        {
+            const laneInt active = (status == ALIVE) & (t < fillTime);
+
+            // Direction bit. The buffer is never empty here, since it is refilled at the end of a step
+            const laneInt down = (bits & 1) != 0;
+            bits = active ? bits >> 1 : bits;
+            bitsLeft += active;
+
+            const laneReal prev = location;
+            const laneReal moved = down ? prev - mfp : prev + mfp;
+            const laneReal stepped = t + dt;
+
+            // Collisions, in the order of particle1d::step. totalSteps has not counted this step yet
+            const laneInt crossed = (totalSteps > 0) & (((prev < c.window) & (c.window < moved)) |
+                                                        ((prev > c.window) & (c.window > moved)) | (moved == c.window));
+            const laneInt atSource = c.sourceLeftCellRight ? (moved <= c.source) : (moved >= c.source);
+            const laneInt atCell = c.sourceLeftCellRight ? (moved >= c.cell) : (moved <= c.cell);
+            const laneInt isWindow = active & crossed;
+            const laneInt isSource = active & ~crossed & atSource;
+            const laneInt isCell = active & ~crossed & ~atSource & atCell;
+            const laneInt isPipe = active & ~crossed & ~atSource & ~atCell;
+
+            // Every check but the source draws once
+            const laneInt draw = isWindow | isCell | isPipe;
+            laneWord d0 = s0, d1 = s1, d2 = s2, d3 = s3;
+            const laneInt u = (laneInt)( xoshiroNext( d0, d1, d2, d3 ) >> 11 );
+            s0 = draw ? d0 : s0;
+            s1 = draw ? d1 : s1;
+            s2 = draw ? d2 : s2;
+            s3 = draw ? d3 : s3;
+            const laneInt hit = (isWindow & (u < static_cast<int64_t>( c.windowLossThreshold ))) |
+                                (isCell & (u < cellThreshold)) |
+                                (isPipe & (u < static_cast<int64_t>( c.lossPerStepThreshold )));
+
+            // Cell entrance: stays until fillTime, exits back into the pipe or is rejected
+            const laneInt entered = isCell & hit;
+            const laneInt stays = entered & ((fillTime - stepped) < cellExitLifetime);
+            const laneInt exits = entered & ~stays;
+            const laneInt rejected = isCell & ~hit;
+            const laneInt newMfp = exits & changeMfp;
+
+            const laneReal exitLocation = c.cell + exitSide * (newMfp ? stepSize2 : mfp);
+            location = active ? moved : location;
+            location = exits ? exitLocation : location;
+            location = rejected ? prev : location;
+            t = active ? stepped : t;
+            t = exits ? stepped + cellExitLifetime : t;
+            t = rejected ? stepped + dt : t;
+            t = stays ? fillTime : t;
+            totalSteps -= active;
+            totalSteps -= exits | rejected;
+
+            status = (isWindow & hit) ? windowStatus : status;
+            status = isSource ? sourceStatus : status;
+            status = stays ? cellStatus : status;
+            status = (isPipe & hit) ? pipeStatus : status;
+            windowHits -= isWindow;
+            cellExits -= exits;
+            cellRejections -= rejected;
+            pipeSteps -= isPipe;
+            mfp = newMfp ? stepSize2 : mfp;
+            dt = newMfp ? exitDt : dt;
+            cellThreshold = newMfp ? cellExitThreshold : cellThreshold;
+
+            // The next step's direction bits come right after this step's draw, as in particle1d.
+            // Lanes that just stopped may take one draw more, which nothing reads
+            const laneInt refill = active & (bitsLeft == 0);
+            laneWord r0 = s0, r1 = s1, r2 = s2, r3 = s3;
+            const laneWord fresh = xoshiroNext( r0, r1, r2, r3 );
+            s0 = refill ? r0 : s0;
+            s1 = refill ? r1 : s1;
+            s2 = refill ? r2 : s2;
+            s3 = refill ? r3 : s3;
+            bits = refill ? fresh : bits;
+            bitsLeft = refill ? fullBuffer : bitsLeft;
+        }
+
+        store( L.location + l, location );
+        store( L.t + l, t );
+        store( L.dt + l, dt );
+        store( L.mfp + l, mfp );
+        store( L.cellThreshold + l, cellThreshold );
+        store( L.s0 + l, s0 );
+        store( L.s1 + l, s1 );
+        store( L.s2 + l, s2 );
+        store( L.s3 + l, s3 );
+        store( L.bits + l, bits );
+        store( L.bitsLeft + l, bitsLeft );
+        store( L.status + l, status );
+        store( L.totalSteps + l, totalSteps );
+        store( L.windowHits + l, windowHits );
+        store( L.cellRejections + l, cellRejections );
+        store( L.cellExits + l, cellExits );
+        store( L.pipeSteps + l, pipeSteps );
+
+        const laneInt walking = (status == ALIVE) & (t < fillTime);
+        for (int i = 0; i < width; i++) stopped += walking[i] ? 0 : 1;
+    }
+    return stopped;
+}
+
+}
+
+#endif
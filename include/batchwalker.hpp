@@ -0,0 +1,90 @@
+#ifndef BATCHWALKER
+#define BATCHWALKER
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <mc.hpp>
+#include <spectrum.hpp>
+#include <particle1d.hpp>
+
+const int BATCH_LANES = 64;         // Particles in flight in one batchWalker
+const int BATCH_VECTOR = 8;         // Live lanes are stepped in multiples of this many
+
+/**
+ * Structure-of-arrays version of particle1d<xoshiro256ss>
+ *
+ * Keeps BATCH_LANES particles in flight, with every field in its own array, and steps all live lanes
+ * together in a branch-free AVX-512 kernel (batchkernel.hpp). On CPUs without AVX-512 particles are
+ * walked one at a time by particle1d instead.
+ * Finished lanes are written out and compacted away, and new particles refill them.
+ * Each lane draws from its own particle's stream in the same order as particle1d, so end states
+ * match --engine step exactly
+ */
+class batchWalker {
+public:
+    batchWalker( std::map<std::string, double> p, std::shared_ptr<const velocitySpectrum> spectrum );
+
+    // End states of particles [first, last) of a run with this seed, in particle order
+    void walk( uint64_t seed, int first, int last, std::vector<particleState> &states );
+
+    // Run constants used by the step kernel
+    struct constants
+    {
+        double window, cell, source;
+        double fillTime;
+        double stepSize2;
+        bool sourceLeftCellRight;
+        bool changeMfp;                 // Whether mfp changes to stepSize2 after a cell exit
+        uint64_t windowLossThreshold, lossPerStepThreshold;
+        uint64_t cellExitThreshold;     // Cell entrance threshold after a cell exit that changes mfp
+    };
+
+    // Particles in flight. Every field the kernel reads is 64 bits wide so it works on one vector width
+    struct lanes
+    {
+        alignas(64) double location[BATCH_LANES];
+        alignas(64) double t[BATCH_LANES];
+        alignas(64) double dt[BATCH_LANES];
+        alignas(64) double exitDt[BATCH_LANES];         // dt after a cell exit that changes mfp
+        alignas(64) double mfp[BATCH_LANES];
+        alignas(64) double v[BATCH_LANES];
+        alignas(64) double cellExitLifetime[BATCH_LANES];
+        alignas(64) int64_t cellThreshold[BATCH_LANES];
+        alignas(64) uint64_t s0[BATCH_LANES];           // xoshiro256ss state
+        alignas(64) uint64_t s1[BATCH_LANES];
+        alignas(64) uint64_t s2[BATCH_LANES];
+        alignas(64) uint64_t s3[BATCH_LANES];
+        alignas(64) uint64_t bits[BATCH_LANES];         // Buffered direction bits
+        alignas(64) int64_t bitsLeft[BATCH_LANES];
+        alignas(64) int64_t status[BATCH_LANES];        // particleStatus
+        alignas(64) int64_t windowHits[BATCH_LANES];
+        alignas(64) int64_t totalSteps[BATCH_LANES];
+        alignas(64) int64_t cellRejections[BATCH_LANES];
+        alignas(64) int64_t cellExits[BATCH_LANES];
+        alignas(64) int64_t pipeSteps[BATCH_LANES];
+        int particleNum[BATCH_LANES];
+        double tstart[BATCH_LANES];
+    };
+
+    typedef int (*stepKernel)( lanes &L, const constants &c, const int n );
+
+private:
+    const std::map<std::string, double> params;
+    constants c;
+    std::shared_ptr<const velocitySpectrum> spectrum;
+    const stepKernel kernel;                // nullptr when the CPU has no vector instruction set to use
+    const double start;
+    const double stepSize;
+    const uint64_t cellThreshold;
+    std::unique_ptr<char[]> storage;        // Holds lane, aligned by hand since new ignores alignas before C++17
+    lanes *lane;
+
+    void fill( int l, uint64_t seed, int particleNum );     // Start particle particleNum in lane l
+    void move( int from, int to );                          // Copy lane from to lane to
+    particleState state( int l ) const;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef BEAMLINE
+#define BEAMLINE
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <mc.hpp>
+#include <spectrum.hpp>
+#include <particle1d.hpp>
+
+const size_t MAX_BEAMLINE_BUCKETS = 1 << 22;   // Largest lookup table a beamline compiles to
+
+// What a neutron meets at a point of the beamline
+enum class componentType : uint8_t
+{
+    section,    // Start or end of a pipe section, nothing but a change of mfp and loss
+    source,     // Absorbs
+    window,     // Counts a hit and loses the neutron with some chance
+    cell,       // Lets the neutron in with some chance and reflects it otherwise
+    valve       // Closed, reflects
+};
+
+// Component of a beamline file. chance is the window loss or cell entrance chance, NaN for the run's value
+struct beamlineComponent
+{
+    componentType type;
+    double position;
+    double chance;
+};
+
+// Stretch of pipe with its own nonspecular fraction and loss per bounce
+struct pipeSection
+{
+    double from, to;
+    double nonspec;
+    double lossPerBounce;
+};
+
+// Beamline as given in a geometry file
+struct beamlineLayout
+{
+    double start;                               // Where neutrons start
+    std::vector<beamlineComponent> components;  // In order of position
+    std::vector<pipeSection> sections;          // Pipe outside them takes the run's ns and lpb
+    std::string text;                           // The file as read, recorded with the run
+};
+
+/**
+ * Read a geometry file
+ *
+ * One component per line, with # starting a comment:
+ *   start x                  where neutrons start
+ *   source x                 absorbs
+ *   window x [loss]          single pass loss chance (default --wl)
+ *   cell x [chance]          entrance chance (default from the mfp of the pipe next to it)
+ *   valve x                  closed valve, reflects
+ *   pipe from to ns lpb      section of pipe with its own nonspecular fraction and loss per bounce
+ */
+beamlineLayout readBeamline( const std::string &path );
+
+/**
+ * Beamline compiled for one point of a run
+ *
+ * Component positions and section ends are boundaries, and the pipe between two boundaries is a
+ * region with its own mfp and losses. A flat table of buckets narrower than the gap between any two
+ * boundaries maps a position to its region with one load and one comparison, however many
+ * components there are. Boundaries are further apart than any mfp, so a step crosses at most one
+ */
+class beamline {
+public:
+    beamline( const beamlineLayout &layout, std::map<std::string, double> params );
+
+    // Pipe between boundaries[i-1] and boundaries[i]
+    struct region
+    {
+        double mfp;
+        uint64_t lossPerStepThreshold;
+    };
+
+    // Component between regions i and i+1
+    struct boundary
+    {
+        componentType type;
+        double position;
+        uint64_t threshold[2];          // Window loss or cell entrance from below and from above, as bernoulliThresholds
+    };
+
+    // Region a position is in. A position on a boundary is in the region above it
+    int regionOf( const double x ) const
+    {
+        const bucket &b = buckets[static_cast<size_t>( (x - origin) * scale )];
+        return (x < b.split) ? b.below : b.above;
+    }
+
+    std::vector<region> regions;        // regions.front() and regions.back() lie outside the beamline
+    std::vector<boundary> boundaries;
+    double start;
+    uint64_t cellExitThreshold;         // Cell entrance after a cell exit that changes mfp to stepSize2
+
+private:
+    struct bucket
+    {
+        double split;                   // Boundary in the bucket, infinity if none
+        int below, above;               // Regions on either side of split
+    };
+
+    double origin;                      // Position of the first bucket
+    double scale;                       // Buckets per meter
+    std::vector<bucket> buckets;
+};
+
+/**
+ * particle1d on a compiled beamline
+ *
+ * Takes the same steps with the same draws as particle1d. Each step looks up the region it lands in,
+ * and only a change of region means a component was reached
+ */
+template<typename generator>
+class beamlineWalker {
+public:
+    beamlineWalker( double startTime, const velocityBin &startVelocity, std::map<std::string, double> p,
+                    std::shared_ptr<const beamline> geometry );
+    void resetState( double startTime, const velocityBin &startVelocity, int num = 0 );
+    particleState getState() const;
+    void walk( randomStream<generator> &mc );
+    void setLossTally( lossTally *t );   // Report window hits to t (nullptr to stop)
+
+private:
+    int particleNum;
+    double t, v, location, prevLocation, tstart, mfp;
+    double dt;                          // Time per step, mfp / v
+    double cellExitLifetime;            // Lifetime for a neutron at velocity v to exit the precession cell
+    int region;                         // Region the neutron is in
+    uint64_t lossPerStepThreshold;      // Pipe loss of region
+    bool exitedCell;                    // Whether mfp is stepSize2 after a cell exit
+    particleStatus status;
+    int cellRejections, windowHits, totalSteps, cellExits;
+    int pipeSteps;                      // Steps that drew for pipe loss
+    lossTally *tally;
+
+    const std::shared_ptr<const beamline> geometry;
+    const double stepSize2;             // 1D walk step size after exiting from cell
+    const double fillTime;              // Source active time
+    const bool exponentialDwell;        // Cell dwell times drawn from an exponential of mean cellExitLifetime
+
+    void step( randomStream<generator> &mc );               // Takes a 1D step
+    void cross( int next, randomStream<generator> &mc );    // Handles the component between region and next
+    void enter( int next );                                 // Moves into region next
+    void pipeDraw( randomStream<generator> &mc );           // One draw for pipe loss
+};
+
+#endif
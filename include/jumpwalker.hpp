@@ -0,0 +1,107 @@
+#ifndef JUMPWALKER
+#define JUMPWALKER
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <mc.hpp>
+#include <spectrum.hpp>
+#include <particle1d.hpp>
+
+/**
+ * Exact first-passage distributions of a symmetric walk on L interior sites
+ *
+ * Sites are numbered 1..L, with exits at 0 (bottom) and L+1 (top). Tables cover walks of up to
+ * nmax steps, and are shared between walkers through firstPassage()
+ */
+struct firstPassageTable
+{
+    firstPassageTable( int L, int nmax );
+
+    const int L;
+    const int nmax;
+    std::vector<double> exitCdf;        // [(i-1)*(nmax+1) + n] chance to exit within n steps starting from site i
+    std::vector<double> topChance;      // [(i-1)*(nmax+1) + n] chance an exit at step n is through the top
+    std::vector<double> mode;           // [(k-1)*L + (y-1)] eigenvector k of the walk at site y
+    std::vector<double> eigenvalue;     // [k-1] eigenvalue of mode k
+
+    // Chance to be at each site after m steps without exiting, starting from site i
+    void survivingSites( int i, long long m, std::vector<double> &weights ) const;
+};
+
+// Cached table for an interval of L sites covering at least nmax steps
+std::shared_ptr<const firstPassageTable> firstPassage( int L, int nmax );
+
+/**
+ * Event-jump version of particle1d
+ *
+ * Walks the same lattice as particle1d::step, but between the source, window and cell it samples
+ * which boundary is reached, after how many steps and whether pipe loss happened on the way
+ * from exact first-passage distributions, instead of taking every step
+ */
+template<typename generator>
+class jumpWalker {
+public:
+    jumpWalker( double startTime, const velocityBin &startVelocity, std::map<std::string, double> p );
+    void resetState( double startTime, const velocityBin &startVelocity, int num = 0 );
+    particleState getState() const;
+    void walk( randomStream<generator> &mc );
+    void setLossTally( lossTally *t );   // Report window hits to t (nullptr to stop)
+
+private:
+    // Sites between source, window and cell for one step size, in units of steps from origin
+    // and oriented so the source is below the cell
+    struct lattice
+    {
+        double origin;
+        double mfp;
+        int sourceSite;                 // Sites at or below this are absorbed by the source
+        int cellSite;                   // Sites at or above this reach the cell
+        double windowSite;              // Window position, not necessarily on a site
+        int count;                      // Number of intervals
+        int lo[2], hi[2];               // Event-free intervals of sites
+        std::shared_ptr<const firstPassageTable> table[2];
+    };
+
+    int particleNum;
+    double t, v, tstart, dt;
+    int site;
+    const lattice *grid;
+    double cellExitLifetime;            // Lifetime for a neutron at velocity v to exit the precession cell
+    uint64_t cellEntranceThreshold;     // Chance for the neutron to enter the cell, as a bernoulliThreshold
+    particleStatus status;
+    int direction;                      // +1 if the source is left of the cell, -1 otherwise
+    int cellRejections, windowHits, totalSteps, cellExits;
+    int pipeSteps;                      // Steps that drew for pipe loss
+    long long pipeBudget;               // Pipe loss draws survived before the next loss
+    lossTally *tally;
+    std::vector<double> weights;        // Scratch space for sampling surviving sites
+    lattice initial, afterExit;
+
+    const double start;                  // Neutron start location
+    const double window;                 // location of window
+    const double cell;                   // location of cell
+    const double source;                 // location of source
+    const double cellChance;             // Chance for particle to enter cell
+    const double lossPerStep;            // Loss per random walk step
+    const double windowLoss;             // Single pass chance of window loss
+    const double stepSize;               // 1D walk step size
+    const double stepSize2;              // 1D walk step size after exiting from cell
+    const double fillTime;               // Source active time
+    const bool exponentialDwell;         // Cell dwell times drawn from an exponential of mean cellExitLifetime
+
+    const uint64_t cellThreshold;        // bernoulliThreshold of cellChance
+    const uint64_t cellExitThreshold;    // bernoulliThreshold of the cell entrance chance at stepSize2
+    const uint64_t windowLossThreshold;  // bernoulliThreshold of windowLoss
+
+    lattice makeLattice( double origin, double mfp, double velocity ) const;
+    void step( randomStream<generator> &mc );       // Takes a single 1D step
+    void jump( randomStream<generator> &mc, int interval );    // Walks until the walker leaves an interval, is lost or runs out of time
+    void arrive( int from, randomStream<generator> &mc );      // Applies what happens on arriving at site from a neighbour
+    void pipeDraw();                                // One draw for pipe loss
+    long long samplePipeBudget( randomStream<generator> &mc );
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef MARKOV
+#define MARKOV
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <spectrum.hpp>
+#include <threadpool.hpp>
+
+const int MARKOV_HIT_LEVELS = 32;               // Window hit counts a lattice keeps at first, widened as needed
+const double NEGLIGIBLE_CHANCE = 1e-15;         // Chance on the highest window hit count that is dropped
+const size_t MARKOV_CHUNK_CHANCES = 16384;      // Site and window hit chances per pool task in a step
+
+// Expected outcome of a run
+struct markovResult
+{
+    double source = 0, pipe = 0, window = 0, cell = 0;     // Fraction of particles ending in each status
+    std::vector<double> cellWindowHits;                     // Fraction of particles that reach the cell with h window hits
+
+    double alive() const;
+    double meanCellWindowHits() const;                      // Mean windowHits of particles that reach the cell
+    void add( const markovResult &other, double weight );
+};
+
+struct markovLattice;
+
+/**
+ * Master equation for the walk of particle1d (--engine markov)
+ *
+ * Every step moves a neutron one site along a lattice of spacing mfp, so rather than walking
+ * particles, the chance of being on each site with each number of window hits is carried forward
+ * one step at a time under the rules of particle1d::step. After a cell exit the walk goes on along
+ * a lattice that starts at the cell, with stepSize2 if it is set. Losses in a step are weighted by
+ * the chance that a start time uniform in [0, fillTime] leaves time for the step, which averages over
+ * tstart exactly. The walk after a cell exit does not depend on when the exit happened, so it is solved
+ * once per velocity and combined with every exit time from running sums.
+ * Window hit counts are only kept up to the highest with a chance of NEGLIGIBLE_CHANCE or more, so the
+ * chance dropped is at most that per step. Velocity bins are solved as separate tasks, and the steps of
+ * large lattices are split into chunks of sites across the pool
+ */
+class markovSolver {
+public:
+    markovSolver( std::map<std::string, double> params, std::shared_ptr<const velocitySpectrum> spectrum );
+    void schedule( workStealingPool &pool );    // Submit a task per velocity bin, which splits its steps across the pool
+    markovResult result() const;                // Once the tasks have finished
+
+private:
+    std::map<std::string, double> params;
+    std::shared_ptr<const velocitySpectrum> spectrum;
+    std::shared_ptr<const markovLattice> first;         // Sites from the start
+    std::shared_ptr<const markovLattice> afterExit;     // Sites from the cell, after a cell exit
+    std::vector<markovResult> bins;                     // Result of each velocity bin
+
+    markovResult solve( const velocityBin &bin, workStealingPool &pool ) const;
+};
+
+#endif
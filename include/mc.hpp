@@ -2,33 +2,226 @@
 #define MC_H_
 
 #include <random>
+#include <cmath>
+#include <string>
+#include <cstdint>
 
-typedef std::mt19937_64 TMCGenerator; ///< typedef to default random-number generator
+// v^2 distribution
+double v2Spectrum(const double v);
+
+// v^3 distribution
+double v3Spectrum(const double v);
+
+// splitmix64 finalizer, a bijection on 64-bit integers
+inline uint64_t splitmix64(uint64_t x){
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// xoshiro256** (Blackman and Vigna), 256 bits of state
+class xoshiro256ss {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT64_MAX; }
+
+	explicit xoshiro256ss(uint64_t value = 0) { seed(value); }
+
+	// State is filled from a splitmix64 sequence, so it is never all zero
+	void seed(uint64_t value){
+		for (int i = 0; i < 4; i++) s[i] = splitmix64(value + i * 0x9e3779b97f4a7c15ULL);
+	}
+
+	result_type operator()() { return next(s[0], s[1], s[2], s[3]); }
+
+	const uint64_t *state() const { return s; }
+
+	// One step on a state held elsewhere, for walkers that keep the state of many streams in arrays
+	static uint64_t next(uint64_t &s0, uint64_t &s1, uint64_t &s2, uint64_t &s3){
+		const uint64_t result = rotl(s1 * 5, 7) * 9;
+		const uint64_t t = s1 << 17;
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = rotl(s3, 45);
+		return result;
+	}
+
+private:
+	uint64_t s[4];
+	static uint64_t rotl(const uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+// Philox4x32-10 (Salmon et al.), counter based: each block of four words is a keyed hash of a counter
+class philox4x32 {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT64_MAX; }
+
+	explicit philox4x32(uint64_t value = 0) { seed(value); }
+
+	void seed(uint64_t value){
+		key[0] = static_cast<uint32_t>(value);
+		key[1] = static_cast<uint32_t>(value >> 32);
+		counter = 0;
+		index = 4;
+	}
+
+	result_type operator()(){
+		if (index >= 4) generate();
+		const uint64_t result = (static_cast<uint64_t>(block[index]) << 32) | block[index + 1];
+		index += 2;
+		return result;
+	}
+
+private:
+	uint32_t key[2];
+	uint64_t counter;
+	uint32_t block[4];
+	int index;                  // Next unused word of block
+
+	void generate(){
+		uint32_t c[4] = { static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), 0, 0 };
+		uint32_t k[2] = { key[0], key[1] };
+		for (int round = 0; round < 10; round++)
+		{
+			const uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * c[0];
+			const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * c[2];
+			const uint32_t next[4] = { static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1),
+			                           static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0) };
+			for (int i = 0; i < 4; i++) c[i] = next[i];
+			k[0] += 0x9E3779B9;
+			k[1] += 0xBB67AE85;
+		}
+		for (int i = 0; i < 4; i++) block[i] = c[i];
+		counter++;
+		index = 0;
+	}
+};
+
+// Generators a walk can use
+enum class generatorType { mt19937_64, xoshiro256ss, philox4x32 };
+
+// Parse a generator name given on the command line
+generatorType parseGenerator(const std::string &name);
+
+const double UNIT_53 = 1. / 9007199254740992.;     // 2^-53
 
 /**
- * Create a piecewise linear distribution from a function with single parameter
+ * Threshold for randomStream::bernoulli
  *
- * @param f Function returning a double using a single double parameter
- * @param range_min Lower range limit of distribution
- * @param range_max Upper range limit of distribution
+ * @param p Chance of success
  *
- * @return Return piecewise linear distribution
+ * @return ceil(p * 2^53), clamped to [0, 2^53], so bernoulli() succeeds exactly when a
+ *         53 bit uniform k * 2^-53 is below p
  */
-template<typename UnaryFunction>
-std::piecewise_linear_distribution<double> parse_distribution(UnaryFunction f, const double range_min, const double range_max);
+uint64_t bernoulliThreshold(const double p);
 
-// v^2 distribution
-double v2Spectrum(const double v);
+const int ZIGGURAT_LAYERS = 256;
+const double ZIGGURAT_EXP_R = 7.69711747013104972;     // Start of the tail of the unit exponential ziggurat
 
-// v^3 distribution
-double v3Spectrum(const double v);
+/**
+ * Ziggurat of the unit exponential density e^-x (Marsaglia and Tsang)
+ *
+ * Layer i > 0 spans [0, x[i]) under the density f[i] = e^-x[i]. Layer 0 is the rectangle under
+ * e^-R up to R = x[1] together with the tail beyond it, spread over a width x[0] of the same area
+ */
+struct exponentialZiggurat
+{
+	double x[ZIGGURAT_LAYERS + 1];
+	double f[ZIGGURAT_LAYERS + 1];
+};
+extern const exponentialZiggurat EXP_ZIGGURAT;
+
+/**
+ * A generator with a buffer of unused random bits
+ *
+ * Direction bits are taken 64 at a time from one generator output, and Bernoulli checks compare
+ * 53 bit integers against precomputed thresholds instead of drawing doubles
+ */
+template<typename generator>
+class randomStream {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT64_MAX; }
+
+	/**
+	 * Start the random stream belonging to a single particle
+	 *
+	 * The stream depends only on (seed, particleNum), so a particle walks identically
+	 * no matter which thread simulates it. Buffered bits are dropped
+	 *
+	 * @param seed Run seed
+	 * @param particleNum Index of the particle
+	 */
+	void seed(const uint64_t seed, const uint64_t particleNum){
+		mc.seed( splitmix64( seed ^ splitmix64(particleNum) ) );
+		bitsLeft = 0;
+	}
+
+	result_type operator()() { return draw(); }
+
+	// Generator behind the stream, for walkers that take over a stream before any bit() draw
+	const generator &source() const { return mc; }
+
+	// One random bit
+	int bit(){
+		if (bitsLeft == 0)
+		{
+			bits = draw();
+			bitsLeft = 64;
+		}
+		const int b = bits & 1;
+		bits >>= 1;
+		bitsLeft--;
+		return b;
+	}
+
+	// Uniform on [0, 1) with 53 random bits
+	double uniform() { return (draw() >> 11) * UNIT_53; }
+
+	// True with the chance given to bernoulliThreshold()
+	bool bernoulli(const uint64_t threshold) { return (draw() >> 11) < threshold; }
 
-extern std::piecewise_linear_distribution<double> v2_distribution;
+	/**
+	 * Unit exponential, with the ziggurat method
+	 *
+	 * The low 8 bits of a draw pick a layer and its high 53 bits a point across it. About 99% of
+	 * points lie inside the layer below, which costs one draw and no log or exp
+	 */
+	double exponential(){
+		while (true)
+		{
+			const uint64_t r = draw();
+			const int i = r & (ZIGGURAT_LAYERS - 1);
+			const double x = (r >> 11) * UNIT_53 * EXP_ZIGGURAT.x[i];
+			if (x < EXP_ZIGGURAT.x[i + 1]) return x;
+			if (i == 0) return ZIGGURAT_EXP_R - std::log( 1 - uniform() );     // The tail is e^-x shifted to R
+			if (EXP_ZIGGURAT.f[i] + (EXP_ZIGGURAT.f[i + 1] - EXP_ZIGGURAT.f[i]) * uniform() < std::exp( -x )) return x;
+		}
+	}
 
-extern std::piecewise_linear_distribution<double> v3_distribution;
+	// Generator outputs drawn so far, counted only in builds with RANDOMWALK_METRICS
+	uint64_t draws() const { return drawn; }
 
-extern std::uniform_int_distribution<int> zeroOrOne;
+private:
+	generator mc;
+	uint64_t bits = 0;
+	int bitsLeft = 0;
+	uint64_t drawn = 0;
 
-extern std::uniform_real_distribution<double> zeroToOne;
+	result_type draw(){
+#ifdef RANDOMWALK_METRICS
+		drawn++;
+#endif
+		return mc();
+	}
+};
 
 #endif /*MC_H_*/
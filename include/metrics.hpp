@@ -0,0 +1,140 @@
+#ifndef METRICS
+#define METRICS
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <particle1d.hpp>
+
+const int CACHE_LINE = 64;                  // [bytes]
+
+// Run time spent on each phase
+enum class metricsPhase { walk, output };
+
+// Totals of the counters of one thread, or of all of them
+struct metricsTotals
+{
+    uint64_t particles[STATUS_COUNT];       // Particles finished, by particleStatus
+    uint64_t steps, cellRejections, cellExits;
+    uint64_t draws;                         // Generator outputs drawn through randomStream
+    uint64_t nanos[2];                      // Time spent in each metricsPhase [ns]
+
+    uint64_t finished() const;
+    void add( const metricsTotals &other );
+};
+
+#ifdef RANDOMWALK_METRICS
+
+/**
+ * Counters of one thread
+ *
+ * Only the owning thread writes them, with plain relaxed stores, and the reporter reads them with
+ * relaxed loads. Padding keeps the counters of different threads on different cache lines
+ */
+struct threadCounters
+{
+    char before[CACHE_LINE];
+    std::atomic<uint64_t> particles[STATUS_COUNT];
+    std::atomic<uint64_t> steps, cellRejections, cellExits, draws;
+    std::atomic<uint64_t> nanos[2];
+    char after[CACHE_LINE];
+
+    void add( std::atomic<uint64_t> &counter, uint64_t value )
+    {
+        counter.store( counter.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
+    }
+    metricsTotals read() const;
+};
+
+threadCounters &localCounters();                    // Counters of the calling thread, made on first use
+std::vector<metricsTotals> readCounters();          // Counters of every thread that has counted anything
+
+// Counts finished particles
+inline void countParticles( const std::vector<particleState> &block )
+{
+    threadCounters &c = localCounters();
+    uint64_t particles[STATUS_COUNT] = {};
+    uint64_t steps = 0, cellRejections = 0, cellExits = 0;
+    for (auto const& s : block)
+    {
+        particles[static_cast<int>( s.status )]++;
+        steps += s.totalSteps;
+        cellRejections += s.cellRejections;
+        cellExits += s.cellExits;
+    }
+    for (int i = 0; i < STATUS_COUNT; i++) c.add( c.particles[i], particles[i] );
+    c.add( c.steps, steps );
+    c.add( c.cellRejections, cellRejections );
+    c.add( c.cellExits, cellExits );
+}
+
+inline void countDraws( uint64_t draws )
+{
+    threadCounters &c = localCounters();
+    c.add( c.draws, draws );
+}
+
+// Adds the time from construction to destruction to a phase of the calling thread
+class phaseTimer {
+public:
+    explicit phaseTimer( metricsPhase phase ) : phase( phase ), start( std::chrono::steady_clock::now() ) {}
+    ~phaseTimer()
+    {
+        threadCounters &c = localCounters();
+        c.add( c.nanos[static_cast<int>( phase )],
+               std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count() );
+    }
+
+private:
+    const metricsPhase phase;
+    const std::chrono::steady_clock::time_point start;
+};
+
+#else
+
+// Built without metrics, counting compiles to nothing
+inline void countParticles( const std::vector<particleState>& ) {}
+inline void countDraws( uint64_t ) {}
+class phaseTimer {
+public:
+    explicit phaseTimer( metricsPhase ) {}
+};
+inline std::vector<metricsTotals> readCounters() { return std::vector<metricsTotals>(); }
+
+#endif
+
+/**
+ * Thread that reports progress while particles are walked (--metrics)
+ *
+ * Every interval it prints throughput and an estimated time left, and rewrites a JSON file with the
+ * totals and per thread counters, so a job monitor can scrape it. The file is written to path.tmp
+ * and renamed, so readers never see half a file
+ */
+class metricsReporter {
+public:
+    metricsReporter( std::string path, double interval, long long expected );
+    ~metricsReporter();                     // Stops the thread and writes the file one last time
+    void expect( long long particles );     // Particles the run is now expected to walk
+    void stop();
+
+private:
+    const std::string path;
+    const std::chrono::duration<double> interval;
+    const std::chrono::steady_clock::time_point start;
+    std::atomic<long long> expected;
+    uint64_t baseline;                      // Particles finished before the reporter started
+    std::mutex mtx;
+    std::condition_variable stopping;
+    bool stopped;
+    std::thread reporter;
+
+    void run();
+    void report( bool last );
+};
+
+#endif
@@ -8,10 +8,49 @@
 #include <vector>
 #include <cstring>
 #include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+#include <particle1d.hpp>
 
-const hsize_t NFIELDS = 10; // Change this when adding or removing columns from hdfOutputFormat
-const int COMPRESSION = 0;
+const hsize_t NFIELDS = 11; // Change this when adding or removing columns from hdfOutputFormat
+const int COMPRESSION = 0;  // Default deflate level (0 = off)
+const hsize_t CHUNK_RECORDS = 4096;          // Records per HDF5 chunk
+const size_t WRITE_BUFFER_RECORDS = 65536;   // Records per buffer handed to the writer thread
 const int CHAR_COUNT = 16; // number of characters allowed for status field
+const int COLUMN_COMPRESSION = 4;            // Default deflate level of columnar tables
+const hsize_t COLUMN_CHUNK_RECORDS = 8192;  // Values per HDF5 chunk of a column
+const H5Z_filter_t LZ4_FILTER = 32004;       // Registered id of the HDF5 LZ4 filter plugin
+
+// How the end states of a run are stored (--layout)
+enum class tableLayout
+{
+    rows,       // One compound table, which PyTables reads as a Table
+    columnar    // A group with one compressed dataset per field
+};
+
+// Parse a layout name given on the command line
+tableLayout parseLayout( const std::string &name );
+
+// Field types of complete tables written by hdfFile::writeTable. The HDF5 types are built
+// under the library lock, so callers need no HDF5 type API
+enum class fieldType
+{
+    integer,    // long long
+    real,       // double
+    text        // char[CHAR_COUNT]
+};
+
+// Storage of a columnar table
+struct columnFormat
+{
+    int compression;            // Deflate level (0 = off), unless lz4
+    bool lz4;                   // LZ4 filter plugin instead of deflate
+    long long maxCount;         // Largest value windowHits, totalSteps and the other counters can take, which picks their type
+};
 
 struct hdfOutputFormat
 {
@@ -22,30 +61,146 @@ struct hdfOutputFormat
      char   status[CHAR_COUNT];
      int    cellRejections;
      int    cellExits;
+     int    pipeSteps;
      double velocity;
      double tstart;
      double tend;
      double mfp;
 
+     hdfOutputFormat () {}
+
      hdfOutputFormat (  int pn, int wh, int ts, double loc,
-                        std::string stringStatus, int cr,
-                        int ce, double v, double tstart, double tend)
+                        const char* stringStatus, int cr,
+                        int ce, int ps, double v, double tstart, double tend)
                         : particleNum(pn), windowHits(wh), totalSteps(ts), location(loc),
-                        cellRejections(cr), cellExits(ce), velocity(v), tstart(tstart), tend(tend)
+                        cellRejections(cr), cellExits(ce), pipeSteps(ps), velocity(v), tstart(tstart), tend(tend)
         {
-            strncpy(status, stringStatus.c_str(), CHAR_COUNT); //need char[] for hdf c library to work
+            const size_t length = strnlen(stringStatus, CHAR_COUNT - 1);
+            std::memcpy(status, stringStatus, length); //need char[] for hdf c library to work
+            status[length] = '\0';
         }
 
+     explicit hdfOutputFormat ( const particleState &s )
+                        : hdfOutputFormat( s.particleNum, s.windowHits, s.totalSteps, s.location,
+                                           statusName(s.status), s.cellRejections, s.cellExits,
+                                           s.pipeSteps, s.velocity, s.tstart, s.tend ) {}
+
+};
+
+/**
+ * HDF5 output file with a dedicated writer thread
+ *
+ * Tables hand full record buffers to the writer thread, which appends them with
+ * H5TBappend_records and flushes the file. Buffers are double buffered: a table hands over
+ * a buffer only once the writer has finished the one before it, so simulation overlaps I/O,
+ * memory stays bounded and a crash loses at most the buffer being written plus the records
+ * each table has not handed over yet. Columnar tables are split into their columns on the
+ * writer thread too
+ */
+class hdfFile {
+public:
+    explicit hdfFile( std::string filename );
+    ~hdfFile();
+    void createGroup( std::string path, std::map<std::string, double> attributes );
+    void writeTable( std::string path, hsize_t nfields, hsize_t nrecords, size_t type_size,
+                     const char *field_names[], const size_t *field_offset, const fieldType *field_types,
+                     const void *data, std::map<std::string, double> attributes );    // Complete, non-appendable table
+    void writeArray( std::string path, const std::vector<long long> &data );          // 1D integer dataset
+    void writeArray( std::string path, const std::vector<double> &data );             // 1D floating point dataset
+    void setAttributes( std::string path, std::map<std::string, long long> attributes );
+    void setAttribute( std::string path, std::string name, uint64_t value );          // Unsigned, for seeds
+    void setAttribute( std::string path, std::string name, const std::string &value );   // Text, for geometry files
+    void close();                        // Writes queued records and closes the file. Rethrows writer errors
+
+private:
+    friend class hdfTableWriter;
+
+    struct pendingWrite {
+        std::string table;
+        bool columnar;
+        std::vector<hdfOutputFormat> records;
+    };
+
+    hid_t file_id;
+    std::deque<pendingWrite> queue;
+    std::mutex mtx;
+    std::condition_variable queueChanged;
+    bool closing;
+    std::exception_ptr error;
+    std::thread writer;
+
+    void push( const std::string &table, bool columnar, std::vector<hdfOutputFormat> &records );    // Hand a buffer to the writer thread once it is idle
+    void run();                                                                    // Writer thread loop
+};
+
+/**
+ * Appendable table of hdfOutputFormat records inside an hdfFile
+ *
+ * A columnar table is a group with one chunked, shuffled and compressed dataset per field. status
+ * is a one byte enum of particleStatus and the counters take the narrowest unsigned type holding
+ * maxCount. Within each buffer handed to the writer thread, rows are grouped by status in enum
+ * order, and row b of the blockStatusCounts dataset holds the rows of each status in buffer b,
+ * so readers can find the runs of one status and read only those
+ *
+ * append() must only be called from one thread at a time
+ */
+class hdfTableWriter {
+public:
+    hdfTableWriter( hdfFile &file, std::string path, std::map<std::string, double> attributes,
+                    int compression = COMPRESSION, bool shuffle = false,
+                    size_t bufferRecords = WRITE_BUFFER_RECORDS );
+    hdfTableWriter( hdfFile &file, std::string path, std::map<std::string, double> attributes,
+                    const columnFormat &format, size_t bufferRecords = WRITE_BUFFER_RECORDS );   // Columnar table
+    ~hdfTableWriter();
+    void append( const hdfOutputFormat &record );
+    void flush();                        // Hands buffered records to the writer thread
+
+private:
+    hdfFile &file;
+    std::string path;
+    bool columnar;
+    size_t bufferRecords;
+    std::vector<hdfOutputFormat> buffer;
+};
+
+/**
+ * HDF5 file opened read only, for merging the output of separate runs
+ *
+ * Safe to use while an hdfFile writer thread is running
+ */
+class hdfReader {
+public:
+    explicit hdfReader( std::string filename );
+    ~hdfReader();
+    hdfReader( const hdfReader& ) = delete;
+    hdfReader& operator=( const hdfReader& ) = delete;
+
+    const std::string filename;
+
+    bool exists( std::string path ) const;
+    std::map<std::string, double> doubleAttributes( std::string path ) const;       // Floating point attributes of an object
+    std::map<std::string, long long> integerAttributes( std::string path ) const;   // Signed integer attributes of an object
+    uint64_t unsignedAttribute( std::string path, std::string name ) const;
+    std::string textAttribute( std::string path, std::string name ) const;           // Empty if there is none
+    bool columnar( std::string path ) const;                                        // Whether a table is a columnar group
+    hsize_t records( std::string path ) const;                                      // Number of records in a table
+    void readTable( std::string path, size_t type_size, const size_t *field_offset, const size_t *field_sizes,
+                    void *data ) const;                                             // Every record of a table
+    void readRecords( std::string path, hsize_t start, std::vector<hdfOutputFormat> &records ) const;   // records.size() records from start
+    std::vector<long long> readArray( std::string path ) const;                    // Integer dataset, flattened
+
+private:
+    hid_t file_id;
 };
 
-void writeToHDF( std::string filename, std::vector<hdfOutputFormat> results , std::map<std::string, double> attributes);
+void writeToHDF( std::string filename, const std::vector<hdfOutputFormat> &results , std::map<std::string, double> attributes);
 
 // Print map to standard output
 template<typename K, typename V>
-void print_map(std::map<K,V> const &m)
+void print_map(std::map<K,V> const &m, std::ostream &out = std::cout)
 {
     for (auto it = m.cbegin(); it != m.cend(); ++it) {
-        std::cout << "{" << (*it).first << ": " << (*it).second << "}\n";
+        out << "{" << (*it).first << ": " << (*it).second << "}\n";
     }
 }
 
@@ -2,32 +2,86 @@
 #define PARTICLE1D
 
 #include <map>
-#include <boost/variant.hpp>
+#include <string>
+#include <cstdint>
 #include <mc.hpp>
+#include <spectrum.hpp>
 
 const double CELL_ENTRANCE_ID = 0.0745; // [meters]
+const double PIPE_ID = 3 * 0.0254;      // Inner diameter of the pipe [m]
+const double CELL_EXIT_NONSPEC = 0.05;  // Nonspecular fraction of the pipe after a cell exit
 const double CELL_VOLUME = 0.019635;    // [m^3]
 const double v2_average = 4.81342; // Average velocity of a v2 dv distribution up to 214 neV [m/s]
 const double v3_average = 5.13431; // Average velocity of a v2 dv distribution up to 214 neV [m/s]
 const double v2_average_SS = 4.44; // Average velocity of a v2 dv distribution up to 190 neV [m/s]
 const double v3_average_SS = 4.73; // Average velocity of a v3 dv distribution up to 190 neV [m/s]
 
+// Where a particle ended up
+enum class particleStatus : uint8_t { alive, source, pipe, window, cell };
+const int STATUS_COUNT = 5;             // Values of particleStatus
+
+// Name of a status as written to output files
+const char* statusName( particleStatus status );
+
+// Mean free path in the pipe for a nonspecular fraction. eq.  4.79, eq.  4.70, and eq.  4.48 in Golub
+double meanFreePath( const double nonspec );
+
+/**
+ * Chance for a neutron at the cell entrance to get into the cell
+ *
+ * @param mfp Mean free path in the pipe [m]
+ * @param nonspec Nonspecular fraction of the pipe
+ *
+ * @return Chance that the neutron reaches the entrance hole before it leaves the last mean free path
+ */
+double cellEntranceChance( const double mfp, const double nonspec );
+
+// End state of a single particle
+struct particleState
+{
+    int            particleNum;
+    int            windowHits;
+    int            totalSteps;
+    double         location;
+    particleStatus status;
+    int            cellRejections;
+    int            cellExits;
+    int            pipeSteps;
+    double         velocity;
+    double         tstart;
+    double         tend;
+};
+
+class lossTally;
+
+/**
+ * A neutron taking one mean free path step at a time
+ *
+ * Which side the source is on and whether mfp changes after a cell exit are fixed for a run, so
+ * walk() and step() are specialized on them, and the constructor picks the specialization once
+ */
+template<typename generator>
 class particle1d {
 public:
-    particle1d( double startTime, double startVelocity, std::map<std::string, double> p);
-    void resetState( double startTime, double startVelocity, int num = 0 );
-    std::map<std::string, boost::variant<double, int, std::string> > getState();
-    void walk( TMCGenerator &mc );
+    particle1d( double startTime, const velocityBin &startVelocity, std::map<std::string, double> p);
+    void resetState( double startTime, const velocityBin &startVelocity, int num = 0 );
+    particleState getState() const;
+    void walk( randomStream<generator> &mc ) { (this->*walker)( mc ); }
+    void walkToExit( randomStream<generator> &mc ) { (this->*prefixWalker)( mc ); }  // Walk until the first cell exit
+    void resumeFrom( const particle1d &prefix );  // Take over a walk stopped by walkToExit, going on with this stepSize2
     float getLocation();
+    void setLossTally( lossTally *t );   // Report window hits to t (nullptr to stop)
 
 private:
     int particleNum;
     double t, v, location, prevLocation, tstart, mfp;
+    double dt;                          // Time per step, mfp / v
     double cellExitLifetime;            // Lifetime for a neutron at velocity v to exit the precession cell
-    double cellEntranceChance;          // Chance for the neutron to enter the cell 
-    std::string status;
-    bool sourceLeftCellRight;
+    uint64_t cellEntranceThreshold;     // Chance for the neutron to enter the cell, as a bernoulliThreshold
+    particleStatus status;
     int cellRejections, windowHits, totalSteps, cellExits;
+    int pipeSteps;                      // Steps that drew for pipe loss
+    lossTally *tally;
 
     const double start;                  // Neutron start location
     const double window;                 // location of window
@@ -39,12 +93,25 @@ private:
     const double stepSize;               // 1D walk step size
     const double stepSize2;               // 1D walk step size after exiting from cell
     const double fillTime;               // Source active time
+    const bool exponentialDwell;         // Cell dwell times drawn from an exponential of mean cellExitLifetime
 
-    void step( TMCGenerator &mc );                        // Takes a 1D step
-    int leavingCellDirection();                // Returns -1 if sourceleftCellRight is true, +1 if false
-    bool crossedWindow();                // Returns true if neutron crossed window
+    const uint64_t cellThreshold;        // bernoulliThreshold of cellChance
+    const uint64_t cellExitThreshold;    // bernoulliThreshold of the cell entrance chance at stepSize2
+    const uint64_t lossPerStepThreshold; // bernoulliThreshold of lossPerStep
+    const uint64_t windowLossThreshold;  // bernoulliThreshold of windowLoss
 
-};
+    typedef void (particle1d::*walkFunction)( randomStream<generator> &mc );
+    const walkFunction walker;           // walkWith specialization for this geometry
+    const walkFunction prefixWalker;     // Same, stopping at the first cell exit
 
+    static walkFunction pickWalk( bool sourceLeftCellRight, bool changeMfp, bool untilExit );
+    template<bool sourceLeftCellRight, bool changeMfp, bool untilExit>
+    void walkWith( randomStream<generator> &mc );
+    template<bool sourceLeftCellRight, bool changeMfp, bool checkWindow>
+    void step( randomStream<generator> &mc );             // Takes a 1D step
+    void leaveCell( bool sourceLeftCellRight, bool changeMfp );   // Back into the pipe after a cell exit
+    bool crossedWindow() const;          // Returns true if neutron crossed window
+
+};
 
 #endif
@@ -0,0 +1,79 @@
+#ifndef REWEIGHT
+#define REWEIGHT
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdint>
+#include <particle1d.hpp>
+#include <output.hpp>
+
+const double TALLY_SCALE = 4294967296.;    // 2^32, fixed point scale of probability sums
+const double HITS_SCALE = 16777216.;       // 2^24, fixed point scale of probability * windowHits sums
+
+// Loss setting a lossless walk is reweighted to
+struct lossPoint
+{
+    double windowLoss;
+    double lossPerBounce;
+    double lossPerStep;
+};
+
+// Outcome of one lossPoint, as written to the reweight table
+struct reweightOutputFormat
+{
+    double windowLoss;
+    double lossPerBounce;
+    double lossPerStep;
+    double source;              // Fraction of particles ending in each status
+    double pipe;
+    double window;
+    double cell;
+    double alive;
+    double cellWindowHits;      // Mean windowHits of particles that reach the cell
+};
+
+/**
+ * Reweights lossless walks to a grid of window and pipe losses
+ *
+ * Particles are walked with windowLoss and lossPerStep set to 0. A particle with h window hits and
+ * m pipe loss draws survives a (wl, lossPerStep) setting with probability (1-wl)^h (1-lossPerStep)^m,
+ * and is lost on its k-th window hit with probability wl (1-wl)^(k-1) (1-lossPerStep)^(m_k), where
+ * m_k is the number of pipe loss draws before that hit. The rest of the lost probability is pipe loss.
+ * Sums are kept in fixed point so totals do not depend on which thread walked which particle
+ */
+class lossTally {
+public:
+    explicit lossTally( std::vector<lossPoint> grid );
+    void windowHit( int hitsBefore, int pipeStepsBefore );   // Called by particle1d on every window hit
+    void finish( const particleState &s );                  // Adds a finished particle to the sums
+    void continueFrom( const lossTally &prefix );          // Takes the window hits prefix has of its current particle
+    void merge( const lossTally &other );
+    void merge( const std::vector<long long> &other );      // Adds sums written by rawSums()
+    std::vector<long long> rawSums() const;                 // Particle count, then the six fixed point sums of each point
+    const std::vector<lossPoint>& points() const;
+    std::vector<reweightOutputFormat> results() const;
+
+private:
+    struct sums
+    {
+        uint64_t source, pipe, window, cell, alive;
+        uint64_t cellWindowHits;
+    };
+
+    std::vector<lossPoint> grid;
+    std::vector<double> logWindowPass;      // log(1 - windowLoss)
+    std::vector<double> logPipePass;        // log(1 - lossPerStep)
+    std::vector<double> windowLost;         // Chance the current particle was lost on the window
+    std::vector<sums> totals;
+    uint64_t particles;
+};
+
+// Write reweighted outcomes as a table
+void writeReweight( hdfFile &file, std::string path, const std::vector<reweightOutputFormat> &results,
+                    std::map<std::string, double> attributes );
+
+// Read a table written by writeReweight
+std::vector<reweightOutputFormat> readReweight( const hdfReader &file, std::string path );
+
+#endif
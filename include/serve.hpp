@@ -0,0 +1,73 @@
+#ifndef SERVE
+#define SERVE
+
+#include <map>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+// A value of a job line: a string, number, true, false or null as written
+struct jsonValue
+{
+    enum kind { string, number, boolean, null };
+    kind type;
+    std::string text;           // Unescaped string, number as written, or "true" / "false"
+};
+
+// Parse one job line, a flat JSON object of names to strings, numbers, booleans or null
+std::map<std::string, jsonValue> parseJobLine( const std::string &line );
+
+// A string as a quoted JSON string
+std::string jsonString( const std::string &text );
+
+// A value as it was given in a job line
+std::string jsonText( const jsonValue &value );
+
+/**
+ * Runs jobs given as lines on a number of job threads (--serve)
+ *
+ * handle() turns a job line into the reply line, and must not throw. Replies are sent as jobs
+ * finish, so they may come in a different order than the jobs, and carry the job's id to match them up
+ */
+class jobServer {
+public:
+    typedef std::function<std::string( const std::string &line )> jobHandler;
+
+    jobServer( jobHandler handle, int jobs );
+    ~jobServer();
+
+    // Runs the jobs of in, one per line, with replies to out. Returns at the end of in once every job has finished
+    void serveStream( std::istream &in, std::ostream &out );
+
+    // Accepts connections on a Unix socket, each sending jobs and getting replies as serveStream does.
+    // Returns once a connection has sent {"shutdown": true} and every job has finished
+    void serveSocket( const std::string &path );
+
+private:
+    typedef std::function<void( const std::string& )> replySink;
+    struct job
+    {
+        std::string line;
+        replySink reply;
+    };
+
+    const jobHandler handle;
+    std::vector<std::thread> workers;
+    std::deque<job> queue;
+    std::mutex mtx;
+    std::condition_variable queueChanged;
+    int running;                        // Jobs taken off the queue and not finished
+    bool stopping;
+
+    void submit( job j );
+    void drain();                       // Waits until every submitted job has finished
+    void run();                         // Job thread loop
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef SIMULATION
+#define SIMULATION
+
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mc.hpp>
+#include <spectrum.hpp>
+#include <particle1d.hpp>
+#include <threadpool.hpp>
+#include <reweight.hpp>
+#include <summary.hpp>
+#include <beamline.hpp>
+
+const int PARTICLE_BLOCK = 256;         // Number of particles a worker claims at a time
+const size_t MAX_PENDING_BLOCKS = 1024; // Finished blocks allowed to wait for an earlier, unfinished block
+
+typedef std::function<void( const particleState& )> particleConsumer;
+
+// How particles are walked
+enum class walkEngine
+{
+    step,       // particle1d, one mean free path at a time
+    jump,       // jumpWalker, straight to the next boundary
+    batch,      // batchWalker, many particles at once with vectorized steps (xoshiro256ss, no reweighting)
+    markov      // markovSolver, expected outcomes without walking particles
+};
+
+// How long a neutron that gets into the cell stays there before it exits
+enum class cellDwell
+{
+    constant,       // Exactly the cellExitLifetime of its velocity
+    exponential     // Exponentially distributed with that mean (the exponentialDwell parameter)
+};
+
+// Parameters passed to particle1d for one point of the pipe geometry in simulation.cpp
+std::map<std::string, double> staticParameters( double nonspec, double lossPerBounce, double windowLoss, double mfp2 );
+
+// Parse an engine name given on the command line
+walkEngine parseEngine( const std::string &name );
+
+// Parse a cell dwell model given on the command line
+cellDwell parseCellDwell( const std::string &name );
+
+// Most steps a particle of a point can take, which bounds windowHits, totalSteps and the other counters of particleState
+long long stepBound( std::map<std::string, double> params, const velocitySpectrum &spectrum, const beamline *geometry = nullptr );
+
+/**
+ * Schedule particles [first, first + n) of one run on a pool
+ *
+ * Blocks of particles are claimed in order from a per-run counter, and each particle's generator is
+ * seeded from (seed, particleNum), so results are identical for any thread count, and runs of
+ * consecutive ranges with the same seed together give the same particles as one run of them all.
+ * End states are handed to consume one at a time, in order of particle number.
+ *
+ * @param pool Pool to run on
+ * @param params Static parameters passed to particle1d
+ * @param first Number of the first particle
+ * @param n Number of particles to simulate
+ * @param seed Run seed
+ * @param engine How particles are walked
+ * @param rng Generator every particle's random stream is drawn from
+ * @param spectrum Velocities of the neutrons
+ * @param consume Called with the end state of every particle (may be empty)
+ * @param done Incremented as particles finish
+ * @param tally If not null, every particle is also added to this loss tally
+ * @param summary If not null, every particle is also added to these summary statistics
+ * @param geometry If not null, particles walk this beamline instead of the one in params (--engine step only)
+ */
+void scheduleRun( workStealingPool &pool, std::map<std::string, double> params, const int first, const int n,
+                  const uint64_t seed, const walkEngine engine, const generatorType rng,
+                  std::shared_ptr<const velocitySpectrum> spectrum, particleConsumer consume,
+                  std::atomic<long> &done, lossTally *tally = nullptr, summaryStats *summary = nullptr,
+                  std::shared_ptr<const beamline> geometry = nullptr );
+
+/**
+ * Schedule particles [first, first + n) of runs that differ only in stepSize2 (--branch-mfp2)
+ *
+ * stepSize2 only matters after a cell exit, so each particle is walked once with particle1d up to
+ * its first cell exit, and its walker and random stream are then copied to go on once in every run.
+ * Every run gets the same end states, tallies and summaries as scheduleRun would give it, and the
+ * walk before the first exit is only taken once. Blocks are claimed as in scheduleRun.
+ *
+ * @param params Static parameters of each run, equal except for stepSize2
+ * @param consume, tallies, summaries Outputs of each run, as in scheduleRun (entries may be empty or null)
+ * Other parameters as in scheduleRun
+ */
+void scheduleBranchedRun( workStealingPool &pool, std::vector< std::map<std::string, double> > params, const int first, const int n,
+                          const uint64_t seed, const generatorType rng, std::shared_ptr<const velocitySpectrum> spectrum,
+                          std::vector<particleConsumer> consume, std::atomic<long> &done,
+                          std::vector<lossTally*> tallies, std::vector<summaryStats*> summaries );
+
+/**
+ * Wait for every task on a pool to finish
+ *
+ * @param pool Pool to wait for
+ * @param total Number of particles scheduled
+ * @param done Incremented as particles finish
+ * @param progress Whether or not crude progress bar updates
+ */
+void waitForRuns( workStealingPool &pool, const long total, std::atomic<long> &done, const bool progress );
+
+/**
+ * Run particles [0, n) through the random walk on a pool of worker threads
+ *
+ * @param params Static parameters passed to particle1d
+ * @param n Number of particles to simulate
+ * @param threads Number of worker threads
+ * @param seed Run seed
+ * @param engine How particles are walked
+ * @param rng Generator every particle's random stream is drawn from
+ * @param spectrum Velocities of the neutrons
+ * @param progress Whether or not crude progress bar updates
+ * @param consume Called with the end state of every particle, in order of particle number
+ */
+void simulate( std::map<std::string, double> params, const int n, const int threads,
+               const uint64_t seed, const walkEngine engine, const generatorType rng,
+               std::shared_ptr<const velocitySpectrum> spectrum, const bool progress, particleConsumer consume );
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef SPECTRUM
+#define SPECTRUM
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <mc.hpp>
+
+const int SPECTRUM_BINS = 1000;     // Velocity bins of the built in spectra
+const double UCN_E_MIN = 1.;        // Built in spectra energy range [neV]
+const double UCN_E_MAX = 215.;
+
+/**
+ * Walker/Vose alias table over n outcomes
+ *
+ * sample() takes one 64 bit draw: the high half picks an outcome and the low half decides
+ * between the outcome and its alias
+ */
+class aliasTable {
+public:
+    explicit aliasTable( const std::vector<double> &weights );
+
+    template<typename generator>
+    int sample( randomStream<generator> &mc ) const
+    {
+        const uint64_t x = mc();
+        const int i = static_cast<int>( ((x >> 32) * n) >> 32 );
+        return ((x & 0xffffffff) < threshold[i]) ? i : alias[i];
+    }
+
+private:
+    uint64_t n;
+    std::vector<uint64_t> threshold;    // Chance to keep outcome i, scaled by 2^32
+    std::vector<int> alias;
+};
+
+// Velocity and the constants derived from it, computed once per bin
+struct velocityBin
+{
+    double v;
+    double cellExitLifetime;            // Lifetime for a neutron at velocity v to exit the precession cell
+};
+
+/**
+ * Discrete velocity spectrum sampled in constant time
+ */
+class velocitySpectrum {
+public:
+    velocitySpectrum( const std::vector<double> &velocities, const std::vector<double> &weights );
+
+    template<typename generator>
+    const velocityBin &sample( randomStream<generator> &mc ) const
+    {
+        // A single velocity takes no draw, so mono-energetic walks keep their random streams
+        return (bins.size() == 1) ? bins[0] : bins[table.sample( mc )];
+    }
+
+    const velocityBin &fastest() const;
+    double mean() const;
+    size_t size() const;
+    const velocityBin &bin( size_t i ) const;
+    double probability( size_t i ) const;       // Weight of bin i over the total
+
+private:
+    std::vector<velocityBin> bins;
+    std::vector<double> weights;
+    aliasTable table;
+};
+
+/**
+ * Spectrum given on the command line
+ *
+ * mono (every neutron at v2_average), v2 and v3 (v^2 dv and v^3 dv between UCN_E_MIN and
+ * UCN_E_MAX) are built on first use and shared. file reads "velocity weight" lines from path,
+ * with # starting a comment
+ */
+std::shared_ptr<const velocitySpectrum> makeSpectrum( const std::string &name, const std::string &path = "" );
+
+#endif
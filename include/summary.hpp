@@ -0,0 +1,69 @@
+#ifndef SUMMARY
+#define SUMMARY
+
+#include <vector>
+#include <string>
+#include <map>
+#include <iostream>
+#include <cstdint>
+#include <particle1d.hpp>
+#include <output.hpp>
+
+const double CONFIDENCE_Z = 1.96;   // Normal quantile of the 95% confidence intervals used for adaptive stopping
+
+// Mean and variance of an integer observable from exact sums, so merging in any order or from
+// separate shard files gives the same result
+struct runningStat
+{
+    long long n = 0;
+    long long sum = 0;
+    long long sumSquares = 0;
+
+    void add( long long x );
+    void merge( const runningStat &other );
+    double mean() const;
+    double variance() const;
+    double stdError() const;
+};
+
+// One row of the cellStats summary table
+struct statOutputFormat
+{
+    char      observable[CHAR_COUNT];
+    long long count;
+    long long sum;
+    long long sumSquares;
+    double    mean;
+    double    variance;
+    double    stdError;
+};
+
+/**
+ * Streaming reduction of particle end states into what parse.py reports
+ *
+ * Status counts, means of windowHits, cellRejections and totalSteps for particles that reach the
+ * cell, and their windowHits histogram. Workers keep their own summaryStats and merge them at the end
+ */
+class summaryStats {
+public:
+    void add( const particleState &s );
+    void merge( const summaryStats &other );
+    void merge( const hdfReader &file, std::string path );     // Adds a summary group written by write()
+    void write( hdfFile &file, std::string path, std::map<std::string, double> attributes ) const;   // Writes the summary group
+    void print( std::ostream &out = std::cout ) const;
+    long long particles() const;
+    long long count( particleStatus status ) const;
+    double meanWindowHits() const;                          // Of particles that reach the cell
+
+    // Half width of the 95% confidence interval of an observable over its estimate, infinite while
+    // there is no estimate. Observables are cell (fraction of particles that reach the cell) and
+    // windowHits, cellRejections and totalSteps (means of particles that reach the cell)
+    double relativeError( const std::string &observable ) const;
+
+private:
+    long long statusCounts[STATUS_COUNT] = {};
+    runningStat windowHits, cellRejections, totalSteps;      // Particles that reach the cell
+    std::vector<long long> windowHitsHistogram;             // Particles that reach the cell, by windowHits
+};
+
+#endif
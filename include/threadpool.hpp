@@ -0,0 +1,85 @@
+#ifndef THREADPOOL
+#define THREADPOOL
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <chrono>
+
+/**
+ * Tasks that are waited for together, such as those of one --serve job
+ *
+ * While a scope is open on a thread, tasks it submits join the group, and so do the tasks those
+ * tasks submit. wait() and waitFor() of a pool called from inside a scope only wait for its group
+ */
+class taskGroup {
+public:
+    taskGroup();
+    ~taskGroup();                       // Waits for the group's tasks, so nothing they use goes away under them
+
+    class scope {
+    public:
+        explicit scope( taskGroup &group );
+        ~scope();
+
+    private:
+        taskGroup *previous;
+    };
+
+private:
+    friend class workStealingPool;
+    std::mutex mtx;
+    std::condition_variable allDone;
+    int unfinished;                     // Tasks of the group submitted but not finished
+    std::exception_ptr error;
+};
+
+/**
+ * Fixed-size work-stealing thread pool
+ *
+ * Every worker has its own task deque. Tasks submitted from a worker go to the back of that
+ * worker's deque and are run newest first; idle workers steal the oldest task from the
+ * front of another worker's deque. Tasks submitted from outside the pool are dealt out round-robin.
+ */
+class workStealingPool {
+public:
+    typedef std::function<void()> task;
+
+    explicit workStealingPool( int threads );
+    ~workStealingPool();
+    void submit( task t );
+    void wait();                        // Blocks until every submitted task (of the caller's taskGroup) has finished. Rethrows the first task exception
+    bool waitFor( std::chrono::milliseconds timeout );   // Returns true if every submitted task (of the caller's taskGroup) finished within timeout
+    int size() const;
+
+private:
+    struct groupTask {
+        task t;
+        taskGroup *group;
+    };
+    struct taskQueue {
+        std::mutex mtx;
+        std::deque<groupTask> tasks;
+    };
+
+    std::vector< std::unique_ptr<taskQueue> > queues;
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+    int queued;                         // Tasks sitting in a deque
+    int unfinished;                     // Tasks submitted but not finished
+    unsigned nextQueue;                 // Round-robin target for outside submissions
+    bool stopping;
+    std::exception_ptr error;
+
+    bool take( int index, groupTask &t );   // Pop from own deque, else steal from another
+    void run( int index );              // Worker thread loop
+};
+
+#endif
@@ -1,12 +1,11 @@
 #!/usr/bin/env python3
-# Use GNU Parallel to sweep across parameters
-import numpy as np
+# Sweep across parameters with a single in-process --sweep run
 import subprocess
 from distutils.util import strtobool
 import os
 import sys
 
-jobfile = 'parallelJobs.txt'
+outfile = 'cellExitMfpScan/mfpScan.h5'
 
 params = [ 0.25, 0.5, 0.75, 1, 1.25, 1.5, 1.75, 2]
 
@@ -14,11 +13,11 @@ if not strtobool(input('\nRun jobs? (y/n): ')):
     print('Quitting...')
     sys.exit()
 
-with open(jobfile, 'w') as runfile:
-    for i, param in enumerate(params):
+os.makedirs(os.path.dirname(outfile), exist_ok=True)
+mfp2 = ','.join(str(param) for param in params)
+# Window losses are reweighted from one lossless walk per particle, branched into every mfp2 value at its first cell exit
+command = ['./randomWalk_t.x', '--f', outfile, '--n', '1000000', '--sweep', '--reweight', '--branch-mfp2',
+           '--wl', '0.03,0', '--mfp2', mfp2, '--threads', str(os.cpu_count())]
 
-        runfile.write(f'./randomWalk_t.x --f cellExitMfpScan/mfp_{param:.2e}.h5 --n 1000000 --mfp2 {param} --progress false\n')
-        runfile.write(f'./randomWalk_t.x --f cellExitMfpScan/mfp_{param:.2e}_noWL.h5 --n 1000000 --wl 0 --mfp2 {param} --progress false\n')
-
-process = subprocess.Popen([f'parallel < {jobfile} --bar'], shell=True)
-print(f'Running {len(params)} jobs...')
+print(f'Running {len(params)} sweep points...')
+subprocess.run(command, check=True)
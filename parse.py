@@ -4,27 +4,58 @@ import argparse, tables
 import pandas as pd
 import numpy as np
 
+STATUS = ['alive', 'source', 'pipe', 'window', 'cell'] # status enum of --layout columnar tables
+
+def read_columns(table, status=None):
+    '''Reads a --layout columnar table group into a DataFrame. Rows are grouped by status within
+    each block, so with a status only its run in each block is read from every column'''
+    counts = table.blockStatusCounts.read()
+    if status is None:
+        runs = [(0, int(counts.sum()))]
+    else:
+        s = STATUS.index(status)
+        starts = np.cumsum(counts.sum(axis=1)) - counts.sum(axis=1) + counts[:, :s].sum(axis=1)
+        runs = [(int(a), int(a + n)) for a, n in zip(starts, counts[:, s]) if n > 0]
+    columns = {}
+    for node in table._f_iter_nodes('Leaf'):
+        if node.name != 'blockStatusCounts':
+            columns[node.name] = np.concatenate([node[a:b] for a, b in runs] + [node[0:0]])
+    df = pd.DataFrame(columns)
+    df['status'] = np.array(STATUS)[df['status'].astype(int)]
+    return df
+
 def main():
     parser = argparse.ArgumentParser(description='Parses h5 files generated by monteCarlo and makes plots')
     parser.add_argument('-f', '--file', type=str, required=True, help='Input file')
+    parser.add_argument('-g', '--group', type=str, default=None, help='Sweep point group (e.g. point_0) in files written with --sweep')
     args = parser.parse_args()
 
     print(f'Reading {args.file}...', end='')
     infile = tables.open_file(args.file)
-    params = infile.root.table._v_attrs # get run attributes
-    df = pd.DataFrame.from_records( infile.root.table.read() ) # use either read() or read_where()
+    if args.group is None:
+        table = infile.root.table
+        params = table._v_attrs # get run attributes
+    else:
+        group = infile.get_node('/', args.group)
+        table = group.table
+        params = group._v_attrs # sweep points keep their attributes on the group
+    if isinstance(table, tables.Group): # --layout columnar: counts come from the block index, and only cell rows are read
+        counts = dict(zip(STATUS, table.blockStatusCounts.read().sum(axis=0)))
+        df = read_columns(table, 'cell')
+    else:
+        df = pd.DataFrame.from_records( table.read() ) # use either read() or read_where()
+        df['status'] = df['status'].str.decode("utf-8") # Status column in byte string format
+        counts = df['status'].value_counts().to_dict()
     infile.close()
     print('done. File closed')
 
     for attr in params._f_list("user"):
         print(f"{attr}: {getattr(params, attr)}")
 
-    df['status'] = df['status'].str.decode("utf-8") # Status column in byte string format
-
-    print('Total neutrons simulated: ', len(df.index) )
-    print('Neutrons lost at source: ', len( df.query('status=="source"').index ) )
-    print('Neutrons lost in pipe: ', len( df.query('status=="pipe"').index ) )
-    print('Neutrons lost on window: ', len( df.query('status=="window"').index ) )
+    print('Total neutrons simulated: ', sum(counts.values()) )
+    print('Neutrons lost at source: ', counts.get('source', 0) )
+    print('Neutrons lost in pipe: ', counts.get('pipe', 0) )
+    print('Neutrons lost on window: ', counts.get('window', 0) )
 
     print("\n### Neutrons in the cell ###")
     df.query('status=="cell"', inplace=True)
@@ -0,0 +1,7 @@
+// Compiled with -mavx512f: eight lanes per vector, with enough registers to keep them for a few steps
+#include "batchkernel.hpp"
+
+int stepLanesAvx512( batchWalker::lanes &L, const batchWalker::constants &c, const int n )
+{
+    return stepLanes<8, 4>( L, c, n );
+}
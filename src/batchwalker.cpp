@@ -0,0 +1,166 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include "batchwalker.hpp"
+#include "batchkernel.hpp"
+
+const int64_t EMPTY_LANE = -1;      // Status of lanes past the live ones
+
+// Vector kernel if this CPU can run it. BATCH_KERNELS is defined when the build compiles it
+static batchWalker::stepKernel pickKernel()
+{
+#ifdef BATCH_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports( "avx512f" )) return stepLanesAvx512;
+#endif
+    return nullptr;
+}
+
+batchWalker::batchWalker( std::map<std::string, double> p, std::shared_ptr<const velocitySpectrum> spectrum )
+            : params( p ), spectrum( spectrum ), kernel( pickKernel() ), start( p["start"] ), stepSize( p["stepSize"] ),
+            cellThreshold( bernoulliThreshold( p["cellChance"] ) ), storage( new char[sizeof(lanes) + alignof(lanes)] )
+{
+    void *buffer = storage.get();
+    size_t space = sizeof(lanes) + alignof(lanes);
+    lane = new (std::align( alignof(lanes), sizeof(lanes), buffer, space )) lanes();
+    c.window = p["window"];
+    c.cell = p["cell"];
+    c.source = p["source"];
+    c.fillTime = p["fillTime"];
+    c.stepSize2 = p["stepSize2"];
+    c.sourceLeftCellRight = (c.source < c.cell);
+    c.changeMfp = (c.stepSize2 != 0);
+    c.windowLossThreshold = bernoulliThreshold( p["windowLoss"] );
+    c.lossPerStepThreshold = bernoulliThreshold( p["lossPerStep"] );
+    c.cellExitThreshold = c.changeMfp ? bernoulliThreshold( cellEntranceChance( c.stepSize2, CELL_EXIT_NONSPEC ) ) : 0;
+    std::fill( lane->status, lane->status + BATCH_LANES, EMPTY_LANE );
+}
+
+void batchWalker::fill( int l, uint64_t seed, int particleNum )
+{
+    // Same draws as walkParticles before particle1d::walk
+    std::uniform_real_distribution<double> start_time_distribution(0, nextafter(c.fillTime, std::numeric_limits<double>::max()) );
+    randomStream<xoshiro256ss> mc;
+    mc.seed( seed, particleNum );
+    const double tstart = start_time_distribution(mc);
+    const velocityBin &velocity = spectrum->sample( mc );
+
+    // The first direction bits are drawn now, since the kernel refills the buffer at the end of a step
+    lanes &L = *lane;
+    const uint64_t *s = mc.source().state();
+    uint64_t s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+    L.bits[l] = xoshiro256ss::next( s0, s1, s2, s3 );
+    L.bitsLeft[l] = 64;
+    L.s0[l] = s0;
+    L.s1[l] = s1;
+    L.s2[l] = s2;
+    L.s3[l] = s3;
+    L.location[l] = start;
+    L.t[l] = tstart;
+    L.v[l] = velocity.v;
+    L.mfp[l] = stepSize;
+    L.dt[l] = stepSize / velocity.v;
+    L.exitDt[l] = c.stepSize2 / velocity.v;
+    L.cellExitLifetime[l] = velocity.cellExitLifetime;
+    L.cellThreshold[l] = cellThreshold;
+    L.status[l] = ALIVE;
+    L.windowHits[l] = 0;
+    L.totalSteps[l] = 0;
+    L.cellRejections[l] = 0;
+    L.cellExits[l] = 0;
+    L.pipeSteps[l] = 0;
+    L.particleNum[l] = particleNum;
+    L.tstart[l] = tstart;
+}
+
+void batchWalker::move( int from, int to )
+{
+    lanes &L = *lane;
+    L.location[to] = L.location[from];
+    L.t[to] = L.t[from];
+    L.dt[to] = L.dt[from];
+    L.exitDt[to] = L.exitDt[from];
+    L.mfp[to] = L.mfp[from];
+    L.v[to] = L.v[from];
+    L.cellExitLifetime[to] = L.cellExitLifetime[from];
+    L.cellThreshold[to] = L.cellThreshold[from];
+    L.s0[to] = L.s0[from];
+    L.s1[to] = L.s1[from];
+    L.s2[to] = L.s2[from];
+    L.s3[to] = L.s3[from];
+    L.bits[to] = L.bits[from];
+    L.bitsLeft[to] = L.bitsLeft[from];
+    L.status[to] = L.status[from];
+    L.windowHits[to] = L.windowHits[from];
+    L.totalSteps[to] = L.totalSteps[from];
+    L.cellRejections[to] = L.cellRejections[from];
+    L.cellExits[to] = L.cellExits[from];
+    L.pipeSteps[to] = L.pipeSteps[from];
+    L.particleNum[to] = L.particleNum[from];
+    L.tstart[to] = L.tstart[from];
+}
+
+particleState batchWalker::state( int l ) const
+{
+    const lanes &L = *lane;
+    return particleState{ L.particleNum[l], static_cast<int>( L.windowHits[l] ), static_cast<int>( L.totalSteps[l] ),
+                          L.location[l], static_cast<particleStatus>( L.status[l] ),
+                          static_cast<int>( L.cellRejections[l] ), static_cast<int>( L.cellExits[l] ),
+                          static_cast<int>( L.pipeSteps[l] ), L.v[l], L.tstart[l], L.t[l] };
+}
+
+void batchWalker::walk( uint64_t seed, int first, int last, std::vector<particleState> &states )
+{
+    states.resize( last - first );
+    if (!kernel)
+    {
+        // One particle at a time, as walkParticles does
+        std::uniform_real_distribution<double> start_time_distribution(0, nextafter(c.fillTime, std::numeric_limits<double>::max()) );
+        randomStream<xoshiro256ss> mc;
+        particle1d<xoshiro256ss> ucn( 0, spectrum->fastest(), params );
+        for (int i = first; i < last; i++)
+        {
+            mc.seed( seed, i );
+            const double tstart = start_time_distribution(mc);
+            ucn.resetState( tstart, spectrum->sample( mc ), i );
+            ucn.walk( mc );
+            states[i - first] = ucn.getState();
+        }
+        return;
+    }
+
+    lanes &L = *lane;
+    int next = first;
+    int live = 0;
+    while (live < BATCH_LANES && next < last) fill( live++, seed, next++ );
+
+    while (live > 0)
+    {
+        // Lanes past live are empty, so rounding up to whole vectors changes nothing
+        const int width = std::min( BATCH_LANES, (live + BATCH_VECTOR - 1) / BATCH_VECTOR * BATCH_VECTOR );
+        const int finished = kernel( L, c, width ) - (width - live);
+
+        // Retiring takes a pass over the lanes, so wait until it frees a good share of them
+        if (finished == 0 || (finished * 4 < live && next < last)) continue;
+        for (int l = 0; l < live; )
+        {
+            if (L.status[l] == ALIVE && L.t[l] < c.fillTime)
+            {
+                l++;
+                continue;
+            }
+            states[L.particleNum[l] - first] = state( l );
+            if (next < last)
+            {
+                fill( l++, seed, next++ );
+            } else {
+                // Compact: the last live lane takes this one's place and is checked next
+                live--;
+                if (l != live) move( live, l );
+                L.status[live] = EMPTY_LANE;
+            }
+        }
+    }
+}
@@ -0,0 +1,324 @@
+#include <beamline.hpp>
+#include <reweight.hpp>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+beamlineLayout readBeamline( const std::string &path )
+{
+    std::ifstream file( path );
+    if (!file) throw std::runtime_error("Unable to open geometry file " + path);
+
+    beamlineLayout layout;
+    bool haveStart = false;
+    std::string line;
+    while (std::getline( file, line ))
+    {
+        layout.text += line + "\n";
+        line = line.substr( 0, line.find('#') );
+        std::stringstream items( line );
+        std::string kind;
+        if (!(items >> kind)) continue;    // blank or comment line
+
+        if (kind == "pipe")
+        {
+            pipeSection s;
+            if (!(items >> s.from >> s.to >> s.nonspec >> s.lossPerBounce))
+                throw std::runtime_error("Geometry line '" + line + "' needs from, to, ns and lpb");
+            if (!(s.from < s.to) || !(s.nonspec > 0 && s.nonspec <= 1) || s.lossPerBounce < 0)
+                throw std::runtime_error("Geometry line '" + line + "' needs from < to, 0 < ns <= 1 and lpb >= 0");
+            layout.sections.push_back( s );
+            continue;
+        }
+
+        double x;
+        if (!(items >> x)) throw std::runtime_error("Geometry line '" + line + "' needs a position");
+        if (kind == "start")
+        {
+            layout.start = x;
+            haveStart = true;
+            continue;
+        }
+
+        beamlineComponent c{ componentType::source, x, std::numeric_limits<double>::quiet_NaN() };
+        if (kind == "source") {
+            c.type = componentType::source;
+        } else if (kind == "window") {
+            c.type = componentType::window;
+        } else if (kind == "cell") {
+            c.type = componentType::cell;
+        } else if (kind == "valve") {
+            c.type = componentType::valve;
+        } else {
+            throw std::runtime_error("Unknown component '" + kind + "' in geometry file " + path);
+        }
+        if ((c.type == componentType::window || c.type == componentType::cell) && (items >> c.chance) &&
+            !(c.chance >= 0 && c.chance <= 1))
+            throw std::runtime_error("Geometry line '" + line + "' needs a chance between 0 and 1");
+        layout.components.push_back( c );
+    }
+    if (!haveStart) throw std::runtime_error("Geometry file " + path + " has no start");
+
+    std::sort( layout.components.begin(), layout.components.end(),
+               []( const beamlineComponent &a, const beamlineComponent &b ){ return a.position < b.position; } );
+    return layout;
+}
+
+beamline::beamline( const beamlineLayout &layout, std::map<std::string, double> params ) : start( layout.start )
+{
+    const std::vector<beamlineComponent> &parts = layout.components;
+    if (parts.size() < 2 || parts.front().type == componentType::window || parts.back().type == componentType::window)
+        throw std::invalid_argument("A beamline needs a source, cell or valve at each end");
+    if (!(parts.front().position < start && start < parts.back().position))
+        throw std::invalid_argument("Neutrons must start between the ends of the beamline");
+
+    // Boundaries are the components, and the ends of sections that are not on a component
+    std::vector<beamlineComponent> walls( parts );
+    for (auto const& s : layout.sections)
+    {
+        if (s.from < parts.front().position || s.to > parts.back().position)
+            throw std::invalid_argument("Pipe sections must lie between the ends of the beamline");
+        for (double x : {s.from, s.to})
+            if (std::none_of( walls.begin(), walls.end(), [x]( const beamlineComponent &c ){ return c.position == x; } ))
+                walls.push_back( beamlineComponent{ componentType::section, x, 0 } );
+    }
+    std::sort( walls.begin(), walls.end(), []( const beamlineComponent &a, const beamlineComponent &b ){ return a.position < b.position; } );
+
+    // Pipe outside every section takes the point's parameters
+    struct pipe { double mfp, lossPerStep, cellChance; };
+    auto pipeAt = [&]( const double x ) {
+        pipe p{ params["stepSize"], params["lossPerStep"], params["cellChance"] };
+        int found = 0;
+        for (auto const& s : layout.sections)
+            if (s.from < x && x < s.to)
+            {
+                p = pipe{ meanFreePath( s.nonspec ), (1/s.nonspec) * s.lossPerBounce, 0 };
+                p.cellChance = cellEntranceChance( p.mfp, s.nonspec );
+                found++;
+            }
+        if (found > 1) throw std::invalid_argument("Pipe sections overlap at " + std::to_string(x));
+        return p;
+    };
+    std::vector<pipe> pipes{ pipeAt( -std::numeric_limits<double>::infinity() ) };
+    for (size_t i = 0; i < walls.size(); i++)
+    {
+        const pipe p = (i + 1 < walls.size()) ? pipeAt( (walls[i].position + walls[i + 1].position) / 2 )
+                                              : pipeAt( std::numeric_limits<double>::infinity() );
+        // Section ends between equal pipe are no boundary at all
+        const pipe &q = pipes.back();
+        if (walls[i].type == componentType::section && p.mfp == q.mfp && p.lossPerStep == q.lossPerStep && p.cellChance == q.cellChance)
+        {
+            walls.erase( walls.begin() + i-- );
+            continue;
+        }
+        pipes.push_back( p );
+    }
+
+    std::vector<uint64_t> cellThresholds;           // Cell entrance from each region
+    double maxMfp = params["stepSize2"];
+    for (auto const& p : pipes)
+    {
+        regions.push_back( region{ p.mfp, bernoulliThreshold( p.lossPerStep ) } );
+        cellThresholds.push_back( bernoulliThreshold( p.cellChance ) );
+        maxMfp = std::max( maxMfp, p.mfp );
+    }
+
+    double gap = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < walls.size(); i++)
+    {
+        const beamlineComponent &c = walls[i];
+        if (i > 0) gap = std::min( gap, c.position - walls[i - 1].position );
+        boundary b{ c.type, c.position, {0, 0} };
+        if (c.type == componentType::window)
+        {
+            b.threshold[0] = b.threshold[1] = bernoulliThreshold( std::isnan( c.chance ) ? params["windowLoss"] : c.chance );
+        } else if (c.type == componentType::cell) {
+            b.threshold[0] = std::isnan( c.chance ) ? cellThresholds[i] : bernoulliThreshold( c.chance );
+            b.threshold[1] = std::isnan( c.chance ) ? cellThresholds[i + 1] : bernoulliThreshold( c.chance );
+        }
+        boundaries.push_back( b );
+    }
+    if (gap == 0) throw std::invalid_argument("Two beamline components at the same position");
+    if (gap < maxMfp)
+        throw std::invalid_argument("Beamline components " + std::to_string(gap) + " m apart are closer than the mean free path "
+                                    + std::to_string(maxMfp) + " m");
+    cellExitThreshold = (params["stepSize2"] != 0) ? bernoulliThreshold( cellEntranceChance( params["stepSize2"], CELL_EXIT_NONSPEC ) ) : 0;
+
+    // Neutrons get at most one mfp past either end. With buckets half the smallest gap wide no bucket
+    // holds two boundaries, and a boundary's bucket is found the same way regionOf finds a position's
+    origin = boundaries.front().position - 2 * maxMfp;
+    scale = 2 / gap;
+    const double count = std::ceil( (boundaries.back().position + 2 * maxMfp - origin) * scale ) + 1;
+    if (count > MAX_BEAMLINE_BUCKETS) throw std::invalid_argument("Beamline components are too close together for the lookup table");
+    buckets.resize( static_cast<size_t>( count ) );
+    size_t b = 0;
+    for (size_t k = 0; k < buckets.size(); k++)
+    {
+        while (b < boundaries.size() && static_cast<size_t>( (boundaries[b].position - origin) * scale ) < k) b++;
+        if (b < boundaries.size() && static_cast<size_t>( (boundaries[b].position - origin) * scale ) == k) {
+            buckets[k] = bucket{ boundaries[b].position, static_cast<int>( b ), static_cast<int>( b + 1 ) };
+        } else {
+            buckets[k] = bucket{ std::numeric_limits<double>::infinity(), static_cast<int>( b ), static_cast<int>( b ) };
+        }
+    }
+}
+
+template<typename generator>
+beamlineWalker<generator>::beamlineWalker( double startTime, const velocityBin &startVelocity, std::map<std::string, double> p,
+                                           std::shared_ptr<const beamline> geometry )
+            : tally( nullptr ), geometry( geometry ), stepSize2( p["stepSize2"] ), fillTime( p["fillTime"] ),
+            exponentialDwell( p["exponentialDwell"] != 0 )
+{
+    resetState( startTime, startVelocity );
+}
+
+template<typename generator>
+void beamlineWalker<generator>::resetState( double startTime, const velocityBin &startVelocity, int num )
+{
+    particleNum = num;
+    windowHits = 0;
+    totalSteps = 0;
+    cellExits = 0;
+    pipeSteps = 0;
+    cellRejections = 0;
+    location = geometry->start;
+    prevLocation = location;
+    status = particleStatus::alive;
+    tstart = startTime;
+    t = startTime;
+    v = startVelocity.v;
+    cellExitLifetime = startVelocity.cellExitLifetime;
+    exitedCell = false;
+    const int start = geometry->regionOf( location );
+    mfp = geometry->regions[start].mfp;
+    dt = mfp / v;
+    enter( start );
+}
+
+template<typename generator>
+particleState beamlineWalker<generator>::getState() const
+{
+    return particleState{ particleNum, windowHits, totalSteps, location, status,
+                          cellRejections, cellExits, pipeSteps, v, tstart, t };
+}
+
+template<typename generator>
+void beamlineWalker<generator>::setLossTally( lossTally *t )
+{
+    tally = t;
+}
+
+template<typename generator>
+void beamlineWalker<generator>::walk( randomStream<generator> &mc )
+{
+    while ( (t < fillTime) && status == particleStatus::alive ) step( mc );
+}
+
+template<typename generator>
+void beamlineWalker<generator>::step( randomStream<generator> &mc )
+{
+    prevLocation = location;
+    location +=  ( 1-(2*mc.bit()) )  * mfp;
+    t += dt;
+    totalSteps++;
+
+    // A position on a boundary is in the region above it, but a step down onto a component reaches it,
+    // as location <= source does in particle1d
+    int next = geometry->regionOf( location );
+    if (next == region && location < prevLocation && location == geometry->boundaries[region - 1].position) next = region - 1;
+    if (next == region) {
+        pipeDraw( mc );
+    } else {
+        cross( next, mc );
+    }
+}
+
+template<typename generator>
+void beamlineWalker<generator>::cross( int next, randomStream<generator> &mc )
+{
+    const bool up = next > region;
+    const beamline::boundary &wall = geometry->boundaries[up ? region : next];
+    switch (wall.type)
+    {
+        case componentType::window:
+            if (totalSteps > 1)
+            {
+                windowHits++;
+                if (tally) tally->windowHit( windowHits - 1, pipeSteps );
+                if (mc.bernoulli( wall.threshold[up ? 0 : 1] )) status = particleStatus::window;  //chance for loss on the window
+                enter( next );
+                break;
+            }
+            // The first step ignores the window, as in particle1d
+            // fall through
+        case componentType::section:
+            enter( next );
+            pipeDraw( mc );
+            break;
+        case componentType::source:
+            status = particleStatus::source; // neutrons get absorbed by the source
+            break;
+        case componentType::cell:
+            // chance for neutrons to get into cell
+            if (mc.bernoulli( exitedCell ? geometry->cellExitThreshold : wall.threshold[up ? 0 : 1] )) {
+                const double dwell = exponentialDwell ? cellExitLifetime * mc.exponential() : cellExitLifetime;
+                if ( (fillTime - t) < dwell )
+                {
+                    status = particleStatus::cell;
+                    t = fillTime;
+                } else {
+                    // If neutron exits the cell, back into the pipe it came from
+                    t += dwell;
+                    cellExits++;
+                    totalSteps++;
+                    if (stepSize2 != 0)
+                    {
+                        exitedCell = true;
+                        mfp = stepSize2;
+                        dt = mfp / v;
+                    }
+                    location = wall.position + ( up ? -mfp : mfp );
+                }
+            } else {
+                //neutron rejected from entrance
+                location = prevLocation;
+                totalSteps++;
+                cellRejections++;
+                t += dt;
+            }
+            break;
+        case componentType::valve:
+            // Bounces back off the closed valve
+            location = prevLocation;
+            totalSteps++;
+            t += dt;
+            break;
+    }
+}
+
+template<typename generator>
+void beamlineWalker<generator>::enter( int next )
+{
+    region = next;
+    lossPerStepThreshold = geometry->regions[next].lossPerStepThreshold;
+    if (!exitedCell && mfp != geometry->regions[next].mfp)
+    {
+        mfp = geometry->regions[next].mfp;
+        dt = mfp / v;
+    }
+}
+
+template<typename generator>
+void beamlineWalker<generator>::pipeDraw( randomStream<generator> &mc )
+{
+    //chance to be absorbed by pipe
+    pipeSteps++;
+    if (mc.bernoulli( lossPerStepThreshold )) status = particleStatus::pipe;
+}
+
+template class beamlineWalker<std::mt19937_64>;
+template class beamlineWalker<xoshiro256ss>;
+template class beamlineWalker<philox4x32>;
@@ -0,0 +1,314 @@
+/**
+* Throughput benchmarks for the random walk, written as JSON
+*/
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <cmath>
+#include <boost/program_options.hpp>
+#include <particle1d.hpp>
+#include <jumpwalker.hpp>
+#include <batchwalker.hpp>
+#include <output.hpp>
+#include <simulation.hpp>
+#include <mc.hpp>
+
+namespace po = boost::program_options;
+
+const uint64_t BENCHMARK_SEED = 1;
+
+// One measured configuration
+struct benchResult
+{
+    std::string name;
+    std::map<std::string, double> params;
+    std::string unit;                   // What items counts
+    double items;                       // Work done per repetition
+    std::vector<double> seconds;        // Time of each repetition
+
+    double best() const { return *std::min_element( seconds.begin(), seconds.end() ); }
+};
+
+// Time f() once per repetition. f returns the number of items it processed
+template<typename F>
+benchResult measure( std::string name, std::map<std::string, double> params, std::string unit, int repeat, F f )
+{
+    benchResult result{ name, params, unit, 0, {} };
+    for (int r = 0; r < repeat; r++)
+    {
+        std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+        result.items = f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.seconds.push_back( elapsed.count() );
+    }
+    std::cerr << name << ": " << result.items / result.best() << " " << unit << "/s\n";
+    return result;
+}
+
+// Walk particles [0, n) on this thread. Returns the total number of steps taken
+template<template<typename> class walker, typename generator>
+double walkSerial( std::map<std::string, double> params, int n, long long &particles, const velocitySpectrum &spectrum )
+{
+    std::uniform_real_distribution<double> start_time_distribution(0, nextafter(params["fillTime"], std::numeric_limits<double>::max()) );
+    randomStream<generator> mc;
+    walker<generator> ucn( 0, spectrum.fastest(), params );
+    long long steps = 0;
+    for (int i = 0; i < n; i++)
+    {
+        mc.seed( BENCHMARK_SEED, i );
+        const double tstart = start_time_distribution(mc);
+        ucn.resetState( tstart, spectrum.sample( mc ), i );
+        ucn.walk( mc );
+        steps += ucn.getState().totalSteps;
+    }
+    particles = n;
+    return steps;
+}
+
+// Direction bits, uniforms and Bernoulli checks from one generator
+template<typename generator>
+void measureGenerator( std::string name, long long draws, int repeat, std::vector<benchResult> &results )
+{
+    randomStream<generator> mc;
+    mc.seed( BENCHMARK_SEED, 0 );
+    volatile long long intSink = 0;
+    volatile double realSink = 0;
+    results.push_back( measure( "rng." + name + ".bit", {}, "draws", repeat, [&]{
+        long long sum = 0;
+        for (long long i = 0; i < draws; i++) sum += mc.bit();
+        intSink = sum;
+        return static_cast<double>(draws);
+    } ) );
+    results.push_back( measure( "rng." + name + ".uniform", {}, "draws", repeat, [&]{
+        double sum = 0;
+        for (long long i = 0; i < draws; i++) sum += mc.uniform();
+        realSink = sum;
+        return static_cast<double>(draws);
+    } ) );
+    const uint64_t threshold = bernoulliThreshold( 0.002 );
+    results.push_back( measure( "rng." + name + ".bernoulli", {}, "draws", repeat, [&]{
+        long long sum = 0;
+        for (long long i = 0; i < draws; i++) sum += mc.bernoulli( threshold );
+        intSink = sum;
+        return static_cast<double>(draws);
+    } ) );
+    // Exponentials from the ziggurat, and from the logarithm of a uniform as a reference
+    results.push_back( measure( "rng." + name + ".exponential", {}, "draws", repeat, [&]{
+        double sum = 0;
+        for (long long i = 0; i < draws; i++) sum += mc.exponential();
+        realSink = sum;
+        return static_cast<double>(draws);
+    } ) );
+    results.push_back( measure( "rng." + name + ".logUniform", {}, "draws", repeat, [&]{
+        double sum = 0;
+        for (long long i = 0; i < draws; i++) sum -= std::log( 1 - mc.uniform() );
+        realSink = sum;
+        return static_cast<double>(draws);
+    } ) );
+}
+
+po::variables_map processArguments( int argc, const char** argv );
+void writeJSON( std::ostream &out, const std::vector<benchResult> &results, int threads );
+
+int main( int argc, const char *argv[] )
+{
+    po::variables_map vm;
+    try
+    {
+        vm = processArguments( argc, argv );
+    } catch (std::exception& err) {
+        std::cerr << err.what() << "\nRun with --help argument\n";
+        return 1;
+    } catch (char const* helpFlag ) {
+        std::cerr << helpFlag << '\n';
+        return -1;
+    }
+
+    const int n = vm["n"].as<int>();
+    const int maxThreads = vm["threads"].as<int>();
+    const int repeat = vm["repeat"].as<int>();
+    const long long draws = vm["draws"].as<long long>();
+    std::vector<benchResult> results;
+
+    try
+    {
+        // RNG draws. std::uniform_int_distribution on mt19937_64 is how directions used to be drawn
+        std::mt19937_64 mt;
+        std::uniform_int_distribution<int> zeroOrOne(0, 1);
+        volatile long long intSink = 0;
+        volatile double realSink = 0;
+        results.push_back( measure( "rng.std.zeroOrOne", {}, "draws", repeat, [&]{
+            long long sum = 0;
+            for (long long i = 0; i < draws; i++) sum += zeroOrOne(mt);
+            intSink = sum;
+            return static_cast<double>(draws);
+        } ) );
+        measureGenerator<std::mt19937_64>( "mt19937_64", draws, repeat, results );
+        measureGenerator<xoshiro256ss>( "xoshiro256ss", draws, repeat, results );
+        measureGenerator<philox4x32>( "philox4x32", draws, repeat, results );
+
+        // Spectrum sampling, and walks with a spectrum instead of a single velocity
+        std::shared_ptr<const velocitySpectrum> mono = makeSpectrum( "mono" );
+        std::shared_ptr<const velocitySpectrum> v2 = makeSpectrum( "v2" );
+        results.push_back( measure( "spectrum.v2", {}, "draws", repeat, [&]{
+            randomStream<xoshiro256ss> mc;
+            mc.seed( BENCHMARK_SEED, 0 );
+            double sum = 0;
+            for (long long i = 0; i < draws; i++) sum += v2->sample( mc ).v;
+            realSink = sum;
+            return static_cast<double>(draws);
+        } ) );
+        results.push_back( measure( "walk.spectrum", {{"nonspec", 0.05}}, "particles", repeat, [&]{
+            long long particles;
+            walkSerial<particle1d, xoshiro256ss>( staticParameters( 0.05, 1e-4, 0.03, 0 ), n, particles, *v2 );
+            return static_cast<double>(particles);
+        } ) );
+
+        // Step kernel: without window or pipe loss nearly all of walk() is spent in step()
+        results.push_back( measure( "walk.lossless", {{"nonspec", 0.05}}, "steps", repeat, [&]{
+            long long particles;
+            return walkSerial<particle1d, xoshiro256ss>( staticParameters( 0.05, 0, 0, 0 ), n, particles, *mono );
+        } ) );
+
+        // Full walks per particle for every engine
+        for (double nonspec : {0.05, 0.9})
+            for (double mfp2 : {0., 0.1})
+            {
+                const std::map<std::string, double> params = staticParameters( nonspec, 1e-4, 0.03, mfp2 );
+                results.push_back( measure( "walk.step", {{"nonspec", nonspec}, {"mfp2", mfp2}}, "particles", repeat, [&]{
+                    long long particles;
+                    walkSerial<particle1d, xoshiro256ss>( params, n, particles, *mono );
+                    return static_cast<double>(particles);
+                } ) );
+                results.push_back( measure( "walk.jump", {{"nonspec", nonspec}, {"mfp2", mfp2}}, "particles", repeat, [&]{
+                    long long particles;
+                    walkSerial<jumpWalker, xoshiro256ss>( params, n, particles, *mono );
+                    return static_cast<double>(particles);
+                } ) );
+                results.push_back( measure( "walk.batch", {{"nonspec", nonspec}, {"mfp2", mfp2}}, "particles", repeat, [&]{
+                    std::vector<particleState> states;
+                    batchWalker( params, mono ).walk( BENCHMARK_SEED, 0, n, states );
+                    return static_cast<double>(states.size());
+                } ) );
+            }
+
+        // End to end through the pool, end states handed to the consumer in order
+        std::vector<int> threadCounts;
+        for (int t = 1; t < maxThreads; t *= 2) threadCounts.push_back( t );
+        threadCounts.push_back( maxThreads );
+        for (int threads : threadCounts)
+        {
+            results.push_back( measure( "simulate", {{"threads", threads}}, "particles", repeat, [&]{
+                long long consumed = 0;
+                simulate( staticParameters( 0.05, 1e-4, 0.03, 0 ), n * threads, threads, BENCHMARK_SEED,
+                          walkEngine::step, generatorType::xoshiro256ss, mono, false, [&consumed](const particleState&){ consumed++; } );
+                return static_cast<double>(consumed);
+            } ) );
+        }
+
+        // HDF5 table writes, including creating and closing the file
+        const std::string scratch = vm["scratch"].as<std::string>();
+        const hdfOutputFormat record( 0, 1, 2, 3., "cell", 4, 5, 6, 7., 8., 9. );
+        for (int records : {1000, 10000, 100000, 1000000})
+        {
+            results.push_back( measure( "hdf5.append", {{"records", records}}, "records", repeat, [&]{
+                hdfFile file( scratch );
+                {
+                    hdfTableWriter table( file, "table", std::map<std::string, double>() );
+                    for (int i = 0; i < records; i++) table.append( record );
+                }
+                file.close();
+                return static_cast<double>(records);
+            } ) );
+            results.push_back( measure( "hdf5.appendColumnar", {{"records", records}}, "records", repeat, [&]{
+                hdfFile file( scratch );
+                {
+                    hdfTableWriter table( file, "table", std::map<std::string, double>(),
+                                          columnFormat{ COLUMN_COMPRESSION, false, 0xFFFF } );
+                    for (int i = 0; i < records; i++) table.append( record );
+                }
+                file.close();
+                return static_cast<double>(records);
+            } ) );
+        }
+        std::remove( scratch.c_str() );
+    } catch (std::exception& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
+    }
+
+    const std::string out = vm["f"].as<std::string>();
+    if (out == "-")
+    {
+        writeJSON( std::cout, results, maxThreads );
+    } else {
+        std::ofstream file( out );
+        writeJSON( file, results, maxThreads );
+        if (!file) { std::cerr << "Unable to write " << out << '\n'; return 1; }
+    }
+    return 0;
+}
+
+/* Results as one JSON object. Names and units are plain identifiers, so nothing needs escaping */
+void writeJSON( std::ostream &out, const std::vector<benchResult> &results, int threads )
+{
+#ifdef __OPTIMIZE__
+    const bool optimized = true;
+#else
+    const bool optimized = false;
+#endif
+    out.precision( 9 );
+    out << "{\n  \"optimized\": " << (optimized ? "true" : "false") << ",\n";
+    out << "  \"threads\": " << threads << ",\n";
+    out << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const benchResult &r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"params\": {";
+        for (auto it = r.params.cbegin(); it != r.params.cend(); ++it)
+            out << (it == r.params.cbegin() ? "" : ", ") << "\"" << it->first << "\": " << it->second;
+        out << "}, \"unit\": \"" << r.unit << "\", \"items\": " << r.items << ", \"seconds\": [";
+        for (size_t j = 0; j < r.seconds.size(); j++) out << (j ? ", " : "") << r.seconds[j];
+        out << "], \"best\": " << r.best() << ", \"rate\": " << r.items / r.best() << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+/* Parse command line arguments */
+po::variables_map processArguments( int argc, const char** argv )
+{
+    po::variables_map vm;
+    po::options_description desc{"Usage"};
+    desc.add_options()
+        ("help,h", "Help")
+        ("n", po::value<int>()->default_value(20000), "Particles per walk benchmark (and per thread end to end)")
+        ("draws", po::value<long long>()->default_value(100000000), "Draws per RNG benchmark")
+        ("threads", po::value<int>()->default_value( std::max(1u, std::thread::hardware_concurrency()) ),
+                    "Largest thread count for the end to end benchmark")
+        ("repeat", po::value<int>()->default_value(3), "Repetitions of each benchmark (the best is reported)")
+        ("scratch", po::value<std::string>()->default_value("benchmark_scratch.h5"), "Scratch file for the HDF5 benchmark")
+        ("f", po::value<std::string>()->default_value("-"), "JSON output file (- for standard output)");
+
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << '\n';
+        throw "Doug Wong 2021";
+    } else {
+        po::notify(vm);
+    }
+
+    if (vm["threads"].as<int>() < 1) throw std::invalid_argument("--threads must be at least 1");
+    if (vm["repeat"].as<int>() < 1) throw std::invalid_argument("--repeat must be at least 1");
+
+    return vm;
+}
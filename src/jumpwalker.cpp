@@ -0,0 +1,341 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include "jumpwalker.hpp"
+#include "reweight.hpp"
+
+const long long MAX_TABLE_ENTRIES = 1 << 20;   // Upper limit on L * nmax for one first-passage table
+const double MODE_CUTOFF = 1e-18;               // Modes decayed below this are left out when sampling surviving sites
+const long long NO_PIPE_LOSS = std::numeric_limits<long long>::max() / 2;
+
+firstPassageTable::firstPassageTable( int L, int nmax )
+                    : L( L ), nmax( nmax ), exitCdf( L * (nmax + 1) ), topChance( L * (nmax + 1) ),
+                    mode( L * L ), eigenvalue( L )
+{
+    // Propagate the walk from every start site, absorbing at 0 and L+1
+    std::vector<double> p( L + 2 ), q( L + 2, 0 );
+    for (int i = 1; i <= L; i++)
+    {
+        std::fill( p.begin(), p.end(), 0 );
+        p[i] = 1;
+        double *cdf = &exitCdf[(i - 1) * (nmax + 1)];
+        double *top = &topChance[(i - 1) * (nmax + 1)];
+        for (int n = 1; n <= nmax; n++)
+        {
+            const double bottom = 0.5 * p[1];
+            const double upper = 0.5 * p[L];
+            cdf[n] = cdf[n - 1] + bottom + upper;
+            top[n] = (bottom + upper > 0) ? upper / (bottom + upper) : 0;
+            for (int y = 1; y <= L; y++) q[y] = 0.5 * (p[y - 1] + p[y + 1]);
+            p.swap( q );
+        }
+    }
+
+    // Eigen decomposition of the same walk, used to sample where a walker is after surviving m steps
+    for (int k = 1; k <= L; k++)
+    {
+        eigenvalue[k - 1] = std::cos( k * M_PI / (L + 1) );
+        for (int y = 1; y <= L; y++)
+            mode[(k - 1) * L + (y - 1)] = std::sqrt( 2. / (L + 1) ) * std::sin( k * y * M_PI / (L + 1) );
+    }
+}
+
+void firstPassageTable::survivingSites( int i, long long m, std::vector<double> &weights ) const
+{
+    weights.assign( L, 0 );
+    if (L == 1)
+    {
+        weights[0] = 1;
+        return;
+    }
+
+    // Short walks only reach a few sites, so propagate them directly
+    if (m * std::min<long long>( 2 * m + 1, L ) <= static_cast<long long>(L) * L)
+    {
+        std::vector<double> p( L + 2, 0 ), q( L + 2, 0 );
+        p[i] = 1;
+        for (long long n = 0; n < m; n++)
+        {
+            const int lo = std::max<long long>( 1, i - n - 1 );
+            const int hi = std::min<long long>( L, i + n + 1 );
+            for (int y = lo; y <= hi; y++) q[y] = 0.5 * (p[y - 1] + p[y + 1]);
+            p.swap( q );
+        }
+        std::copy( p.begin() + 1, p.end() - 1, weights.begin() );
+        return;
+    }
+
+    // Otherwise sum the modes that have not decayed, scaled by eigenvalue[0]^m so long walks
+    // do not underflow. Only relative weights matter
+    std::vector<int> modes;
+    std::vector<double> c;
+    modes.reserve( L );
+    c.reserve( L );
+    for (int k = 0; k < L; k++)
+    {
+        const double decay = std::pow( eigenvalue[k] / eigenvalue[0], static_cast<double>(m) );
+        if (std::abs( decay ) < MODE_CUTOFF) continue;
+        modes.push_back( k );
+        c.push_back( mode[k * L + (i - 1)] * decay );
+    }
+
+    for (int y = 1; y <= L; y++)
+    {
+        // Sites of the wrong parity have exactly zero chance
+        if ((std::abs( y - i ) + m) % 2 != 0) continue;
+        double sum = 0;
+        for (size_t j = 0; j < modes.size(); j++) sum += c[j] * mode[modes[j] * L + (y - 1)];
+        weights[y - 1] = std::max( 0., sum );
+    }
+}
+
+std::shared_ptr<const firstPassageTable> firstPassage( int L, int nmax )
+{
+    static std::mutex cacheMutex;
+    static std::map<int, std::shared_ptr<const firstPassageTable>> cache;
+
+    std::lock_guard<std::mutex> lock( cacheMutex );
+    std::shared_ptr<const firstPassageTable> &table = cache[L];
+    if (!table || table->nmax < nmax) table = std::make_shared<const firstPassageTable>( L, nmax );
+    return table;
+}
+
+template<typename generator>
+jumpWalker<generator>::jumpWalker( double startTime, const velocityBin &startVelocity, std::map<std::string, double> p )
+            : tally( nullptr ), start( p["start"] ), window( p["window"] ), cell( p["cell"] ),
+            source( p["source"] ), cellChance( p["cellChance"] ), lossPerStep( p["lossPerStep"] ),
+            windowLoss( p["windowLoss"] ), stepSize( p["stepSize"] ), stepSize2( p["stepSize2"] ), fillTime( p["fillTime"] ),
+            exponentialDwell( p["exponentialDwell"] != 0 ),
+            cellThreshold( bernoulliThreshold( cellChance ) ),
+            cellExitThreshold( stepSize2 != 0 ? bernoulliThreshold( cellEntranceChance( stepSize2, CELL_EXIT_NONSPEC ) ) : 0 ),
+            windowLossThreshold( bernoulliThreshold( windowLoss ) )
+{
+    direction = (source < cell) ? 1 : -1;
+    initial = makeLattice( start, stepSize, startVelocity.v );
+    afterExit = makeLattice( cell, (stepSize2 != 0) ? stepSize2 : stepSize, startVelocity.v );
+    resetState( startTime, startVelocity );
+}
+
+template<typename generator>
+typename jumpWalker<generator>::lattice jumpWalker<generator>::makeLattice( double origin, double mfp, double velocity ) const
+{
+    lattice g;
+    g.origin = origin;
+    g.mfp = mfp;
+    g.sourceSite = static_cast<int>( std::floor( (source - origin) * direction / mfp ) );
+    g.cellSite = static_cast<int>( std::ceil( (cell - origin) * direction / mfp ) );
+    g.windowSite = (window - origin) * direction / mfp;
+
+    // Split the sites between source and cell at the window
+    int bounds[4];
+    int count = 0;
+    bounds[count++] = g.sourceSite + 1;
+    if (g.windowSite > g.sourceSite && g.windowSite < g.cellSite)
+    {
+        const int below = static_cast<int>( std::ceil( g.windowSite ) ) - 1;   // Highest site below the window
+        bounds[count++] = below;
+        bounds[count++] = (below + 1 == g.windowSite) ? below + 2 : below + 1;
+    }
+    bounds[count++] = g.cellSite - 1;
+
+    // Tables cover a whole fill from t = 0, within memory limits. Longer walks are taken in several jumps
+    g.count = 0;
+    for (int j = 0; j < count; j += 2)
+    {
+        if (bounds[j] > bounds[j + 1]) continue;
+        const int L = bounds[j + 1] - bounds[j] + 1;
+        const long long steps = static_cast<long long>( std::ceil( fillTime * velocity / mfp ) ) + 1;
+        g.lo[g.count] = bounds[j];
+        g.hi[g.count] = bounds[j + 1];
+        g.table[g.count] = firstPassage( L, static_cast<int>( std::max( 1LL, std::min( steps, MAX_TABLE_ENTRIES / L ) ) ) );
+        g.count++;
+    }
+    return g;
+}
+
+template<typename generator>
+void jumpWalker<generator>::resetState( double startTime, const velocityBin &startVelocity, int num )
+{
+    particleNum = num;
+    windowHits = 0;
+    totalSteps = 0;
+    cellExits = 0;
+    pipeSteps = 0;
+    cellEntranceThreshold = cellThreshold;
+    grid = &initial;
+    site = 0;
+    status = particleStatus::alive;
+    cellRejections = 0;
+    tstart = startTime;
+    t = startTime;
+    v = startVelocity.v;
+    dt = grid->mfp / v;
+    cellExitLifetime = startVelocity.cellExitLifetime;
+}
+
+template<typename generator>
+particleState jumpWalker<generator>::getState() const
+{
+    return particleState{ particleNum, windowHits, totalSteps, grid->origin + direction * site * grid->mfp, status,
+                          cellRejections, cellExits, pipeSteps, v, tstart, t };
+}
+
+template<typename generator>
+void jumpWalker<generator>::setLossTally( lossTally *t )
+{
+    tally = t;
+}
+
+template<typename generator>
+long long jumpWalker<generator>::samplePipeBudget( randomStream<generator> &mc )
+{
+    if (lossPerStep <= 0) return NO_PIPE_LOSS;
+    if (lossPerStep >= 1) return 0;
+    const double u = 1 - mc.uniform();   // (0, 1]
+    return static_cast<long long>( std::min<double>( std::floor( std::log( u ) / std::log1p( -lossPerStep ) ), NO_PIPE_LOSS ) );
+}
+
+template<typename generator>
+void jumpWalker<generator>::walk( randomStream<generator> &mc )
+{
+    if (totalSteps == 0) pipeBudget = samplePipeBudget( mc );
+
+    while ( (t < fillTime) && status == particleStatus::alive )
+    {
+        // The first step ignores the window, and sites outside the intervals (on the window,
+        // beyond the source or cell) are rare, so both are walked one step at a time
+        int interval = -1;
+        if (totalSteps > 0)
+            for (int j = 0; j < grid->count; j++)
+                if (grid->lo[j] <= site && site <= grid->hi[j]) interval = j;
+
+        if (interval < 0) {
+            step( mc );
+        } else {
+            jump( mc, interval );
+        }
+    }
+}
+
+template<typename generator>
+void jumpWalker<generator>::step( randomStream<generator> &mc )
+{
+    const int from = site;
+    site += 1 - 2 * mc.bit();
+    t += dt;
+    totalSteps++;
+    arrive( from, mc );
+}
+
+template<typename generator>
+void jumpWalker<generator>::jump( randomStream<generator> &mc, int interval )
+{
+    const firstPassageTable &table = *grid->table[interval];
+    const int lo = grid->lo[interval];
+    const int hi = grid->hi[interval];
+    const int i = site - lo + 1;
+
+    // Steps before fillTime, the next pipe loss or the end of the table, whichever is first
+    long long m = std::max( 1LL, static_cast<long long>( std::ceil( (fillTime - t) / dt ) ) );
+    m = std::min( m, pipeBudget + 1 );
+    m = std::min<long long>( m, table.nmax );
+
+    const double *cdf = &table.exitCdf[(i - 1) * (table.nmax + 1)];
+    const double u = mc.uniform();
+    if (u < cdf[m])
+    {
+        // Leaves the interval on step n, drawing for pipe loss on the n-1 steps before
+        const int n = std::upper_bound( cdf + 1, cdf + m + 1, u ) - cdf;
+        const bool top = mc.uniform() < table.topChance[(i - 1) * (table.nmax + 1) + n];
+        t += n * dt;
+        totalSteps += n;
+        pipeSteps += n - 1;
+        pipeBudget -= n - 1;
+
+        const int from = top ? hi : lo;
+        site = top ? hi + 1 : lo - 1;
+        arrive( from, mc );
+    } else {
+        // Still inside after m steps, every one of which drew for pipe loss
+        table.survivingSites( i, m, weights );
+        double r = mc.uniform() * std::accumulate( weights.begin(), weights.end(), 0. );
+        int y = 0;
+        while (y < table.L - 1 && (r -= weights[y]) >= 0) y++;
+        while (y > 0 && weights[y] == 0) y--;     // Guards against rounding past the last reachable site
+
+        site = lo + y;
+        t += m * dt;
+        totalSteps += m;
+        pipeSteps += m;
+        if (m == pipeBudget + 1) {
+            status = particleStatus::pipe;
+        } else {
+            pipeBudget -= m;
+        }
+    }
+}
+
+template<typename generator>
+void jumpWalker<generator>::arrive( int from, randomStream<generator> &mc )
+{
+    const double w = grid->windowSite;
+    const bool crossedWindow = (from < w && w < site) || (from > w && w > site) || (site == w);
+
+    // Same checks, in the same order, as particle1d::step
+    if (crossedWindow && totalSteps > 1) {
+        windowHits++;
+        if (tally) tally->windowHit( windowHits - 1, pipeSteps );
+        if (mc.bernoulli( windowLossThreshold )) status = particleStatus::window;  //chance for loss on the window
+    } else if (site <= grid->sourceSite) {
+        status = particleStatus::source; // neutrons get absorbed by the source
+    } else if (site >= grid->cellSite) {
+        // chance for neutrons to get into cell
+        if (mc.bernoulli( cellEntranceThreshold )) {
+            const double dwell = exponentialDwell ? cellExitLifetime * mc.exponential() : cellExitLifetime;
+            if ( (fillTime - t) < dwell )
+            {
+                status = particleStatus::cell;
+                t = fillTime;
+            } else {
+                // If neutron exits the cell, continue on the lattice starting one step from the cell
+                t += dwell;
+                cellExits++;
+                totalSteps++;
+
+                if (stepSize2 != 0)
+                    cellEntranceThreshold = cellExitThreshold;
+
+                grid = &afterExit;
+                dt = grid->mfp / v;
+                site = -1;
+            }
+        } else {
+            //neutron rejected from entrance
+            site = from;
+            totalSteps++;
+            cellRejections++;
+            t += dt;
+        }
+    } else {
+        pipeDraw();
+    }
+}
+
+template<typename generator>
+void jumpWalker<generator>::pipeDraw()
+{
+    //chance to be absorbed by pipe
+    pipeSteps++;
+    if (pipeBudget == 0) {
+        status = particleStatus::pipe;
+    } else {
+        pipeBudget--;
+    }
+}
+
+template class jumpWalker<std::mt19937_64>;
+template class jumpWalker<xoshiro256ss>;
+template class jumpWalker<philox4x32>;
@@ -10,28 +10,50 @@
 #include <iterator>
 #include <boost/program_options.hpp>
 #include <particle1d.hpp>
-#include <boost/variant.hpp>
-#include <boost/progress.hpp>
 #include <output.hpp>
+#include <simulation.hpp>
+#include <reweight.hpp>
+#include <summary.hpp>
+#include <beamline.hpp>
+#include <markov.hpp>
+#include <metrics.hpp>
+#include <serve.hpp>
 #include <chrono>
 #include <mc.hpp>
 #include <random>
 #include <string>
+#include <sstream>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <cstdarg>
 
 namespace po = boost::program_options;
 
-po::variables_map processArguments(int argc, const char** argv);
+// Outcome fractions of one point of a run, as in the reweight table, for --serve replies
+struct pointOutcome
+{
+    std::string group;
+    long long particles;
+    std::vector<reweightOutputFormat> outcomes;
+};
 
-// uint64_t seed = 0; ///< random seed used for random-number generator (generated from high-resolution clock)
+struct runOutcome
+{
+    uint64_t seed;
+    double seconds;
+    std::vector<pointOutcome> points;
+};
 
-////////// input parameters ////////////
-const double pipeID = 3 * 0.0254;                                // Inner diameter of the pipe [m]
-const double pipeL  = 12;                                        // Total length of the pipe [m]
-const double gateValve  = 6;                                     // starting position [m]
-const double window = 9.1;                                       // PPM window location
-const double source = 0;                                         // source location
-const double fillTime = 50;                                    // source active time
-////////////////////////////////////////
+po::options_description simulationOptions();
+po::variables_map processArguments(int argc, const char** argv);
+runOutcome runSimulation(const po::variables_map &vm, workStealingPool &pool, std::ostream &log);
+void serve(const po::variables_map &vm, workStealingPool &pool);
+std::string format(const char *fmt, ...);
+std::vector<double> parseValues(const std::string &spec, const std::string &option);
+void parseShard(const std::string &spec, int &shard, int &shards);
 
 int main(int argc, const char *argv[])
 {
@@ -48,100 +70,537 @@ int main(int argc, const char *argv[])
         return -1;
     }
 
-     // Calculate parameters to pass to particle1d
-    const double nonspec = vm["ns"].as<double>();                     // Chance for a nonspecular bounce
-    const double lossPerBounce = vm["lpb"].as<double>();              // Loss per bounce (NiPh)
-    const double windowLoss = vm["wl"].as<double>();                  // Chance for loss when passing through window
-    const double mfp = pipeID * sqrt( 2*(2-nonspec)/nonspec/3 );     // Mean free path. eq.  4.79, eq.  4.70, and eq.  4.48 in Golub
-    const double mfp2 =  vm["mfp2"].as<double>();                     // Mean free path after neutron exits cell
-    // const double mfp = vm["mfp"].as<double>();     // Mean free path
+    try
+    {
+        workStealingPool pool( vm["threads"].as<int>() );
+        if (vm["serve"].as<bool>()) {
+            serve( vm, pool );
+        } else {
+            runSimulation( vm, pool, std::cout );
+        }
+    } catch (std::exception& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
+    }
 
-    // get high-resolution timestamp to generate seed
+    return 0;
+}
+
+runOutcome runSimulation(const po::variables_map &vm, workStealingPool &pool, std::ostream &log)
+{
+    if (!vm.count("n") || !vm.count("f")) throw std::invalid_argument("--n and --f are required");
+
+    // get high-resolution timestamp to generate seed, unless one was given
     uint64_t seed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (vm.count("seed")) seed = vm["seed"].as<uint64_t>();
 
     // simulation time counter
     std::chrono::time_point<std::chrono::steady_clock> simstart = std::chrono::steady_clock::now();
 
-    // load random number generator
-    TMCGenerator mc;
-    mc.seed(seed);
-    std::uniform_real_distribution<double> start_time_distribution(0, nextafter(fillTime, std::numeric_limits<double>::max()) ); // Uniform distribution [0,fillTime]
-
-    std::map<std::string, double> static_parameters = {
-        {"stepSize",  mfp},
-        {"nonspec",  nonspec},
-        {"lossPerBounce",  lossPerBounce},
-        {"cell", pipeL},
-        {"window", window},
-        {"windowLoss", windowLoss},
-        {"start", gateValve},
-        {"source", source},
-        {"fillTime", fillTime},
-        // {"cellChance", 0.35},
-        {"cellChance", std::pow( (1 - std::pow( 1- std::pow(CELL_ENTRANCE_ID/2 , 2) / pipeID / mfp , 1/nonspec) ) , 2 )},
-        {"stepSize2", mfp2},
-        {"lossPerStep", (1/nonspec) * lossPerBounce},
+    // Every combination of ns, lpb, wl and mfp2 is one point. Reweighted points are walked
+    // without window or pipe loss and cover every lpb and wl value at once
+    const bool reweight = vm["reweight"].as<bool>();
+    const std::vector<double> lossesPerBounce = parseValues( vm["lpb"].as<std::string>(), "lpb" );
+    const std::vector<double> windowLosses = parseValues( vm["wl"].as<std::string>(), "wl" );
+    const std::vector<double> mfp2s = parseValues( vm["mfp2"].as<std::string>(), "mfp2" );
+    std::vector< std::map<std::string, double> > points;
+    for (double nonspec : parseValues( vm["ns"].as<std::string>(), "ns" ))
+        for (double lossPerBounce : reweight ? std::vector<double>{0} : lossesPerBounce)
+            for (double windowLoss : reweight ? std::vector<double>{0} : windowLosses)
+                for (double mfp2 : mfp2s)
+                    points.push_back( staticParameters( nonspec, lossPerBounce, windowLoss, mfp2 ) );
+
+    const bool sweep = vm["sweep"].as<bool>();
+    const walkEngine engine = parseEngine( vm["engine"].as<std::string>() );
+    const generatorType rng = parseGenerator( vm["rng"].as<std::string>() );
+    std::shared_ptr<const velocitySpectrum> spectrum = makeSpectrum( vm["spectrum"].as<std::string>(),
+                                                                     vm.count("spectrum-file") ? vm["spectrum-file"].as<std::string>() : "" );
+    std::unique_ptr<beamlineLayout> layout;
+    if (vm.count("geometry")) layout.reset( new beamlineLayout( readBeamline( vm["geometry"].as<std::string>() ) ) );
+    if (points.size() > 1 && !sweep)
+        throw std::invalid_argument("Multiple values for --ns, --mfp2 (or --lpb, --wl without --reweight) require --sweep");
+
+    // Particles [first, first + n) of the run. Each particle's stream only depends on the seed and
+    // its number, so shards of one seed merge into exactly the single process run
+    int n = vm["n"].as<int>();
+    int first = 0;
+    int shard = 0, shards = 0;
+    if ((vm.count("shard") || vm.count("first-particle")) && !vm.count("seed"))
+        throw std::invalid_argument("--shard and --first-particle need --seed, so every part draws from the same streams");
+    if (vm.count("shard") && vm.count("first-particle"))
+        throw std::invalid_argument("Only one of --shard and --first-particle can be given");
+    if (vm.count("shard"))
+    {
+        parseShard( vm["shard"].as<std::string>(), shard, shards );
+        first = static_cast<int>( static_cast<long long>(n) * shard / shards );
+        n = static_cast<int>( static_cast<long long>(n) * (shard + 1) / shards ) - first;
+    }
+    if (vm.count("first-particle")) first = vm["first-particle"].as<int>();
+
+    // An exponential dwell is passed to the walkers as a parameter of every point, so it is also recorded with them
+    if (parseCellDwell( vm["cell-dwell"].as<std::string>() ) == cellDwell::exponential)
+        for (auto &point : points) point["exponentialDwell"] = 1;
+
+    // The geometry file places the sources, windows and cells instead of the default beamline,
+    // so its text is recorded with the run in place of the default positions
+    std::vector< std::map<std::string, double> > recorded( points );
+    if (layout)
+        for (auto &point : recorded)
+            for (const char *position : {"source", "start", "window", "cell"}) point.erase( position );
+
+    const bool markov = (engine == walkEngine::markov);
+    if (markov && (reweight || layout || vm.count("target-rel-error") || vm.count("shard") || vm.count("first-particle")))
+        throw std::invalid_argument("--engine markov solves every point exactly, without --reweight, --geometry, "
+                                    "--target-rel-error, --shard or --first-particle");
+
+    // With --branch-mfp2, consecutive points that only differ in mfp2 share each particle's walk up to its first cell exit
+    const bool branch = vm["branch-mfp2"].as<bool>();
+    if (branch && (engine != walkEngine::step || layout || vm.count("target-rel-error")))
+        throw std::invalid_argument("--branch-mfp2 needs --engine step, and does not support --geometry or --target-rel-error");
+
+    // With --target-rel-error, each point walks batches of n particles until its observables are
+    // precise enough. Batch k always holds particles [k n, (k+1) n), so where a point stops only
+    // depends on the seed
+    const bool adaptive = vm.count("target-rel-error");
+    double target = 0;
+    int maxN = n;
+    std::vector<std::string> observables;
+    if (adaptive)
+    {
+        if (vm.count("shard") || vm.count("first-particle"))
+            throw std::invalid_argument("--target-rel-error walks whole runs, and cannot be combined with --shard or --first-particle");
+        target = vm["target-rel-error"].as<double>();
+        if (!(target > 0)) throw std::invalid_argument("--target-rel-error must be positive");
+        if (n < 1) throw std::invalid_argument("--n particles per batch must be at least 1");
+        maxN = vm.count("max-n") ? vm["max-n"].as<int>()
+                                 : static_cast<int>( std::min<long long>( 100LL * n, std::numeric_limits<int>::max() ) );
+        if (maxN < 1) throw std::invalid_argument("--max-n must be at least 1");
+        std::stringstream items( vm["target-observables"].as<std::string>() );
+        std::string item;
+        while (std::getline( items, item, ',' ))
+        {
+            summaryStats().relativeError( item );    // Throws on unknown names
+            observables.push_back( item );
+        }
+        if (observables.empty()) throw std::invalid_argument("No --target-observables given");
+    }
+
+    // Run particles through MC simulation, streaming end states to file.
+    // A sweep puts each point's table in its own group, with the point's parameters on the group.
+    // The run's task group is declared last so its tasks finish before the tables they write to are destroyed
+    const bool summaryOnly = vm["summary-only"].as<bool>();
+    const bool columnar = (parseLayout( vm["layout"].as<std::string>() ) == tableLayout::columnar);
+    log << "Writing data to file " << vm["f"].as<std::string>() << "\n";
+    log << "Seed: " << seed << "\n";
+    if (adaptive) {
+        log << "Batches of " << n << " particles up to " << maxN << ", until the relative error is below " << target << "\n";
+    } else {
+        log << "Particles " << first << " to " << static_cast<long long>(first) + n - 1 << "\n";
+    }
+    hdfFile file( vm["f"].as<std::string>() );
+    file.setAttribute( "/", "seed", seed );
+    if (layout) file.setAttribute( "/", "geometry", layout->text );
+    std::vector< std::unique_ptr<hdfTableWriter> > tables;
+    std::vector< std::unique_ptr<lossTally> > tallies;
+    std::vector< std::unique_ptr<summaryStats> > summaries;
+    std::vector<particleConsumer> consumers;
+    std::vector< std::shared_ptr<const beamline> > geometries;
+    std::vector< std::unique_ptr<markovSolver> > solvers;
+    // The reporter takes the place of the progress bar
+    std::unique_ptr<metricsReporter> reporter;
+    const long long expected = markov ? 0 : static_cast<long long>( adaptive ? maxN : n ) * points.size();
+    if (vm.count("metrics")) reporter.reset( new metricsReporter( vm["metrics"].as<std::string>(), vm["metrics-interval"].as<double>(), expected ) );
+    const bool progress = vm["progress"].as<bool>() && !reporter;
+    taskGroup tasks;
+    taskGroup::scope inRun( tasks );        // pool.wait() only waits for this run
+    std::atomic<long> done(0);
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        const std::string group = sweep ? "point_" + std::to_string(i) + "/" : "";
+        if (sweep) file.createGroup( group, recorded[i] );
+        log << "\n### Parameters " << group << "table ###\n";
+        print_map(recorded[i], log);
+        if (markov)
+        {
+            solvers.emplace_back( new markovSolver( points[i], spectrum ) );
+            solvers.back()->schedule( pool );
+            continue;
+        }
+
+        // The beamline takes the point's mfp and losses wherever the file does not set them
+        std::shared_ptr<const beamline> geometry;
+        if (layout) geometry = std::make_shared<const beamline>( *layout, points[i] );
+
+        particleConsumer consume;
+        if (!summaryOnly)
+        {
+            const std::map<std::string, double> attributes = sweep ? std::map<std::string, double>() : recorded[i];
+            if (columnar) {
+                const columnFormat format{ vm["compression"].defaulted() ? COLUMN_COMPRESSION : vm["compression"].as<int>(),
+                                           vm["lz4"].as<bool>(), stepBound( points[i], *spectrum, geometry.get() ) };
+                tables.emplace_back( new hdfTableWriter( file, group + "table", attributes, format ) );
+            } else {
+                tables.emplace_back( new hdfTableWriter( file, group + "table", attributes,
+                                                         vm["compression"].as<int>(), vm["shuffle"].as<bool>() ) );
+            }
+            hdfTableWriter *table = tables.back().get();
+            consume = [table](const particleState &state){ table->append( hdfOutputFormat(state) ); };
+        }
+        summaries.emplace_back( new summaryStats() );
+
+        if (reweight)
+        {
+            std::vector<lossPoint> grid;
+            for (double lossPerBounce : lossesPerBounce)
+                for (double windowLoss : windowLosses)
+                    grid.push_back( lossPoint{ windowLoss, lossPerBounce, (1/points[i]["nonspec"]) * lossPerBounce } );
+            tallies.emplace_back( new lossTally( grid ) );
+        }
+        consumers.push_back( consume );
+        geometries.push_back( geometry );
+    }
+
+    // Schedule particles [from, from + count) of point i
+    auto schedule = [&]( size_t i, int from, int count ) {
+        scheduleRun( pool, points[i], from, count, seed, engine, rng, spectrum, consumers[i], done,
+                     reweight ? tallies[i].get() : nullptr, summaries[i].get(), geometries[i] );
     };
+    if (markov) {
+        pool.wait();
+    } else if (branch) {
+        for (size_t i = 0; i < points.size(); i += mfp2s.size())
+        {
+            std::vector<lossTally*> branchTallies;
+            std::vector<summaryStats*> branchSummaries;
+            for (size_t j = i; j < i + mfp2s.size(); j++)
+            {
+                branchTallies.push_back( reweight ? tallies[j].get() : nullptr );
+                branchSummaries.push_back( summaries[j].get() );
+            }
+            scheduleBranchedRun( pool, std::vector< std::map<std::string, double> >( points.begin() + i, points.begin() + i + mfp2s.size() ),
+                                 first, n, seed, rng, spectrum,
+                                 std::vector<particleConsumer>( consumers.begin() + i, consumers.begin() + i + mfp2s.size() ),
+                                 done, branchTallies, branchSummaries );
+        }
+        waitForRuns( pool, static_cast<long>(n) * points.size(), done, progress );
+    } else if (!adaptive) {
+        for (size_t i = 0; i < points.size(); i++) schedule( i, first, n );
+        waitForRuns( pool, static_cast<long>(n) * points.size(), done, progress );
+    }
+    std::vector<size_t> running;
+    if (adaptive) for (size_t i = 0; i < points.size(); i++) running.push_back( i );
+    for (long long from = 0; !running.empty(); from += n)
+    {
+        const int count = static_cast<int>( std::min<long long>( n, maxN - from ) );
+        for (size_t i : running) schedule( i, static_cast<int>( from ), count );
+        waitForRuns( pool, static_cast<long>(count) * running.size(), done, false );
+
+        std::vector<size_t> unfinished;
+        for (size_t i : running)
+        {
+            double error = 0;
+            for (auto const& observable : observables) error = std::max( error, summaries[i]->relativeError( observable ) );
+            if (error > target && from + count < maxN)
+            {
+                unfinished.push_back( i );
+                continue;
+            }
+            log << format("%s stopped after %lld particles with relative error %g\n", sweep ? ("point_" + std::to_string(i)).c_str() : "Run",
+                   summaries[i]->particles(), error);
+        }
+        running.swap( unfinished );
+        if (reporter) reporter->expect( done + static_cast<long long>( maxN - from - count ) * running.size() );
+    }
+
+    // Particles of the largest point. Summaries hold the count of each point
+    long long particles = 0;
+    for (auto const& summary : summaries) particles = std::max( particles, summary->particles() );
+    std::map<std::string, long long> range{ {"firstParticle", first}, {"particles", particles} };
+    if (shards) range.insert( { {"shard", shard}, {"shards", shards} } );
+    file.setAttributes( "/", range );
+
+    for (size_t i = 0; i < summaries.size(); i++)
+    {
+        const std::string group = sweep ? "point_" + std::to_string(i) + "/" : "";
+        std::map<std::string, double> attributes = sweep ? std::map<std::string, double>() : recorded[i];
+        if (adaptive) attributes["targetRelError"] = target;
+        summaries[i]->write( file, group + "summary", attributes );
+
+        log << "\n### " << group << "summary ###\n";
+        summaries[i]->print( log );
+    }
 
-    std::cout << "\n### Parameters ###\n";
-    print_map(static_parameters);
+    for (size_t i = 0; i < tallies.size(); i++)
+    {
+        const std::string group = sweep ? "point_" + std::to_string(i) + "/" : "";
+        const std::vector<reweightOutputFormat> results = tallies[i]->results();
+        writeReweight( file, group + "reweight", results, sweep ? std::map<std::string, double>() : recorded[i] );
+        file.writeArray( group + "reweightSums", tallies[i]->rawSums() );     // Exact sums for randomWalk_merge.x
 
-    std::vector<hdfOutputFormat> data;
+        log << "\n### Reweighted " << group << "table ###\n";
+        for (auto const& r : results)
+            log << format("wl: %g\tlpb: %g\tcell: %.5f\twindow: %.5f\tpipe: %.5f\tsource: %.5f\n",
+                   r.windowLoss, r.lossPerBounce, r.cell, r.window, r.pipe, r.source);
+    }
 
-    // Initialize particle and run through MC simulation
-    particle1d ucn( start_time_distribution(mc), v2_average, static_parameters );
-    boost::progress_display show_progress( vm["n"].as<int>()  );
-    for  (int i = 0; i < vm["n"].as<int>(); i++)
+    std::vector<reweightOutputFormat> expectedRows;
+    for (size_t i = 0; i < solvers.size(); i++)
     {
-        ucn.walk( mc );
-        std::map<std::string, boost::variant<double, int, std::string>> endstate = ucn.getState();
-        // print_map( endstate );
-        ucn.resetState( start_time_distribution(mc), v2_average, i + 1 );
-
-        data.push_back( hdfOutputFormat{    boost::get<int>(endstate["particleNum"]),
-                                            boost::get<int>(endstate["windowHits"]),
-                                            boost::get<int>(endstate["totalSteps"]),
-                                            boost::get<double>(endstate["location"]),
-                                            boost::get<std::string>(endstate["status"]),
-                                            boost::get<int>(endstate["cellRejections"]),
-                                            boost::get<int>(endstate["cellExits"]),
-                                            boost::get<double>(endstate["velocity"]),
-                                            boost::get<double>(endstate["tstart"]),
-                                            boost::get<double>(endstate["tend"]) }
-                        );
-
-        if (vm["progress"].as<bool>()) ++show_progress;
+        // Expected outcomes in the format of the reweight table, and the cell's windowHits histogram as fractions of all particles
+        const std::string group = sweep ? "point_" + std::to_string(i) + "/" : "";
+        const markovResult r = solvers[i]->result();
+        const reweightOutputFormat row{ points[i]["windowLoss"], points[i]["lossPerBounce"], points[i]["lossPerStep"],
+                                        r.source, r.pipe, r.window, r.cell, r.alive(), r.meanCellWindowHits() };
+        expectedRows.push_back( row );
+        writeReweight( file, group + "expected", std::vector<reweightOutputFormat>{ row }, sweep ? std::map<std::string, double>() : recorded[i] );
+        file.writeArray( group + "expectedWindowHits", r.cellWindowHits );
+
+        log << "\n### Expected " << group << "outcome ###\n";
+        log << format("cell: %.6f\twindow: %.6f\tpipe: %.6f\tsource: %.6f\talive: %.6f\tcell window hits: %.4f\n",
+               r.cell, r.window, r.pipe, r.source, r.alive(), r.meanCellWindowHits());
     }
 
     std::chrono::time_point<std::chrono::steady_clock> simend = std::chrono::steady_clock::now();
     float SimulationTime = std::chrono::duration_cast<std::chrono::milliseconds>(simend - simstart).count()/1000.;
-    printf("\nSimulation Time: %.2fs\n", SimulationTime);
+    log << format("\nSimulation Time: %.2fs\n", SimulationTime);
 
-    // Output to file
-    std::cout << "Writing data to file " << vm["f"].as<std::string>() << " ...";
-    writeToHDF( vm["f"].as<std::string>(),  data, static_parameters);
-    std::cout << "Done!\n";
+    log << "Flushing remaining records...";
+    tables.clear();
+    file.close();
+    log << "Done!\n";
+    if (reporter) reporter->stop();
 
-    return 0;
+    // Outcome fractions of every point, in the format of the reweight table
+    runOutcome outcome{ seed, std::chrono::duration<double>(simend - simstart).count(), std::vector<pointOutcome>() };
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        const std::string group = sweep ? "point_" + std::to_string(i) + "/" : "";
+        if (markov)
+        {
+            outcome.points.push_back( pointOutcome{ group, 0, std::vector<reweightOutputFormat>{ expectedRows[i] } } );
+            continue;
+        }
+        const summaryStats &s = *summaries[i];
+        const double total = std::max( 1LL, s.particles() );
+        std::vector<reweightOutputFormat> rows;
+        if (reweight) {
+            rows = tallies[i]->results();
+        } else {
+            rows.push_back( reweightOutputFormat{ points[i]["windowLoss"], points[i]["lossPerBounce"], points[i]["lossPerStep"],
+                                                  s.count( particleStatus::source ) / total, s.count( particleStatus::pipe ) / total,
+                                                  s.count( particleStatus::window ) / total, s.count( particleStatus::cell ) / total,
+                                                  s.count( particleStatus::alive ) / total, s.meanWindowHits() } );
+        }
+        outcome.points.push_back( pointOutcome{ group, s.particles(), rows } );
+    }
+    return outcome;
 }
 
-/* Parse command line arguments */
-po::variables_map processArguments(int argc, const char** argv)
+/* Parse a comma separated list of values and start:stop:step ranges (stop inclusive), optionally in parentheses */
+std::vector<double> parseValues(const std::string &spec, const std::string &option)
 {
+    std::string list = spec;
+    if (list.size() >= 2 && list.front() == '(' && list.back() == ')') list = list.substr(1, list.size() - 2);
 
-    po::variables_map vm;
+    // One number, all of text
+    auto number = [&]( const std::string &text, const std::string &item ) {
+        size_t used = 0;
+        double value = 0;
+        try {
+            value = std::stod(text, &used);
+        } catch (std::logic_error&) {}      // std::invalid_argument and std::out_of_range
+        if (used == 0 || text.find_first_not_of(" \t", used) != std::string::npos)
+            throw std::invalid_argument("--" + option + ": '" + item + "' is not a number or start:stop:step range");
+        return value;
+    };
+
+    std::vector<double> values;
+    std::stringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ','))
+    {
+        size_t first = item.find(':');
+        if (first == std::string::npos)
+        {
+            values.push_back( number(item, item) );
+            continue;
+        }
+
+        size_t second = item.find(':', first + 1);
+        if (second == std::string::npos) throw std::invalid_argument("--" + option + ": range " + item + " must be start:stop:step");
+        const double start = number( item.substr(0, first), item );
+        const double stop = number( item.substr(first + 1, second - first - 1), item );
+        const double step = number( item.substr(second + 1), item );
+        if (step <= 0 || stop < start) throw std::invalid_argument("--" + option + ": range " + item + " needs step > 0 and stop >= start");
+
+        // Computed from start rather than accumulated, with a little slack so stop is included
+        for (int i = 0; start + i * step <= stop + 1e-9 * step; i++) values.push_back( start + i * step );
+    }
+    if (values.empty()) throw std::invalid_argument("--" + option + ": no values given in '" + spec + "'");
+    return values;
+}
+
+/* Parse a shard given as i/N, with 0 <= i < N */
+void parseShard(const std::string &spec, int &shard, int &shards)
+{
+    size_t slash = spec.find('/');
+    size_t end = 0;
+    try {
+        if (slash == std::string::npos) throw std::invalid_argument(spec);
+        shard = std::stoi( spec.substr(0, slash), &end );
+        if (end != slash) throw std::invalid_argument(spec);
+        shards = std::stoi( spec.substr(slash + 1), &end );
+        if (end != spec.size() - slash - 1) throw std::invalid_argument(spec);
+    } catch (std::logic_error&) {
+        throw std::invalid_argument("Shard " + spec + " must be i/N");
+    }
+    if (shards < 1 || shard < 0 || shard >= shards) throw std::invalid_argument("Shard " + spec + " needs 0 <= i < N");
+}
+
+/* Run jobs given as JSON lines on stdin, or on a Unix socket, on one pool that stays up between jobs */
+void serve(const po::variables_map &vm, workStealingPool &pool)
+{
+    const po::options_description desc = simulationOptions();
+    const std::set<std::string> serverOnly{ "help", "serve", "socket", "jobs", "metrics", "metrics-interval" };
+    const std::set<std::string> ignored{ "threads", "progress" };   // Jobs run on the server's threads, without a progress bar
+
+    jobServer server( [&]( const std::string &line ) {
+        std::string id = "null";
+        try
+        {
+            // Every name is an option of the command line, given the value it would take there
+            const std::map<std::string, jsonValue> values = parseJobLine( line );
+            if (values.count("id")) id = jsonText( values.at("id") );
+            std::vector<std::string> args{ "--progress", "false" };
+            for (auto const& it : values)
+            {
+                if (it.first == "id" || ignored.count( it.first ) || it.second.type == jsonValue::null) continue;
+                if (serverOnly.count( it.first )) throw std::invalid_argument("--" + it.first + " cannot be given to a --serve job");
+                const po::option_description *option = desc.find_nothrow( it.first, false );
+                if (!option) throw std::invalid_argument("Unknown option " + it.first);
+                if (option->semantic()->max_tokens() == 0) {
+                    if (it.second.type != jsonValue::boolean) throw std::invalid_argument(it.first + " must be true or false");
+                    if (it.second.text == "true") args.push_back( "--" + it.first );
+                } else {
+                    args.push_back( "--" + it.first );
+                    args.push_back( it.second.text );
+                }
+            }
+            po::variables_map job;
+            po::store( po::command_line_parser( args ).options( desc ).run(), job );
+            po::notify( job );
+
+            std::ostream log( nullptr );    // The log of a job is dropped, and its reply holds the outcomes
+            const runOutcome outcome = runSimulation( job, pool, log );
+
+            std::ostringstream reply;
+            reply.precision( 10 );
+            reply << "{\"id\": " << id << ", \"ok\": true, \"f\": " << jsonString( job["f"].as<std::string>() )
+                  << ", \"seed\": " << outcome.seed << ", \"seconds\": " << outcome.seconds << ", \"points\": [";
+            for (size_t i = 0; i < outcome.points.size(); i++)
+            {
+                const pointOutcome &point = outcome.points[i];
+                reply << (i ? ", " : "") << "{\"group\": " << jsonString( point.group ) << ", \"particles\": " << point.particles << ", \"outcomes\": [";
+                for (size_t j = 0; j < point.outcomes.size(); j++)
+                {
+                    const reweightOutputFormat &r = point.outcomes[j];
+                    reply << (j ? ", " : "") << "{\"wl\": " << r.windowLoss << ", \"lpb\": " << r.lossPerBounce
+                          << ", \"source\": " << r.source << ", \"pipe\": " << r.pipe << ", \"window\": " << r.window
+                          << ", \"cell\": " << r.cell << ", \"alive\": " << r.alive << ", \"cellWindowHits\": " << r.cellWindowHits << "}";
+                }
+                reply << "]}";
+            }
+            reply << "]}";
+            return reply.str();
+        } catch (std::exception& err) {
+            return "{\"id\": " + id + ", \"ok\": false, \"error\": " + jsonString( err.what() ) + "}";
+        }
+    }, vm["jobs"].as<int>() );
+
+    if (vm.count("socket")) {
+        std::cerr << "Serving jobs on " << vm["socket"].as<std::string>() << "\n";
+        server.serveSocket( vm["socket"].as<std::string>() );
+    } else {
+        server.serveStream( std::cin, std::cout );
+    }
+}
+
+/* printf formatting into a string */
+std::string format(const char *fmt, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    return line;
+}
+
+/* Options of a run, on the command line or in a --serve job line */
+po::options_description simulationOptions()
+{
     po::options_description desc{"Usage"};
     desc.add_options()
         ("help,h", "Help")
-        ("n", po::value<int>()->required(), "Number of particles to simulate")
-        ("f", po::value<std::string>()->required(), "Stores end particle states to h5 file")
-        ("lpb", po::value<double>()->default_value(1E-4), "Loss per bounce")
-        ("ns", po::value<double>()->default_value(0.05), "Chance for nonspecular bounce")
-        ("wl", po::value<double>()->default_value(0.03), "Chance of neutron loss for single window pass")
+        ("n", po::value<int>(), "Number of particles to simulate (required)")
+        ("f", po::value<std::string>(), "Stores end particle states to h5 file (required)")
+        ("lpb", po::value<std::string>()->default_value("1E-4"), "Loss per bounce")
+        ("ns", po::value<std::string>()->default_value("0.05"), "Chance for nonspecular bounce")
+        ("wl", po::value<std::string>()->default_value("0.03"), "Chance of neutron loss for single window pass")
         // ("mfp", po::value<double>()->default_value(1), "1D walk step size")
-        ("mfp2", po::value<double>()->default_value(0), "Mean free path upon cell exit")
-        ("progress", po::value<bool>()->default_value(true), "Whether or not crude progress bar updates");;
+        ("mfp2", po::value<std::string>()->default_value("0"), "Mean free path upon cell exit")
+        ("reweight", po::bool_switch(), "Walk without window and pipe loss, then reweight to every "
+                                        "combination of --wl and --lpb")
+        ("sweep", po::bool_switch(), "Sweep every combination of --ns, --lpb, --wl and --mfp2, "
+                                            "each given as a list a,b,c (or (a,b,c)) or range start:stop:step")
+        ("branch-mfp2", po::bool_switch(), "Walk each particle once up to its first cell exit, then branch it "
+                                           "into every --mfp2 value of the sweep (--engine step)")
+        ("engine", po::value<std::string>()->default_value("step"), "Walk engine: step (every mean free path), "
+                                                                    "jump (straight to the next boundary), batch "
+                                                                    "(vectorized step) or markov (expected outcomes, "
+                                                                    "no particles)")
+        ("cell-dwell", po::value<std::string>()->default_value("constant"), "Time a neutron stays in the cell: constant "
+                                                                             "(its velocity's exit lifetime) or exponential "
+                                                                             "(exponentially distributed with that mean)")
+        ("spectrum", po::value<std::string>()->default_value("mono"), "Neutron velocities: mono (v2_average), v2, v3 "
+                                                                      "or file (see --spectrum-file)")
+        ("spectrum-file", po::value<std::string>(), "Velocity spectrum with one 'velocity weight' line per bin")
+        ("geometry", po::value<std::string>(), "Beamline file of sources, windows, cells, valves and pipe sections "
+                                               "(default: source, gate valve, window and cell of simulation.cpp)")
+        ("rng", po::value<std::string>()->default_value("xoshiro256ss"), "Random generator: xoshiro256ss, philox4x32 or mt19937_64")
+        ("threads", po::value<int>()->default_value(1), "Number of worker threads")
+        ("compression", po::value<int>()->default_value(COMPRESSION), "Deflate level for the output table (0-9, 0 = off; "
+                                                                      "4 for --layout columnar unless given)")
+        ("shuffle", po::value<bool>()->default_value(false), "Whether or not to apply the shuffle filter before compression")
+        ("layout", po::value<std::string>()->default_value("rows"), "Output table layout: rows (one PyTables table) or columnar "
+                                                                    "(a group of shuffled, compressed columns, grouped by status)")
+        ("lz4", po::bool_switch(), "Compress columnar tables with the HDF5 LZ4 filter plugin instead of deflate")
+        ("seed", po::value<uint64_t>(), "Random seed (default: generated from system clock)")
+        ("shard", po::value<std::string>(), "Only walk shard i/N of the --n particles (needs --seed)")
+        ("first-particle", po::value<int>(), "Number of the first of the --n particles walked (needs --seed)")
+        ("target-rel-error", po::value<double>(), "Walk batches of --n particles until the 95% confidence interval of every "
+                                                  "--target-observables value is within this fraction of it")
+        ("target-observables", po::value<std::string>()->default_value("cell,windowHits"), "Observables --target-rel-error "
+                                                  "applies to: cell (fraction reaching the cell), windowHits, cellRejections, totalSteps")
+        ("max-n", po::value<int>(), "Most particles --target-rel-error walks per point (default: 100 batches)")
+        ("summary-only", po::bool_switch(), "Only write summary statistics, not the end state of every particle")
+        ("metrics", po::value<std::string>(), "Print throughput and time left, and keep a JSON file of run counters "
+                                              "up to date at this path")
+        ("metrics-interval", po::value<double>()->default_value(5), "Seconds between --metrics reports")
+        ("progress", po::value<bool>()->default_value(true), "Whether or not crude progress bar updates")
+        ("serve", po::bool_switch(), "Keep the worker pool up and run jobs given as JSON lines of these options "
+                                     "on standard input (or --socket), replying with a JSON line per job")
+        ("socket", po::value<std::string>(), "Unix socket --serve listens on instead of standard input")
+        ("jobs", po::value<int>()->default_value(1), "Jobs --serve runs at once");
+    return desc;
+}
+
+/* Parse command line arguments */
+po::variables_map processArguments(int argc, const char** argv)
+{
 
+    po::variables_map vm;
+    po::options_description desc = simulationOptions();
     po::store(po::parse_command_line(argc, argv, desc), vm);
 
     if (vm.count("help"))
@@ -152,5 +611,7 @@ po::variables_map processArguments(int argc, const char** argv)
         po::notify(vm); // Must be after vm.count("help")
     }
 
+    if (vm["threads"].as<int>() < 1) throw std::invalid_argument("--threads must be at least 1");
+
     return vm;
 }
@@ -0,0 +1,518 @@
+#include <markov.hpp>
+#include <particle1d.hpp>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+enum class moveType : uint8_t { pipe, window, source, cell };
+
+// Sites of a lattice between the source and the cell, and where a step from each one goes
+struct markovLattice
+{
+    struct move
+    {
+        moveType type;
+        int to;                         // Site the step ends on, for pipe and window
+    };
+
+    std::vector<move> steps[2];         // Step toward the source and toward the cell from each site
+    std::vector<move> firstSteps[2];    // Same for the first step of a walk, which ignores the window
+    int entry;                          // Site walks start on
+
+    size_t size() const { return steps[0].size(); }
+};
+
+// Lattice of spacing mfp through anchor. Positions are added up one step at a time, as particle1d does
+static std::shared_ptr<const markovLattice> makeLattice( const double anchor, const double mfp,
+                                                         const double source, const double cell, const double window )
+{
+    const bool sourceLeftCellRight = (source < cell);
+    auto atSource = [&]( double x ){ return sourceLeftCellRight ? (x <= source) : (x >= source); };
+    auto atCell = [&]( double x ){ return sourceLeftCellRight ? (x >= cell) : (x <= cell); };
+    if (atSource( anchor ) || atCell( anchor )) throw std::invalid_argument("Walks must start between the source and the cell");
+
+    const double toCell = sourceLeftCellRight ? mfp : -mfp;
+    std::vector<double> sites;
+    for (double x = anchor - toCell; !atSource( x ); x -= toCell) sites.push_back( x );
+    std::reverse( sites.begin(), sites.end() );
+    std::shared_ptr<markovLattice> lattice = std::make_shared<markovLattice>();
+    lattice->entry = sites.size();
+    for (double x = anchor; !atCell( x ); x += toCell) sites.push_back( x );
+
+    for (size_t i = 0; i < sites.size(); i++)
+        for (int d = 0; d < 2; d++)
+        {
+            // Same checks in the same order as particle1d::step
+            const double from = sites[i];
+            const double to = from + (d ? toCell : -toCell);
+            const int site = d ? i + 1 : static_cast<int>(i) - 1;
+            markovLattice::move move{ moveType::pipe, site };
+            if (atSource( to )) {
+                move = markovLattice::move{ moveType::source, -1 };
+            } else if (atCell( to )) {
+                move = markovLattice::move{ moveType::cell, -1 };
+            }
+            lattice->firstSteps[d].push_back( move );
+
+            if ((from < window && window < to) || (from > window && window > to) || to == window)
+            {
+                if (move.type != moveType::pipe)
+                    throw std::invalid_argument("--engine markov needs the window more than a mean free path from the source and cell");
+                move.type = moveType::window;
+            }
+            lattice->steps[d].push_back( move );
+        }
+    return lattice;
+}
+
+// Chances of one step
+struct stepChances
+{
+    double windowLoss, lossPerStep, cellEntrance;
+};
+
+// Chance of each loss in one tick
+struct tickLosses
+{
+    double source = 0, pipe = 0, window = 0;
+};
+
+// Runs body( chunk ) for every chunk, on this thread and on pool workers that are free. Chunks are
+// claimed from a counter, so this thread never waits for a chunk that no thread has started
+static void forChunks( workStealingPool &pool, const int chunks, const std::function<void(int)> &body )
+{
+    struct claims
+    {
+        std::atomic<int> next{0};
+        int unfinished;
+        std::mutex mtx;
+        std::condition_variable done;
+        const std::function<void(int)> *body;     // Only used by a thread holding an unfinished chunk
+    };
+    std::shared_ptr<claims> c = std::make_shared<claims>();
+    c->unfinished = chunks;
+    c->body = &body;
+    auto work = [c, chunks]{
+        for (int i = c->next++; i < chunks; i = c->next++)
+        {
+            (*c->body)( i );
+            std::lock_guard<std::mutex> lock( c->mtx );
+            if (--c->unfinished == 0) c->done.notify_all();
+        }
+    };
+    if (pool.size() > 1)
+        for (int i = 1; i < std::min( chunks, pool.size() ); i++) pool.submit( work );
+    work();
+    std::unique_lock<std::mutex> lock( c->mtx );
+    c->done.wait( lock, [&c]{ return c->unfinished == 0; } );
+}
+
+// Chance of being on each site with each number of window hits, for the current tick and the two after it
+struct latticeRun
+{
+    explicit latticeRun( const markovLattice &lattice ) : lattice( lattice ), width( 0 ), tick( 0 ), top( 0 )
+    {
+        widen( MARKOV_HIT_LEVELS );
+    }
+
+    // What one chunk of sites passed on in a step
+    struct chunkResult
+    {
+        tickLosses loss;
+        std::vector<double> accepted;
+        bool moved, rejected, hit;
+    };
+
+    const markovLattice &lattice;
+    int width;                                  // Window hit counts kept for each site
+    int tick;
+    int top;                                    // Highest window hit count with any chance
+    std::vector<double> buffer[3];              // Ticks tick, tick + 1 and tick + 2, by tick % 3
+    std::vector<char> occupied[3];              // Sites that may have any chance in each buffer
+    bool filled[3] = {false, false, false};
+    std::map<int, std::vector<double>> entries; // Chance to start on the entry site at later ticks, by window hits
+    std::vector<chunkResult> chunks;
+
+    bool live() const
+    {
+        return filled[0] || filled[1] || filled[2] || !entries.empty();
+    }
+
+    // Keeps at least levels window hit counts for each site
+    void widen( int levels )
+    {
+        const int wider = std::max( levels, 2 * width );
+        for (auto &b : buffer)
+        {
+            std::vector<double> w( lattice.size() * wider, 0 );
+            for (size_t s = 0; s < lattice.size() && width > 0; s++)
+                std::copy( b.begin() + s * width, b.begin() + (s + 1) * width, w.begin() + s * wider );
+            b.swap( w );
+        }
+        width = wider;
+        for (auto &o : occupied) o.resize( lattice.size(), false );
+    }
+
+    // Moves to the next tick with any chance and adds the walks that start on it
+    void prepare()
+    {
+        if (!filled[0] && !filled[1] && !filled[2] && !entries.empty()) tick = std::max( tick, entries.begin()->first );
+        while (!entries.empty() && entries.begin()->first == tick)
+        {
+            const std::vector<double> &start = entries.begin()->second;
+            if (static_cast<int>( start.size() ) > width) widen( start.size() );
+            double *site = buffer[tick % 3].data() + lattice.entry * width;
+            for (size_t h = 0; h < start.size(); h++) site[h] += start[h];
+            occupied[tick % 3][lattice.entry] = true;
+            top = std::max( top, static_cast<int>( start.size() ) - 1 );
+            filled[tick % 3] = true;
+            entries.erase( entries.begin() );
+        }
+    }
+
+    // Steps the sites [from, to): what leaves them, and what arrives on them from their neighbours, so
+    // chunks of sites write to separate parts of the buffers
+    void stepSites( const size_t from, const size_t to, const stepChances &p, const bool firstStep, chunkResult &out )
+    {
+        const double *now = buffer[tick % 3].data();
+        double *next = buffer[(tick + 1) % 3].data();
+        double *later = buffer[(tick + 2) % 3].data();
+        const std::vector<char> &occupiedNow = occupied[tick % 3];
+        const std::vector<markovLattice::move> *moves = firstStep ? lattice.firstSteps : lattice.steps;
+        out.loss = tickLosses();
+        out.accepted.assign( top + 1, 0 );
+        out.moved = out.rejected = out.hit = false;
+        const double pipePass = 0.5 * (1 - p.lossPerStep), windowPass = 0.5 * (1 - p.windowLoss);
+        for (size_t s = from; s < to; s++)
+        {
+            const double *m = now + s * width;
+            double total = 0;
+            if (occupiedNow[s])
+                for (int h = 0; h <= top; h++) total += m[h];
+            if (total != 0)
+            {
+                for (int d = 0; d < 2; d++)
+                {
+                    switch (moves[d][s].type)
+                    {
+                        case moveType::pipe:
+                            out.loss.pipe += 0.5 * p.lossPerStep * total;
+                            out.moved = true;
+                            break;
+                        case moveType::window:
+                            out.loss.window += 0.5 * p.windowLoss * total;
+                            out.moved = out.hit = true;
+                            break;
+                        case moveType::source:
+                            out.loss.source += 0.5 * total;
+                            break;
+                        case moveType::cell: {
+                            // Rejected neutrons are back on this site after another tick
+                            double *back = later + s * width;
+                            for (int h = 0; h <= top; h++)
+                            {
+                                out.accepted[h] += 0.5 * p.cellEntrance * m[h];
+                                back[h] += 0.5 * (1 - p.cellEntrance) * m[h];
+                            }
+                            occupied[(tick + 2) % 3][s] = true;
+                            out.rejected = true;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            // Steps toward the cell from the site before and toward the source from the site after
+            double *arrive = next + s * width;
+            for (int d = 0; d < 2; d++)
+            {
+                if ((d && s == 0) || (!d && s + 1 == lattice.size())) continue;
+                const size_t neighbour = d ? s - 1 : s + 1;
+                if (!occupiedNow[neighbour]) continue;
+                const markovLattice::move &move = moves[d][neighbour];
+                const double *n = now + neighbour * width;
+                if (move.type == moveType::pipe) {
+                    for (int h = 0; h <= top; h++) arrive[h] += pipePass * n[h];
+                    occupied[(tick + 1) % 3][s] = true;
+                } else if (move.type == moveType::window) {
+                    for (int h = 0; h <= top; h++) arrive[h + 1] += windowPass * n[h];
+                    occupied[(tick + 1) % 3][s] = true;
+                }
+            }
+        }
+    }
+
+    // Takes one step, with accepted set to the chances the cell accepts by window hits. Large lattices are
+    // stepped in chunks of sites on the pool. The chance on the highest window hit count is dropped while
+    // it is below NEGLIGIBLE_CHANCE, which keeps only the window hit counts that matter
+    tickLosses step( workStealingPool &pool, const stepChances &p, const bool firstStep, std::vector<double> &accepted )
+    {
+        accepted.assign( top + 1, 0 );
+        tickLosses loss;
+        if (!filled[tick % 3])
+        {
+            tick++;
+            return loss;
+        }
+        if (top + 2 > width) widen( top + 2 );
+
+        const size_t sites = lattice.size();
+        const int parts = static_cast<int>( std::max<size_t>( 1, std::min( sites, sites * (top + 1) / MARKOV_CHUNK_CHANCES ) ) );
+        chunks.resize( parts );
+        if (parts == 1) {
+            stepSites( 0, sites, p, firstStep, chunks[0] );
+        } else {
+            forChunks( pool, parts, [&]( int i ){ stepSites( sites * i / parts, sites * (i + 1) / parts, p, firstStep, chunks[i] ); } );
+        }
+
+        bool hit = false;
+        for (auto const& c : chunks)
+        {
+            loss.source += c.loss.source;
+            loss.pipe += c.loss.pipe;
+            loss.window += c.loss.window;
+            for (int h = 0; h <= top; h++) accepted[h] += c.accepted[h];
+            if (c.moved) filled[(tick + 1) % 3] = true;
+            if (c.rejected) filled[(tick + 2) % 3] = true;
+            hit = hit || c.hit;
+        }
+        double *now = buffer[tick % 3].data();
+        for (size_t s = 0; s < sites; s++)
+            if (occupied[tick % 3][s]) std::fill( now + s * width, now + s * width + top + 1, 0. );
+        std::fill( occupied[tick % 3].begin(), occupied[tick % 3].end(), false );
+        filled[tick % 3] = false;
+        if (hit) top++;
+        while (top > 0 && levelChance( top ) < NEGLIGIBLE_CHANCE)
+        {
+            for (int b = 1; b <= 2; b++)
+                for (size_t s = 0; s < sites; s++) buffer[(tick + b) % 3][s * width + top] = 0;
+            top--;
+        }
+        tick++;
+        return loss;
+    }
+
+    // Chance on window hit count h in the two ticks after this one
+    double levelChance( const int h ) const
+    {
+        double chance = 0;
+        for (int b = 1; b <= 2; b++)
+            for (size_t s = 0; s < lattice.size(); s++) chance += buffer[(tick + b) % 3][s * width + h];
+        return chance;
+    }
+};
+
+// Running sums of the chance and the chance times step time of each loss and of cell entries by window hits
+struct runningSums
+{
+    tickLosses loss0, loss1;
+    std::vector<double> cell0, cell1;
+};
+
+double markovResult::alive() const
+{
+    return 1 - source - pipe - window - cell;
+}
+
+double markovResult::meanCellWindowHits() const
+{
+    double hits = 0;
+    for (size_t h = 0; h < cellWindowHits.size(); h++) hits += h * cellWindowHits[h];
+    return cell ? hits / cell : 0;
+}
+
+void markovResult::add( const markovResult &other, double weight )
+{
+    source += weight * other.source;
+    pipe += weight * other.pipe;
+    window += weight * other.window;
+    cell += weight * other.cell;
+    if (cellWindowHits.size() < other.cellWindowHits.size()) cellWindowHits.resize( other.cellWindowHits.size(), 0 );
+    for (size_t h = 0; h < other.cellWindowHits.size(); h++) cellWindowHits[h] += weight * other.cellWindowHits[h];
+}
+
+markovSolver::markovSolver( std::map<std::string, double> params, std::shared_ptr<const velocitySpectrum> spectrum )
+            : params( params ), spectrum( spectrum )
+{
+    if (params["exponentialDwell"] != 0)
+        throw std::invalid_argument("--cell-dwell exponential needs --engine step or jump");
+    const double source = params["source"], cell = params["cell"], window = params["window"];
+    const double mfp = params["stepSize"];
+    const double mfp1 = (params["stepSize2"] != 0) ? params["stepSize2"] : mfp;
+    first = makeLattice( params["start"], mfp, source, cell, window );
+    afterExit = makeLattice( cell + ((source < cell) ? -mfp1 : mfp1), mfp1, source, cell, window );
+}
+
+void markovSolver::schedule( workStealingPool &pool )
+{
+    bins.assign( spectrum->size(), markovResult() );
+    for (size_t i = 0; i < bins.size(); i++)
+        pool.submit( [this, i, &pool]{ bins[i] = solve( spectrum->bin( i ), pool ); } );
+}
+
+markovResult markovSolver::result() const
+{
+    markovResult total;
+    for (size_t i = 0; i < bins.size(); i++) total.add( bins[i], spectrum->probability( i ) );
+    return total;
+}
+
+markovResult markovSolver::solve( const velocityBin &bin, workStealingPool &pool ) const
+{
+    const double fillTime = params.at("fillTime");
+    const double tau = bin.cellExitLifetime;
+    const bool changeMfp = (params.at("stepSize2") != 0);
+    const double dt = params.at("stepSize") / bin.v;
+    const double dt1 = (changeMfp ? params.at("stepSize2") : params.at("stepSize")) / bin.v;
+    const stepChances before{ params.at("windowLoss"), params.at("lossPerStep"), params.at("cellChance") };
+    const stepChances after{ before.windowLoss, before.lossPerStep,
+                             changeMfp ? cellEntranceChance( params.at("stepSize2"), CELL_EXIT_NONSPEC ) : before.cellEntrance };
+
+    // Walk from the start, weighting each step by the chance fillTime - tstart leaves time for it.
+    // A cell entry at the end of a step from time s stays in the cell for fillTime - tstart between s and
+    // s + dt + tau, and otherwise exits into the pipe at s + dt + tau
+    markovResult result;
+    struct cellExit
+    {
+        double time;
+        std::vector<double> hits;
+    };
+    std::vector<cellExit> exits;
+    latticeRun walk( *first );
+    walk.entries[0] = std::vector<double>{ 1 };
+    std::vector<double> accepted;
+    while (walk.live())
+    {
+        walk.prepare();
+        const double s = walk.tick * dt;
+        if (s >= fillTime) break;
+        const tickLosses loss = walk.step( pool, before, walk.tick == 0, accepted );
+
+        const double w = (fillTime - s) / fillTime;
+        result.source += w * loss.source;
+        result.pipe += w * loss.pipe;
+        result.window += w * loss.window;
+        const double stay = std::min( dt + tau, fillTime - s ) / fillTime;
+        const double entered = std::accumulate( accepted.begin(), accepted.end(), 0. );
+        if (result.cellWindowHits.size() < accepted.size()) result.cellWindowHits.resize( accepted.size(), 0 );
+        for (size_t h = 0; h < accepted.size(); h++) result.cellWindowHits[h] += stay * accepted[h];
+        result.cell += stay * entered;
+        if (entered > 0 && s + dt + tau < fillTime) exits.push_back( cellExit{ s + dt + tau, accepted } );
+    }
+    if (exits.empty()) return result;
+
+    // The walk after an exit at time o, over the time s since then, has the same chances for every o,
+    // with steps weighted by (fillTime - o - s) / fillTime, and cell entries by the smaller of that and
+    // (dt1 + tau) / fillTime. It is walked once, in order of s, with runs[e] the walk after e more exits.
+    // Each exit is added from the running sums at s = fillTime - o - dt1 - tau and s = fillTime - o
+    const double horizon = fillTime - exits.front().time;
+    std::vector< std::unique_ptr<latticeRun> > runs;
+    runs.emplace_back( new latticeRun( *afterExit ) );
+    runs[0]->entries[0] = std::vector<double>{ 1 };
+
+    // Points where exits are added, in order of s: (s, exit, whether it is the second point)
+    struct query
+    {
+        double s;
+        size_t exit;
+        bool last;
+    };
+    std::vector<query> queries;
+    for (size_t i = 0; i < exits.size(); i++)
+    {
+        queries.push_back( query{ fillTime - exits[i].time - dt1 - tau, i, false } );
+        queries.push_back( query{ fillTime - exits[i].time, i, true } );
+    }
+    std::sort( queries.begin(), queries.end(), []( const query &a, const query &b ){ return a.s < b.s; } );
+    std::vector<runningSums> stays( exits.size() );     // Sums at the first point of each exit
+
+    runningSums sums;
+    std::vector<double> stay;                   // Chance of a cell entry to stay, by window hits after the exit
+    auto answer = [&]( const query &q ) {
+        if (!q.last)
+        {
+            stays[q.exit] = sums;
+            return;
+        }
+        const std::vector<double> &m = exits[q.exit].hits;
+        const double entering = std::accumulate( m.begin(), m.end(), 0. );
+        const double X = q.s;
+        result.source += entering * (X * sums.loss0.source - sums.loss1.source) / fillTime;
+        result.pipe += entering * (X * sums.loss0.pipe - sums.loss1.pipe) / fillTime;
+        result.window += entering * (X * sums.loss0.window - sums.loss1.window) / fillTime;
+
+        const runningSums &a = stays[q.exit];
+        stay.assign( sums.cell0.size(), 0 );
+        for (size_t dh = 0; dh < stay.size(); dh++)
+        {
+            const double a0 = (dh < a.cell0.size()) ? a.cell0[dh] : 0, a1 = (dh < a.cell1.size()) ? a.cell1[dh] : 0;
+            stay[dh] = ((dt1 + tau) * a0 + X * (sums.cell0[dh] - a0) - (sums.cell1[dh] - a1)) / fillTime;
+        }
+        stays[q.exit] = runningSums();
+
+        result.cell += entering * std::accumulate( stay.begin(), stay.end(), 0. );
+        if (result.cellWindowHits.size() + 1 < m.size() + stay.size()) result.cellWindowHits.resize( m.size() + stay.size() - 1, 0 );
+        for (size_t dh = 0; dh < stay.size(); dh++)
+            if (stay[dh] != 0)
+                for (size_t h = 0; h < m.size(); h++) result.cellWindowHits[h + dh] += m[h] * stay[dh];
+    };
+
+    size_t answered = 0;
+    while (true)
+    {
+        // Run with the earliest step
+        size_t e = runs.size();
+        double s = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+            if (!runs[i]->live()) continue;
+            runs[i]->prepare();
+            const double next = i * tau + runs[i]->tick * dt1;
+            if (next < s)
+            {
+                s = next;
+                e = i;
+            }
+        }
+        if (e == runs.size() || s >= horizon) break;
+        while (answered < queries.size() && queries[answered].s <= s) answer( queries[answered++] );
+
+        latticeRun &run = *runs[e];
+        const tickLosses loss = run.step( pool, after, false, accepted );
+        sums.loss0.source += loss.source;
+        sums.loss0.pipe += loss.pipe;
+        sums.loss0.window += loss.window;
+        sums.loss1.source += s * loss.source;
+        sums.loss1.pipe += s * loss.pipe;
+        sums.loss1.window += s * loss.window;
+        if (sums.cell0.size() < accepted.size())
+        {
+            sums.cell0.resize( accepted.size(), 0 );
+            sums.cell1.resize( accepted.size(), 0 );
+        }
+        double entered = 0;
+        for (size_t h = 0; h < accepted.size(); h++)
+        {
+            sums.cell0[h] += accepted[h];
+            sums.cell1[h] += s * accepted[h];
+            entered += accepted[h];
+        }
+
+        // Exits go on in the next run, tau later
+        if (entered > 0 && s + dt1 + tau < horizon)
+        {
+            if (e + 1 == runs.size()) runs.emplace_back( new latticeRun( *afterExit ) );
+            std::vector<double> &start = runs[e + 1]->entries[run.tick];
+            start.resize( std::max( start.size(), accepted.size() ), 0 );
+            for (size_t h = 0; h < accepted.size(); h++) start[h] += accepted[h];
+        }
+    }
+    while (answered < queries.size()) answer( queries[answered++] );
+    return result;
+}
@@ -1,25 +1,8 @@
 #include "mc.hpp"
 
 #include <iostream>
-
-const int PIECEWISE_LINEAR_DIST_INTERVALS = 1000;
-const double UCN_E_MIN = 1.;
-const double UCN_E_MAX = 215.;
-
-template<typename UnaryFunction>
-std::piecewise_linear_distribution<double> parse_distribution(UnaryFunction f, const double range_min, const double range_max){
-	if (range_min > range_max)
-		throw std::runtime_error("Invalid range used to parse distribution");
-	double rmin = range_min;
-	double rmax = range_max;
-	int nw = PIECEWISE_LINEAR_DIST_INTERVALS;
-	if (range_min == range_max){
-		rmax = std::nextafter(range_max, std::numeric_limits<double>::max()); // use slightly larger double value for range_max, else distribution will default to range 0..1
-		nw = 1;
-	}
-
-	return std::piecewise_linear_distribution<double>(nw, rmin, rmax, f);
-}
+#include <cmath>
+#include <stdexcept>
 
 // v^2 distribution
 double v2Spectrum(const double v){
@@ -31,10 +14,29 @@ double v3Spectrum(const double v){
 	return v*v*v;
 }
 
-std::piecewise_linear_distribution<double> v2_distribution = parse_distribution(v2Spectrum, UCN_E_MIN, UCN_E_MAX);
+generatorType parseGenerator(const std::string &name){
+	if (name == "mt19937_64") return generatorType::mt19937_64;
+	if (name == "xoshiro256ss") return generatorType::xoshiro256ss;
+	if (name == "philox4x32") return generatorType::philox4x32;
+	throw std::invalid_argument("Unknown generator '" + name + "' (expected mt19937_64, xoshiro256ss or philox4x32)");
+}
 
-std::piecewise_linear_distribution<double> v3_distribution = parse_distribution(v3Spectrum, UCN_E_MIN, UCN_E_MAX);
+uint64_t bernoulliThreshold(const double p){
+	if (!(p > 0)) return 0;
+	if (p >= 1) return 1ULL << 53;
+	return static_cast<uint64_t>( std::ceil( p * 9007199254740992. ) );
+}
 
-std::uniform_int_distribution<int> zeroOrOne(0,1);
+static exponentialZiggurat buildExponentialZiggurat(){
+	// Every layer has the area v of the bottom one: the rectangle up to R plus the tail, (R + 1) e^-R
+	exponentialZiggurat z;
+	const double v = (ZIGGURAT_EXP_R + 1) * std::exp( -ZIGGURAT_EXP_R );
+	z.x[0] = ZIGGURAT_EXP_R + 1;
+	z.x[1] = ZIGGURAT_EXP_R;
+	for (int i = 1; i < ZIGGURAT_LAYERS - 1; i++) z.x[i + 1] = -std::log( std::exp( -z.x[i] ) + v / z.x[i] );
+	z.x[ZIGGURAT_LAYERS] = 0;
+	for (int i = 0; i <= ZIGGURAT_LAYERS; i++) z.f[i] = std::exp( -z.x[i] );
+	return z;
+}
 
-std::uniform_real_distribution<double> zeroToOne(0, std::nextafter(1, std::numeric_limits<double>::max()));
+const exponentialZiggurat EXP_ZIGGURAT = buildExponentialZiggurat();
@@ -0,0 +1,241 @@
+/**
+* Merge the output files of runs over consecutive particle ranges of one seed
+*/
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <stdexcept>
+#include <boost/program_options.hpp>
+#include <output.hpp>
+#include <reweight.hpp>
+#include <summary.hpp>
+
+namespace po = boost::program_options;
+
+typedef std::vector< std::unique_ptr<hdfReader> > inputFiles;
+
+po::variables_map processArguments(int argc, const char** argv);
+
+// Groups holding each point's tables: the root, or point_0/, point_1/, ... of a sweep
+std::vector<std::string> pointGroups(const hdfReader &file)
+{
+    if (!file.exists("point_0")) return std::vector<std::string>{ "" };
+    std::vector<std::string> groups;
+    for (int i = 0; file.exists("point_" + std::to_string(i)); i++) groups.push_back( "point_" + std::to_string(i) + "/" );
+    return groups;
+}
+
+// Parameters stored on path, which must be the same in every input
+std::map<std::string, double> matchingAttributes(const inputFiles &inputs, const std::string &path)
+{
+    const std::map<std::string, double> attributes = inputs.front()->doubleAttributes( path );
+    for (auto const& input : inputs)
+        if (input->doubleAttributes( path ) != attributes)
+            throw std::runtime_error("Attributes of " + path + " differ between " + inputs.front()->filename + " and " + input->filename);
+    return attributes;
+}
+
+// Whether every input has path. Throws if only some do
+bool allHave(const inputFiles &inputs, const std::string &path)
+{
+    const bool found = inputs.front()->exists( path );
+    for (auto const& input : inputs)
+        if (input->exists( path ) != found)
+            throw std::runtime_error(path + " is in " + (found ? inputs.front() : input)->filename + " but not in " + (found ? input : inputs.front())->filename);
+    return found;
+}
+
+int main(int argc, const char *argv[])
+{
+    po::variables_map vm;
+    try
+    {
+        vm = processArguments(argc,  argv);
+    } catch (std::exception& err) {
+        std::cerr << err.what() << "\nRun with --help argument\n";
+        return 1;
+    } catch (char const* helpFlag ) {
+        std::cerr << helpFlag << '\n';
+        return -1;
+    }
+
+    try
+    {
+        // Inputs in particle order, covering one unbroken range of one seed
+        inputFiles inputs;
+        for (auto const& name : vm["inputs"].as< std::vector<std::string> >()) inputs.emplace_back( new hdfReader( name ) );
+        std::vector< std::map<std::string, long long> > ranges;
+        for (auto const& input : inputs)
+        {
+            ranges.push_back( input->integerAttributes( "/" ) );
+            if (!ranges.back().count("firstParticle") || !ranges.back().count("particles"))
+                throw std::runtime_error(input->filename + " has no particle range");
+        }
+        std::vector<size_t> order( inputs.size() );
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        std::stable_sort( order.begin(), order.end(),
+                          [&]( size_t a, size_t b ){ return ranges[a]["firstParticle"] < ranges[b]["firstParticle"]; } );
+        inputFiles sorted;
+        for (size_t i : order) sorted.push_back( std::move( inputs[i] ) );
+        inputs.swap( sorted );
+
+        const uint64_t seed = inputs.front()->unsignedAttribute( "/", "seed" );
+        const std::string geometry = inputs.front()->textAttribute( "/", "geometry" );
+        const long long first = ranges[order.front()]["firstParticle"];
+        long long particles = 0;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            std::map<std::string, long long> &range = ranges[order[i]];
+            if (inputs[i]->unsignedAttribute( "/", "seed" ) != seed)
+                throw std::runtime_error(inputs[i]->filename + " was run with a different seed than " + inputs.front()->filename);
+            if (inputs[i]->textAttribute( "/", "geometry" ) != geometry)
+                throw std::runtime_error(inputs[i]->filename + " was run with a different geometry than " + inputs.front()->filename);
+            if (range["firstParticle"] != first + particles)
+                throw std::runtime_error(inputs[i]->filename + " starts at particle " + std::to_string(range["firstParticle"]) +
+                                         ", expected " + std::to_string(first + particles));
+            if (range.count("shards") && (range["shards"] != static_cast<long long>(inputs.size()) || range["shard"] != static_cast<long long>(i)))
+                throw std::runtime_error(inputs[i]->filename + " is shard " + std::to_string(range["shard"]) + "/" +
+                                         std::to_string(range["shards"]) + ", but " + std::to_string(inputs.size()) + " files were given");
+            particles += range["particles"];
+        }
+        if (first + particles - 1 > std::numeric_limits<int>::max())
+            throw std::runtime_error("Merged particle numbers do not fit in an int");
+
+        const std::vector<std::string> groups = pointGroups( *inputs.front() );
+        for (auto const& input : inputs)
+            if (pointGroups( *input ) != groups)
+                throw std::runtime_error(input->filename + " does not have the same points as " + inputs.front()->filename);
+
+        std::cout << "Merging " << inputs.size() << " files of seed " << seed << ", particles " << first << " to "
+                  << first + particles - 1 << ", into " << vm["f"].as<std::string>() << "\n";
+        hdfFile file( vm["f"].as<std::string>() );
+        file.setAttribute( "/", "seed", seed );
+        if (!geometry.empty()) file.setAttribute( "/", "geometry", geometry );
+        file.setAttributes( "/", std::map<std::string, long long>{ {"firstParticle", first}, {"particles", particles} } );
+
+        for (auto const& group : groups)
+        {
+            if (!group.empty()) file.createGroup( group, matchingAttributes( inputs, group ) );
+
+            // Tables are concatenated in particle order
+            if (allHave( inputs, group + "table" ) && inputs.front()->columnar( group + "table" ))
+            {
+                // Each block of blockStatusCounts is a run of consecutive particles grouped by status, so sorting
+                // a block by particle number gives back particle order, and the merged table is regrouped as one run's
+                long long maxCount = 0;
+                for (auto const& input : inputs)
+                {
+                    if (!input->columnar( group + "table" ))
+                        throw std::runtime_error(input->filename + " does not have the same table layout as " + inputs.front()->filename);
+                    maxCount = std::max( maxCount, input->integerAttributes( group + "table" )["maxCount"] );
+                }
+                const columnFormat format{ vm["compression"].defaulted() ? COLUMN_COMPRESSION : vm["compression"].as<int>(),
+                                           vm["lz4"].as<bool>(), maxCount };
+                hdfTableWriter table( file, group + "table", matchingAttributes( inputs, group + "table" ), format );
+                std::vector<hdfOutputFormat> records;
+                for (auto const& input : inputs)
+                {
+                    const std::vector<long long> counts = input->readArray( group + "table/blockStatusCounts" );
+                    hsize_t start = 0;
+                    for (size_t b = 0; b < counts.size(); b += STATUS_COUNT)
+                    {
+                        records.resize( std::accumulate( counts.begin() + b, counts.begin() + b + STATUS_COUNT, 0LL ) );
+                        input->readRecords( group + "table", start, records );
+                        std::sort( records.begin(), records.end(),
+                                   []( const hdfOutputFormat &a, const hdfOutputFormat &b ){ return a.particleNum < b.particleNum; } );
+                        for (auto const& record : records) table.append( record );
+                        start += records.size();
+                    }
+                }
+            } else if (allHave( inputs, group + "table" )) {
+                hdfTableWriter table( file, group + "table", matchingAttributes( inputs, group + "table" ),
+                                      vm["compression"].as<int>(), vm["shuffle"].as<bool>() );
+                std::vector<hdfOutputFormat> records;
+                for (auto const& input : inputs)
+                {
+                    if (input->columnar( group + "table" ))
+                        throw std::runtime_error(input->filename + " does not have the same table layout as " + inputs.front()->filename);
+                    const hsize_t total = input->records( group + "table" );
+                    for (hsize_t start = 0; start < total; start += WRITE_BUFFER_RECORDS)
+                    {
+                        records.resize( std::min<hsize_t>( WRITE_BUFFER_RECORDS, total - start ) );
+                        input->readRecords( group + "table", start, records );
+                        for (auto const& record : records) table.append( record );
+                    }
+                }
+            }
+
+            // Summaries and reweighting keep exact sums, so they add up to those of a single run
+            summaryStats summary;
+            for (auto const& input : inputs) summary.merge( *input, group + "summary" );
+            summary.write( file, group + "summary", matchingAttributes( inputs, group + "summary" ) );
+            std::cout << "\n### " << group << "summary ###\n";
+            summary.print();
+
+            if (allHave( inputs, group + "reweight" ))
+            {
+                std::vector<lossPoint> grid;
+                for (auto const& r : readReweight( *inputs.front(), group + "reweight" ))
+                    grid.push_back( lossPoint{ r.windowLoss, r.lossPerBounce, r.lossPerStep } );
+                lossTally tally( grid );
+                for (auto const& input : inputs)
+                {
+                    const std::vector<reweightOutputFormat> other = readReweight( *input, group + "reweight" );
+                    bool same = (other.size() == grid.size());
+                    for (size_t j = 0; same && j < grid.size(); j++)
+                        same = other[j].windowLoss == grid[j].windowLoss && other[j].lossPerBounce == grid[j].lossPerBounce &&
+                               other[j].lossPerStep == grid[j].lossPerStep;
+                    if (!same) throw std::runtime_error("Reweighting grid of " + input->filename + " differs from " + inputs.front()->filename);
+                    tally.merge( input->readArray( group + "reweightSums" ) );
+                }
+                writeReweight( file, group + "reweight", tally.results(), matchingAttributes( inputs, group + "reweight" ) );
+                file.writeArray( group + "reweightSums", tally.rawSums() );
+            }
+        }
+
+        std::cout << "Flushing remaining records...";
+        file.close();
+        std::cout << "Done!\n";
+    } catch (std::exception& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Parse command line arguments */
+po::variables_map processArguments(int argc, const char** argv)
+{
+
+    po::variables_map vm;
+    po::options_description desc{"Usage: randomWalk_merge.x --f merged.h5 shard_0.h5 shard_1.h5 ..."};
+    desc.add_options()
+        ("help,h", "Help")
+        ("f", po::value<std::string>()->required(), "Merged h5 file")
+        ("inputs", po::value< std::vector<std::string> >()->required(), "h5 files to merge, in any order")
+        ("compression", po::value<int>()->default_value(COMPRESSION), "Deflate level for the merged table (0-9, 0 = off; "
+                                                                      "4 for columnar tables unless given)")
+        ("shuffle", po::value<bool>()->default_value(false), "Whether or not to apply the shuffle filter before compression")
+        ("lz4", po::bool_switch(), "Compress columnar tables with the HDF5 LZ4 filter plugin instead of deflate");
+    po::positional_options_description inputs;
+    inputs.add("inputs", -1);
+
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(inputs).run(), vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << '\n';
+        throw "Doug Wong 2021";
+    } else {
+        po::notify(vm); // Must be after vm.count("help")
+    }
+
+    return vm;
+}
@@ -0,0 +1,171 @@
+#include <metrics.hpp>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+
+uint64_t metricsTotals::finished() const
+{
+    uint64_t n = 0;
+    for (int i = 0; i < STATUS_COUNT; i++) n += particles[i];
+    return n;
+}
+
+void metricsTotals::add( const metricsTotals &other )
+{
+    for (int i = 0; i < STATUS_COUNT; i++) particles[i] += other.particles[i];
+    steps += other.steps;
+    cellRejections += other.cellRejections;
+    cellExits += other.cellExits;
+    draws += other.draws;
+    nanos[0] += other.nanos[0];
+    nanos[1] += other.nanos[1];
+}
+
+#ifdef RANDOMWALK_METRICS
+
+// Counters of every thread, kept until exit so the reporter can read those of finished threads
+static std::mutex registry;
+static std::vector< std::unique_ptr<threadCounters> > counters;
+
+metricsTotals threadCounters::read() const
+{
+    metricsTotals t;
+    for (int i = 0; i < STATUS_COUNT; i++) t.particles[i] = particles[i].load( std::memory_order_relaxed );
+    t.steps = steps.load( std::memory_order_relaxed );
+    t.cellRejections = cellRejections.load( std::memory_order_relaxed );
+    t.cellExits = cellExits.load( std::memory_order_relaxed );
+    t.draws = draws.load( std::memory_order_relaxed );
+    t.nanos[0] = nanos[0].load( std::memory_order_relaxed );
+    t.nanos[1] = nanos[1].load( std::memory_order_relaxed );
+    return t;
+}
+
+threadCounters &localCounters()
+{
+    static thread_local threadCounters *local = nullptr;
+    if (!local)
+    {
+        std::unique_ptr<threadCounters> c( new threadCounters() );
+        for (auto &p : c->particles) p = 0;
+        c->steps = c->cellRejections = c->cellExits = c->draws = 0;
+        c->nanos[0] = c->nanos[1] = 0;
+        std::lock_guard<std::mutex> lock( registry );
+        counters.push_back( std::move( c ) );
+        local = counters.back().get();
+    }
+    return *local;
+}
+
+std::vector<metricsTotals> readCounters()
+{
+    std::lock_guard<std::mutex> lock( registry );
+    std::vector<metricsTotals> totals;
+    for (auto const& c : counters) totals.push_back( c->read() );
+    return totals;
+}
+
+#endif
+
+static metricsTotals sum( const std::vector<metricsTotals> &threads )
+{
+    metricsTotals total = metricsTotals();
+    for (auto const& t : threads) total.add( t );
+    return total;
+}
+
+metricsReporter::metricsReporter( std::string path, double interval, long long expected )
+                : path( path ), interval( interval ), start( std::chrono::steady_clock::now() ), expected( expected ),
+                  baseline( sum( readCounters() ).finished() ), stopped( false )
+{
+#ifndef RANDOMWALK_METRICS
+    throw std::invalid_argument("--metrics needs a build with -DMETRICS=ON");
+#endif
+    if (!(interval > 0)) throw std::invalid_argument("--metrics-interval must be positive");
+    reporter = std::thread( &metricsReporter::run, this );
+}
+
+metricsReporter::~metricsReporter()
+{
+    try {
+        stop();
+    } catch (std::exception& err) {
+        std::cerr << err.what() << '\n';
+    }
+}
+
+void metricsReporter::expect( long long particles )
+{
+    expected = particles;
+}
+
+void metricsReporter::stop()
+{
+    if (!reporter.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        stopped = true;
+    }
+    stopping.notify_all();
+    reporter.join();
+    report( true );
+}
+
+void metricsReporter::run()
+{
+    std::unique_lock<std::mutex> lock( mtx );
+    while (!stopping.wait_for( lock, interval, [this]{ return stopped; } ))
+    {
+        lock.unlock();
+        report( false );
+        lock.lock();
+    }
+}
+
+/* Counters as one JSON object. Keys are plain identifiers, so nothing needs escaping */
+static void writeCounters( std::ostream &out, const metricsTotals &t )
+{
+    out << "{\"particles\": " << t.finished() << ", \"status\": {";
+    for (int i = 0; i < STATUS_COUNT; i++)
+        out << (i ? ", " : "") << "\"" << statusName( static_cast<particleStatus>( i ) ) << "\": " << t.particles[i];
+    out << "}, \"steps\": " << t.steps << ", \"cellRejections\": " << t.cellRejections << ", \"cellExits\": " << t.cellExits
+        << ", \"rngDraws\": " << t.draws << ", \"walkSeconds\": " << t.nanos[0] * 1e-9 << ", \"outputSeconds\": " << t.nanos[1] * 1e-9 << "}";
+}
+
+void metricsReporter::report( bool last )
+{
+    const std::vector<metricsTotals> threads = readCounters();
+    const metricsTotals total = sum( threads );
+    const double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    const long long walked = total.finished() - baseline;
+    const long long left = std::max( 0LL, expected - walked );
+    const double rate = elapsed > 0 ? walked / elapsed : 0;
+    const double eta = last ? 0 : (rate > 0 ? left / rate : -1);    // -1 until anything has finished
+
+    if (!last)
+    {
+        printf("%lld/%lld particles, %.4g particles/s, %.4g steps/s, ETA %s\n", walked, expected.load(), rate,
+               elapsed > 0 ? total.steps / elapsed : 0, eta < 0 ? "unknown" : (std::to_string( static_cast<long long>( eta ) ) + " s").c_str());
+        fflush(stdout);
+    }
+
+    std::ofstream file( path + ".tmp" );
+    file << "{\n  \"finished\": " << (last ? "true" : "false") << ",\n";
+    file << "  \"elapsedSeconds\": " << elapsed << ",\n";
+    file << "  \"expectedParticles\": " << expected << ",\n";
+    file << "  \"particlesPerSecond\": " << rate << ",\n";
+    file << "  \"etaSeconds\": " << eta << ",\n";
+    file << "  \"total\": ";
+    writeCounters( file, total );
+    file << ",\n  \"threads\": [";
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        file << (i ? ",\n" : "\n") << "    ";
+        writeCounters( file, threads[i] );
+    }
+    file << "\n  ]\n}\n";
+    file.close();
+    if (!file || std::rename( (path + ".tmp").c_str(), path.c_str() ) != 0)
+        std::cerr << "Unable to write metrics to " << path << '\n';
+}
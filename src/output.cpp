@@ -1,34 +1,393 @@
 #include <output.hpp>
+#include <metrics.hpp>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
 
-void writeToHDF( std::string filename, std::vector<hdfOutputFormat> results , std::map<std::string, double> attributes)
-{
-    hsize_t nrecords = results.size();
-    size_t dst_size =  sizeof( hdfOutputFormat );
-    int *fill_data = NULL;
-    hid_t      file_id;
-
-    // Field information
-    size_t dst_offset[NFIELDS] = {  HOFFSET( hdfOutputFormat,    particleNum),
-                                    HOFFSET( hdfOutputFormat,    windowHits),
-                                    HOFFSET( hdfOutputFormat,    totalSteps),
-                                    HOFFSET( hdfOutputFormat,    location),
-                                    HOFFSET( hdfOutputFormat,    status),
-                                    HOFFSET( hdfOutputFormat,    cellRejections),
-                                    HOFFSET( hdfOutputFormat,    cellExits),
-                                    HOFFSET( hdfOutputFormat,    velocity),
-                                    HOFFSET( hdfOutputFormat,    tstart),
-                                    HOFFSET( hdfOutputFormat,    tend )};
-    const char *field_names[NFIELDS]  = {   "particleNum",
-                                            "windowHits",
-                                            "totalSteps",
-                                            "location",
-                                            "status",
-                                            "cellRejections",
-                                            "cellExits",
-                                            "velocity",
-                                            "tstart",
-                                            "tend"};
+// Field information
+static const size_t dst_offset[NFIELDS] = {  HOFFSET( hdfOutputFormat,    particleNum),
+                                             HOFFSET( hdfOutputFormat,    windowHits),
+                                             HOFFSET( hdfOutputFormat,    totalSteps),
+                                             HOFFSET( hdfOutputFormat,    location),
+                                             HOFFSET( hdfOutputFormat,    status),
+                                             HOFFSET( hdfOutputFormat,    cellRejections),
+                                             HOFFSET( hdfOutputFormat,    cellExits),
+                                             HOFFSET( hdfOutputFormat,    pipeSteps),
+                                             HOFFSET( hdfOutputFormat,    velocity),
+                                             HOFFSET( hdfOutputFormat,    tstart),
+                                             HOFFSET( hdfOutputFormat,    tend )};
+static const size_t dst_sizes[NFIELDS] = {  sizeof( hdfOutputFormat::particleNum),
+                                            sizeof( hdfOutputFormat::windowHits),
+                                            sizeof( hdfOutputFormat::totalSteps),
+                                            sizeof( hdfOutputFormat::location),
+                                            sizeof( hdfOutputFormat::status),
+                                            sizeof( hdfOutputFormat::cellRejections),
+                                            sizeof( hdfOutputFormat::cellExits),
+                                            sizeof( hdfOutputFormat::pipeSteps),
+                                            sizeof( hdfOutputFormat::velocity),
+                                            sizeof( hdfOutputFormat::tstart),
+                                            sizeof( hdfOutputFormat::tend )};
+static const char *field_names[NFIELDS]  = {   "particleNum",
+                                               "windowHits",
+                                               "totalSteps",
+                                               "location",
+                                               "status",
+                                               "cellRejections",
+                                               "cellExits",
+                                               "pipeSteps",
+                                               "velocity",
+                                               "tstart",
+                                               "tend"};
+
+// Counter columns of a columnar table, stored as unsigned integers of the table's counter type
+const int COUNTER_COLUMNS = 5;
+const int DOUBLE_COLUMNS = 4;
+static int hdfOutputFormat::* const counterColumns[COUNTER_COLUMNS] = { &hdfOutputFormat::windowHits, &hdfOutputFormat::totalSteps,
+                                                         &hdfOutputFormat::cellRejections, &hdfOutputFormat::cellExits,
+                                                         &hdfOutputFormat::pipeSteps };
+static const char *counterNames[COUNTER_COLUMNS] = { "windowHits", "totalSteps", "cellRejections", "cellExits", "pipeSteps" };
+static double hdfOutputFormat::* const doubleColumns[DOUBLE_COLUMNS] = { &hdfOutputFormat::location, &hdfOutputFormat::velocity,
+                                                           &hdfOutputFormat::tstart, &hdfOutputFormat::tend };
+static const char *doubleNames[DOUBLE_COLUMNS] = { "location", "velocity", "tstart", "tend" };
+
+// The HDF5 library is not built thread safe here, so every call into it holds this lock
+static std::mutex hdfLibrary;
+
+tableLayout parseLayout( const std::string &name )
+{
+    if (name == "rows") return tableLayout::rows;
+    if (name == "columnar") return tableLayout::columnar;
+    throw std::invalid_argument("Unknown layout '" + name + "' (expected rows or columnar)");
+}
+
+// particleStatus of a record's status string
+static uint8_t statusCode( const hdfOutputFormat &record )
+{
+    for (int i = 0; i < STATUS_COUNT; i++)
+        if (std::strncmp( record.status, statusName( static_cast<particleStatus>( i ) ), CHAR_COUNT ) == 0) return i;
+    throw std::runtime_error("Unknown status " + std::string( record.status, strnlen( record.status, CHAR_COUNT ) ));
+}
+
+// One byte enum of particleStatus. The base type is the same in memory and on file
+static hid_t statusType()
+{
+    hid_t type_id = H5Tenum_create( H5T_NATIVE_UINT8 );
+    for (uint8_t i = 0; i < STATUS_COUNT; i++) H5Tenum_insert( type_id, statusName( static_cast<particleStatus>( i ) ), &i );
+    return type_id;
+}
+
+// Write n values to rows [from, from + n) of a 1D dataset, extending it
+static herr_t appendColumn( hid_t group_id, const char *name, hid_t mem_type, hsize_t from, hsize_t n, const void *data )
+{
+    hid_t dataset_id = H5Dopen2( group_id, name, H5P_DEFAULT );
+    if (dataset_id < 0) return -1;
+    const hsize_t size[1] = { from + n }, start[1] = { from }, count[1] = { n };
+    herr_t status = H5Dset_extent( dataset_id, size );
+    hid_t file_space = H5Dget_space( dataset_id );
+    hid_t mem_space = H5Screate_simple( 1, count, NULL );
+    if (status >= 0) status = H5Sselect_hyperslab( file_space, H5S_SELECT_SET, start, NULL, count, NULL );
+    if (status >= 0) status = H5Dwrite( dataset_id, mem_type, mem_space, file_space, H5P_DEFAULT, data );
+    H5Sclose( mem_space );
+    H5Sclose( file_space );
+    H5Dclose( dataset_id );
+    return status;
+}
+
+// Largest value an integer dataset holds
+static long long columnLimit( hid_t group_id, const char *name )
+{
+    hid_t dataset_id = H5Dopen2( group_id, name, H5P_DEFAULT );
+    hid_t type_id = H5Dget_type( dataset_id );
+    const size_t size = H5Tget_size( type_id );
+    H5Tclose( type_id );
+    H5Dclose( dataset_id );
+    return (size >= 4) ? 0xFFFFFFFFLL : (1LL << (8 * size)) - 1;
+}
+
+// Cut a 1D dataset back to its first rows
+static void truncateColumn( hid_t group_id, const char *name, hsize_t rows )
+{
+    hid_t dataset_id = H5Dopen2( group_id, name, H5P_DEFAULT );
+    if (dataset_id < 0) return;
+    const hsize_t size[1] = { rows };
+    H5Dset_extent( dataset_id, size );
+    H5Dclose( dataset_id );
+}
+
+/* Append one buffer to a columnar table, its rows grouped by status. Called with hdfLibrary held.
+   Either every column and blockStatusCounts grow by the buffer or none does */
+static herr_t appendColumns( hid_t file_id, const std::string &path, const std::vector<hdfOutputFormat> &records )
+{
+    // Counting sort by status keeps particle order within each status
+    const size_t n = records.size();
+    std::vector<uint8_t> codes( n );
+    long long counts[STATUS_COUNT] = {};
+    for (size_t k = 0; k < n; k++) counts[codes[k] = statusCode( records[k] )]++;
+    size_t next[STATUS_COUNT];
+    for (int i = 0, at = 0; i < STATUS_COUNT; at += counts[i++]) next[i] = at;
+    std::vector<size_t> order( n );
+    for (size_t k = 0; k < n; k++) order[next[codes[k]]++] = k;
+
+    hid_t group_id = H5Gopen2( file_id, path.c_str(), H5P_DEFAULT );
+    if (group_id < 0) return -1;
+    hsize_t from = 0;
+    hid_t dataset_id = H5Dopen2( group_id, "particleNum", H5P_DEFAULT );
+    hid_t space_id = H5Dget_space( dataset_id );
+    H5Sget_simple_extent_dims( space_id, &from, NULL );
+    H5Sclose( space_id );
+    H5Dclose( dataset_id );
+
+    // Every counter must fit its column before any column grows
+    for (int c = 0; c < COUNTER_COLUMNS; c++)
+    {
+        const long long limit = columnLimit( group_id, counterNames[c] );
+        for (auto const& record : records)
+        {
+            const long long value = record.*counterColumns[c];
+            if (value < 0 || value > limit)
+            {
+                H5Gclose( group_id );
+                throw std::runtime_error(std::string( counterNames[c] ) + " " + std::to_string( value ) + " does not fit the counter type of " + path);
+            }
+        }
+    }
+
+    std::vector<int> ints( n );
+    for (size_t k = 0; k < n; k++) ints[k] = records[order[k]].particleNum;
+    herr_t status = appendColumn( group_id, "particleNum", H5T_NATIVE_INT, from, n, ints.data() );
+    for (int c = 0; c < COUNTER_COLUMNS && status >= 0; c++)
+    {
+        for (size_t k = 0; k < n; k++) ints[k] = records[order[k]].*counterColumns[c];
+        status = appendColumn( group_id, counterNames[c], H5T_NATIVE_INT, from, n, ints.data() );
+    }
+    std::vector<double> doubles( n );
+    for (int c = 0; c < DOUBLE_COLUMNS && status >= 0; c++)
+    {
+        for (size_t k = 0; k < n; k++) doubles[k] = records[order[k]].*doubleColumns[c];
+        status = appendColumn( group_id, doubleNames[c], H5T_NATIVE_DOUBLE, from, n, doubles.data() );
+    }
+    std::vector<uint8_t> sorted( n );
+    for (size_t k = 0; k < n; k++) sorted[k] = codes[order[k]];
+    hid_t status_type = statusType();
+    if (status >= 0) status = appendColumn( group_id, "status", status_type, from, n, sorted.data() );
+    H5Tclose( status_type );
+
+    // One more row of blockStatusCounts
+    if (status >= 0)
+    {
+        dataset_id = H5Dopen2( group_id, "blockStatusCounts", H5P_DEFAULT );
+        space_id = H5Dget_space( dataset_id );
+        hsize_t dims[2];
+        H5Sget_simple_extent_dims( space_id, dims, NULL );
+        H5Sclose( space_id );
+        const hsize_t size[2] = { dims[0] + 1, STATUS_COUNT }, start[2] = { dims[0], 0 }, count[2] = { 1, STATUS_COUNT };
+        status = H5Dset_extent( dataset_id, size );
+        hid_t file_space = H5Dget_space( dataset_id );
+        hid_t mem_space = H5Screate_simple( 2, count, NULL );
+        if (status >= 0) status = H5Sselect_hyperslab( file_space, H5S_SELECT_SET, start, NULL, count, NULL );
+        if (status >= 0) status = H5Dwrite( dataset_id, H5T_NATIVE_LLONG, mem_space, file_space, H5P_DEFAULT, counts );
+        if (status < 0) H5Dset_extent( dataset_id, dims );
+        H5Sclose( mem_space );
+        H5Sclose( file_space );
+        H5Dclose( dataset_id );
+    }
+
+    // A failed write leaves the columns as they were, so the table stays readable
+    if (status < 0)
+    {
+        truncateColumn( group_id, "particleNum", from );
+        for (int c = 0; c < COUNTER_COLUMNS; c++) truncateColumn( group_id, counterNames[c], from );
+        for (int c = 0; c < DOUBLE_COLUMNS; c++) truncateColumn( group_id, doubleNames[c], from );
+        truncateColumn( group_id, "status", from );
+    }
+    H5Gclose( group_id );
+    return status;
+}
+
+hdfFile::hdfFile( std::string filename ) : closing( false )
+{
+    {
+        std::lock_guard<std::mutex> lock( hdfLibrary );
+        file_id = H5Fcreate( filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT );
+    }
+    if (file_id < 0) throw std::runtime_error("Unable to create " + filename);
+
+    writer = std::thread( &hdfFile::run, this );
+}
+
+hdfFile::~hdfFile()
+{
+    try {
+        close();
+    } catch (std::exception& err) {
+        std::cerr << err.what() << '\n';
+    }
+}
+
+void hdfFile::createGroup( std::string path, std::map<std::string, double> attributes )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    hid_t group_id = H5Gcreate2( file_id, path.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT );
+    if (group_id < 0) throw std::runtime_error("Unable to create group " + path);
+    H5Gclose( group_id );
+
+    for (auto const& it : attributes)
+    {
+        H5LTset_attribute_double(file_id, path.c_str(), it.first.c_str(), &it.second, 1);
+    }
+}
+
+void hdfFile::writeTable( std::string path, hsize_t nfields, hsize_t nrecords, size_t type_size,
+                          const char *field_names[], const size_t *field_offset, const fieldType *field_types,
+                          const void *data, std::map<std::string, double> attributes )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    hid_t string_type = H5Tcopy( H5T_C_S1 );
+    H5Tset_size( string_type, CHAR_COUNT );
+    std::vector<hid_t> types( nfields );
+    for (hsize_t i = 0; i < nfields; i++)
+    {
+        switch (field_types[i])
+        {
+            case fieldType::integer: types[i] = H5T_NATIVE_LLONG; break;
+            case fieldType::real:    types[i] = H5T_NATIVE_DOUBLE; break;
+            case fieldType::text:    types[i] = string_type; break;
+        }
+    }
+    herr_t status = H5TBmake_table( path.c_str(), file_id, path.c_str(), nfields, nrecords, type_size,
+                                    field_names, field_offset, types.data(),
+                                    std::max<hsize_t>(nrecords, 1), NULL, 0, data );
+    H5Tclose( string_type );
+    if (status < 0) throw std::runtime_error("Unable to write table " + path);
+
+    for (auto const& it : attributes)
+    {
+        H5LTset_attribute_double(file_id, path.c_str(), it.first.c_str(), &it.second, 1);
+    }
+}
+
+void hdfFile::writeArray( std::string path, const std::vector<long long> &data )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    const hsize_t dims[1] = { data.size() };
+    if (H5LTmake_dataset( file_id, path.c_str(), 1, dims, H5T_NATIVE_LLONG, data.data() ) < 0)
+        throw std::runtime_error("Unable to write dataset " + path);
+}
+
+void hdfFile::writeArray( std::string path, const std::vector<double> &data )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    const hsize_t dims[1] = { data.size() };
+    if (H5LTmake_dataset( file_id, path.c_str(), 1, dims, H5T_NATIVE_DOUBLE, data.data() ) < 0)
+        throw std::runtime_error("Unable to write dataset " + path);
+}
+
+void hdfFile::setAttributes( std::string path, std::map<std::string, long long> attributes )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    for (auto const& it : attributes)
+    {
+        H5LTset_attribute_long_long(file_id, path.c_str(), it.first.c_str(), &it.second, 1);
+    }
+}
+
+void hdfFile::setAttribute( std::string path, std::string name, uint64_t value )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    hid_t space_id = H5Screate( H5S_SCALAR );
+    hid_t attr_id = H5Acreate_by_name( file_id, path.c_str(), name.c_str(), H5T_NATIVE_UINT64, space_id,
+                                       H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT );
+    herr_t status = (attr_id < 0) ? -1 : H5Awrite( attr_id, H5T_NATIVE_UINT64, &value );
+    if (attr_id >= 0) H5Aclose( attr_id );
+    H5Sclose( space_id );
+    if (status < 0) throw std::runtime_error("Unable to write attribute " + name + " of " + path);
+}
+
+void hdfFile::setAttribute( std::string path, std::string name, const std::string &value )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    if (H5LTset_attribute_string( file_id, path.c_str(), name.c_str(), value.c_str() ) < 0)
+        throw std::runtime_error("Unable to write attribute " + name + " of " + path);
+}
+
+void hdfFile::push( const std::string &table, bool columnar, std::vector<hdfOutputFormat> &records )
+{
+    std::unique_lock<std::mutex> lock( mtx );
+    queueChanged.wait( lock, [this]{ return queue.empty() || error; } );   // The front stays queued until it is written
+    if (error)
+    {
+        records.clear();    // the error is reported by close()
+        return;
+    }
+    queue.push_back( pendingWrite{ table, columnar, std::vector<hdfOutputFormat>() } );
+    queue.back().records.swap( records );
+    queueChanged.notify_all();
+}
+
+void hdfFile::run()
+{
+    std::unique_lock<std::mutex> lock( mtx );
+    while (true)
+    {
+        queueChanged.wait( lock, [this]{ return !queue.empty() || closing; } );
+        if (queue.empty()) return;
+
+        // Write without holding the queue lock so the simulation can keep filling buffers
+        pendingWrite &next = queue.front();
+        lock.unlock();
+        herr_t status = 0;
+        std::exception_ptr failure;
+        try {
+            phaseTimer timer( metricsPhase::output );
+            std::lock_guard<std::mutex> library( hdfLibrary );
+            if (next.columnar) {
+                status = appendColumns( file_id, next.table, next.records );
+            } else {
+                status = H5TBappend_records( file_id, next.table.c_str(), next.records.size(), sizeof( hdfOutputFormat ),
+                                             dst_offset, dst_sizes, next.records.data() );
+            }
+            if (status >= 0) status = H5Fflush( file_id, H5F_SCOPE_LOCAL );
+        } catch (std::exception&) {
+            failure = std::current_exception();
+        }
+        lock.lock();
+
+        if (status < 0 && !failure) failure = std::make_exception_ptr( std::runtime_error("Failed to write records to " + next.table) );
+        if (failure && !error) error = failure;
+        queue.pop_front();
+        queueChanged.notify_all();
+    }
+}
+
+void hdfFile::close()
+{
+    if (!writer.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        closing = true;
+    }
+    queueChanged.notify_all();
+    writer.join();
+
+    {
+        std::lock_guard<std::mutex> lock( hdfLibrary );
+        H5Fclose( file_id );
+    }
+
+    if (error) std::rethrow_exception( error );
+}
+
+hdfTableWriter::hdfTableWriter( hdfFile &file, std::string path, std::map<std::string, double> attributes,
+                                int compression, bool shuffle, size_t bufferRecords )
+                                : file( file ), path( path ), columnar( false ), bufferRecords( bufferRecords )
+{
+    if (compression < 0 || compression > 9)
+        throw std::invalid_argument("Compression level must be between 0 and 9");
+
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    const hid_t file_id = file.file_id;
 
     // Initialize field types
     hid_t string_type = H5Tcopy( H5T_C_S1 );
@@ -40,32 +399,360 @@ void writeToHDF( std::string filename, std::vector<hdfOutputFormat> results , st
                             string_type,
                             H5T_NATIVE_INT,
                             H5T_NATIVE_INT,
+                            H5T_NATIVE_INT,
                             H5T_NATIVE_DOUBLE,
                             H5T_NATIVE_DOUBLE,
                             H5T_NATIVE_DOUBLE};
 
-    // Calculate file writing chunk size... this is kind of arbitrary since I couldn't
-    // find a method to auto-calculate chunk size for you
-    int chunk_size = std::ceil( nrecords / NFIELDS);
-    double buffer;
+    // Empty, extendible table. Built by hand rather than with H5TBmake_table since that
+    // only offers a fixed deflate level and no shuffle filter
+    hid_t record_type = H5Tcreate( H5T_COMPOUND, sizeof( hdfOutputFormat ) );
+    for (hsize_t i = 0; i < NFIELDS; i++)
+        H5Tinsert( record_type, field_names[i], dst_offset[i], field_type[i] );
 
+    hsize_t dims[1] = {0};
+    hsize_t maxdims[1] = {H5S_UNLIMITED};
+    hsize_t chunk[1] = {CHUNK_RECORDS};
+    hid_t space_id = H5Screate_simple( 1, dims, maxdims );
+    hid_t plist_id = H5Pcreate( H5P_DATASET_CREATE );
+    H5Pset_chunk( plist_id, 1, chunk );
+    if (shuffle) H5Pset_shuffle( plist_id );
+    if (compression > 0) H5Pset_deflate( plist_id, compression );
 
-    // Create file
-    file_id = H5Fcreate( filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT );
+    hid_t dataset_id = H5Dcreate2( file_id, path.c_str(), record_type, space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT );
+    H5Pclose( plist_id );
+    H5Sclose( space_id );
+    H5Tclose( record_type );
+    H5Tclose( string_type );
+    if (dataset_id < 0) throw std::runtime_error("Unable to create table " + path);
+    H5Dclose( dataset_id );
 
-    H5TBmake_table( "table", file_id, "table", NFIELDS, nrecords ,
-                            dst_size, field_names, dst_offset, field_type,
-                            chunk_size, fill_data, COMPRESSION, static_cast<void*>(results.data())  );
+    // Attributes H5TB and PyTables use to recognize the dataset as a table
+    H5LTset_attribute_string( file_id, path.c_str(), "CLASS", "TABLE" );
+    H5LTset_attribute_string( file_id, path.c_str(), "VERSION", "3.0" );
+    H5LTset_attribute_string( file_id, path.c_str(), "TITLE", "table" );
+    for (hsize_t i = 0; i < NFIELDS; i++)
+    {
+        std::string name = "FIELD_" + std::to_string(i) + "_NAME";
+        H5LTset_attribute_string( file_id, path.c_str(), name.c_str(), field_names[i] );
+    }
 
     // Write attributes
     for (auto const& it : attributes)
     {
-        H5LTset_attribute_double(file_id, "/table", it.first.c_str(), &it.second, 1);
-        H5LTget_attribute_double(file_id, "/table", it.first.c_str(), &buffer);
+        H5LTset_attribute_double(file_id, path.c_str(), it.first.c_str(), &it.second, 1);
     }
 
-    // Close everything else
-    H5Tclose( string_type );
+    buffer.reserve( bufferRecords );
+}
+
+hdfTableWriter::hdfTableWriter( hdfFile &file, std::string path, std::map<std::string, double> attributes,
+                                const columnFormat &format, size_t bufferRecords )
+                                : file( file ), path( path ), columnar( true ), bufferRecords( bufferRecords )
+{
+    if (format.compression < 0 || format.compression > 9)
+        throw std::invalid_argument("Compression level must be between 0 and 9");
+    if (format.maxCount < 0 || format.maxCount > 0xFFFFFFFFLL)
+        throw std::invalid_argument("Counters of " + path + " do not fit in 32 bits");
+
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    const hid_t file_id = file.file_id;
+    if (format.lz4 && H5Zfilter_avail( LZ4_FILTER ) <= 0)
+        throw std::invalid_argument("--lz4 needs the HDF5 LZ4 filter plugin (see HDF5_PLUGIN_PATH)");
+
+    hid_t group_id = H5Gcreate2( file_id, path.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT );
+    if (group_id < 0) throw std::runtime_error("Unable to create group " + path);
+
+    // Every column is chunked, shuffled and compressed
+    hsize_t dims[1] = {0};
+    hsize_t maxdims[1] = {H5S_UNLIMITED};
+    hsize_t chunk[1] = {COLUMN_CHUNK_RECORDS};
+    hid_t space_id = H5Screate_simple( 1, dims, maxdims );
+    hid_t plist_id = H5Pcreate( H5P_DATASET_CREATE );
+    H5Pset_chunk( plist_id, 1, chunk );
+    H5Pset_shuffle( plist_id );
+    if (format.lz4) {
+        H5Pset_filter( plist_id, LZ4_FILTER, H5Z_FLAG_MANDATORY, 0, NULL );
+    } else if (format.compression > 0) {
+        H5Pset_deflate( plist_id, format.compression );
+    }
+
+    hid_t status_type = statusType();
+    const hid_t counter_type = (format.maxCount <= 0xFF) ? H5T_STD_U8LE : (format.maxCount <= 0xFFFF) ? H5T_STD_U16LE : H5T_STD_U32LE;
+
+    bool created = true;
+    auto column = [&]( const char *name, hid_t type ) {
+        hid_t dataset_id = H5Dcreate2( group_id, name, type, space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT );
+        created = created && dataset_id >= 0;
+        if (dataset_id >= 0) H5Dclose( dataset_id );
+    };
+    column( "particleNum", H5T_STD_I32LE );
+    for (int c = 0; c < COUNTER_COLUMNS; c++) column( counterNames[c], counter_type );
+    for (int c = 0; c < DOUBLE_COLUMNS; c++) column( doubleNames[c], H5T_IEEE_F64LE );
+    column( "status", status_type );
+    H5Tclose( status_type );
+    H5Pclose( plist_id );
+    H5Sclose( space_id );
+
+    // Rows of each status in each buffer
+    hsize_t countDims[2] = {0, STATUS_COUNT};
+    hsize_t countMaxdims[2] = {H5S_UNLIMITED, STATUS_COUNT};
+    hsize_t countChunk[2] = {256, STATUS_COUNT};
+    space_id = H5Screate_simple( 2, countDims, countMaxdims );
+    plist_id = H5Pcreate( H5P_DATASET_CREATE );
+    H5Pset_chunk( plist_id, 2, countChunk );
+    hid_t dataset_id = H5Dcreate2( group_id, "blockStatusCounts", H5T_STD_I64LE, space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT );
+    created = created && dataset_id >= 0;
+    if (dataset_id >= 0) H5Dclose( dataset_id );
+    H5Pclose( plist_id );
+    H5Sclose( space_id );
+    H5Gclose( group_id );
+    if (!created) throw std::runtime_error("Unable to create the columns of " + path);
+
+    H5LTset_attribute_string( file_id, path.c_str(), "layout", "columnar" );
+    H5LTset_attribute_long_long( file_id, path.c_str(), "maxCount", &format.maxCount, 1 );
+    for (auto const& it : attributes)
+    {
+        H5LTset_attribute_double(file_id, path.c_str(), it.first.c_str(), &it.second, 1);
+    }
+
+    buffer.reserve( bufferRecords );
+}
+
+hdfTableWriter::~hdfTableWriter()
+{
+    flush();
+}
+
+void hdfTableWriter::append( const hdfOutputFormat &record )
+{
+    buffer.push_back( record );
+    if (buffer.size() >= bufferRecords)
+    {
+        file.push( path, columnar, buffer );
+        buffer.reserve( bufferRecords );
+    }
+}
+
+void hdfTableWriter::flush()
+{
+    if (!buffer.empty()) file.push( path, columnar, buffer );
+}
+
+hdfReader::hdfReader( std::string filename ) : filename( filename )
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    file_id = H5Fopen( filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT );
+    if (file_id < 0) throw std::runtime_error("Unable to open " + filename);
+}
+
+hdfReader::~hdfReader()
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
     H5Fclose( file_id );
+}
 
+bool hdfReader::exists( std::string path ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    return H5LTpath_valid( file_id, path.c_str(), 1 ) > 0;
+}
+
+// Attributes of one kind found by H5Aiterate2
+struct attributeScan
+{
+    std::map<std::string, double> doubles;
+    std::map<std::string, long long> integers;
+};
+
+static herr_t scanAttribute( hid_t location, const char *name, const H5A_info_t *, void *data )
+{
+    attributeScan &scan = *static_cast<attributeScan*>( data );
+    hid_t attr_id = H5Aopen( location, name, H5P_DEFAULT );
+    hid_t type_id = H5Aget_type( attr_id );
+    hid_t space_id = H5Aget_space( attr_id );
+
+    // Only single values, and not the unsigned seed
+    herr_t status = 0;
+    if (H5Sget_simple_extent_npoints( space_id ) == 1)
+    {
+        if (H5Tget_class( type_id ) == H5T_FLOAT) {
+            status = H5Aread( attr_id, H5T_NATIVE_DOUBLE, &scan.doubles[name] );
+        } else if (H5Tget_class( type_id ) == H5T_INTEGER && H5Tget_sign( type_id ) == H5T_SGN_2) {
+            status = H5Aread( attr_id, H5T_NATIVE_LLONG, &scan.integers[name] );
+        }
+    }
+    H5Sclose( space_id );
+    H5Tclose( type_id );
+    H5Aclose( attr_id );
+    return status;
+}
+
+static attributeScan scanAttributes( hid_t file_id, const std::string &path )
+{
+    attributeScan scan;
+    hid_t object_id = H5Oopen( file_id, path.c_str(), H5P_DEFAULT );
+    if (object_id < 0) throw std::runtime_error("No object " + path);
+    herr_t status = H5Aiterate2( object_id, H5_INDEX_NAME, H5_ITER_INC, NULL, scanAttribute, &scan );
+    H5Oclose( object_id );
+    if (status < 0) throw std::runtime_error("Unable to read attributes of " + path);
+    return scan;
+}
+
+std::map<std::string, double> hdfReader::doubleAttributes( std::string path ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    return scanAttributes( file_id, path ).doubles;
+}
+
+std::map<std::string, long long> hdfReader::integerAttributes( std::string path ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    return scanAttributes( file_id, path ).integers;
+}
+
+uint64_t hdfReader::unsignedAttribute( std::string path, std::string name ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    uint64_t value;
+    hid_t attr_id = H5Aopen_by_name( file_id, path.c_str(), name.c_str(), H5P_DEFAULT, H5P_DEFAULT );
+    herr_t status = (attr_id < 0) ? -1 : H5Aread( attr_id, H5T_NATIVE_UINT64, &value );
+    if (attr_id >= 0) H5Aclose( attr_id );
+    if (status < 0) throw std::runtime_error(filename + " has no attribute " + name + " on " + path);
+    return value;
+}
+
+std::string hdfReader::textAttribute( std::string path, std::string name ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    if (H5Aexists_by_name( file_id, path.c_str(), name.c_str(), H5P_DEFAULT ) <= 0) return "";
+    hsize_t dims;
+    H5T_class_t type_class;
+    size_t size;
+    if (H5LTget_attribute_info( file_id, path.c_str(), name.c_str(), &dims, &type_class, &size ) < 0 || type_class != H5T_STRING)
+        throw std::runtime_error(filename + " has no text attribute " + name + " on " + path);
+    std::vector<char> value( size + 1, 0 );
+    if (H5LTget_attribute_string( file_id, path.c_str(), name.c_str(), value.data() ) < 0)
+        throw std::runtime_error("Unable to read attribute " + name + " of " + path + " in " + filename);
+    return std::string( value.data() );
+}
+
+bool hdfReader::columnar( std::string path ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    if (H5LTpath_valid( file_id, path.c_str(), 1 ) <= 0) return false;
+    hid_t object_id = H5Oopen( file_id, path.c_str(), H5P_DEFAULT );
+    const bool group = (H5Iget_type( object_id ) == H5I_GROUP);
+    H5Oclose( object_id );
+    return group;
+}
+
+hsize_t hdfReader::records( std::string path ) const
+{
+    if (columnar( path ))
+    {
+        std::lock_guard<std::mutex> lock( hdfLibrary );
+        hsize_t dims[1];
+        if (H5LTget_dataset_info( file_id, (path + "/particleNum").c_str(), dims, NULL, NULL ) < 0)
+            throw std::runtime_error(filename + " has no column " + path + "/particleNum");
+        return dims[0];
+    }
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    hsize_t nfields, nrecords;
+    if (H5TBget_table_info( file_id, path.c_str(), &nfields, &nrecords ) < 0)
+        throw std::runtime_error(filename + " has no table " + path);
+    return nrecords;
+}
+
+void hdfReader::readTable( std::string path, size_t type_size, const size_t *field_offset, const size_t *field_sizes,
+                           void *data ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    if (H5TBread_table( file_id, path.c_str(), type_size, field_offset, field_sizes, data ) < 0)
+        throw std::runtime_error("Unable to read table " + path + " of " + filename);
+}
+
+// Read n values from rows [from, from + n) of a 1D dataset
+static herr_t readColumn( hid_t group_id, const char *name, hid_t mem_type, hsize_t from, hsize_t n, void *data )
+{
+    hid_t dataset_id = H5Dopen2( group_id, name, H5P_DEFAULT );
+    if (dataset_id < 0) return -1;
+    const hsize_t start[1] = { from }, count[1] = { n };
+    hid_t file_space = H5Dget_space( dataset_id );
+    hid_t mem_space = H5Screate_simple( 1, count, NULL );
+    herr_t status = H5Sselect_hyperslab( file_space, H5S_SELECT_SET, start, NULL, count, NULL );
+    if (status >= 0) status = H5Dread( dataset_id, mem_type, mem_space, file_space, H5P_DEFAULT, data );
+    H5Sclose( mem_space );
+    H5Sclose( file_space );
+    H5Dclose( dataset_id );
+    return status;
+}
+
+void hdfReader::readRecords( std::string path, hsize_t start, std::vector<hdfOutputFormat> &records ) const
+{
+    if (columnar( path ))
+    {
+        std::lock_guard<std::mutex> lock( hdfLibrary );
+        const size_t n = records.size();
+        if (n == 0) return;
+        hid_t group_id = H5Gopen2( file_id, path.c_str(), H5P_DEFAULT );
+        if (group_id < 0) throw std::runtime_error(filename + " has no table " + path);
+        std::vector<int> ints( n );
+        herr_t status = readColumn( group_id, "particleNum", H5T_NATIVE_INT, start, n, ints.data() );
+        for (size_t k = 0; k < n; k++) records[k].particleNum = ints[k];
+        for (int c = 0; c < COUNTER_COLUMNS && status >= 0; c++)
+        {
+            status = readColumn( group_id, counterNames[c], H5T_NATIVE_INT, start, n, ints.data() );
+            for (size_t k = 0; k < n; k++) records[k].*counterColumns[c] = ints[k];
+        }
+        std::vector<double> doubles( n );
+        for (int c = 0; c < DOUBLE_COLUMNS && status >= 0; c++)
+        {
+            status = readColumn( group_id, doubleNames[c], H5T_NATIVE_DOUBLE, start, n, doubles.data() );
+            for (size_t k = 0; k < n; k++) records[k].*doubleColumns[c] = doubles[k];
+        }
+        std::vector<uint8_t> codes( n );
+        hid_t status_type = statusType();
+        if (status >= 0) status = readColumn( group_id, "status", status_type, start, n, codes.data() );
+        H5Tclose( status_type );
+        H5Gclose( group_id );
+        if (status < 0) throw std::runtime_error("Unable to read records of " + path + " in " + filename);
+        for (size_t k = 0; k < n; k++)
+        {
+            if (codes[k] >= STATUS_COUNT) throw std::runtime_error("Unknown status in " + path + " of " + filename);
+            const char *name = statusName( static_cast<particleStatus>( codes[k] ) );  // Shorter than CHAR_COUNT
+            std::memcpy( records[k].status, name, std::strlen( name ) + 1 );
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    if (H5TBread_records( file_id, path.c_str(), start, records.size(), sizeof( hdfOutputFormat ),
+                          dst_offset, dst_sizes, records.data() ) < 0)
+        throw std::runtime_error("Unable to read records of " + path + " in " + filename);
+}
+
+std::vector<long long> hdfReader::readArray( std::string path ) const
+{
+    std::lock_guard<std::mutex> lock( hdfLibrary );
+    int rank;
+    if (H5LTget_dataset_ndims( file_id, path.c_str(), &rank ) < 0 || rank < 1)
+        throw std::runtime_error(filename + " has no dataset " + path);
+    std::vector<hsize_t> dims( rank );
+    H5LTget_dataset_info( file_id, path.c_str(), dims.data(), NULL, NULL );
+    hsize_t size = 1;
+    for (hsize_t d : dims) size *= d;
+    std::vector<long long> data( size );
+    if (H5LTread_dataset( file_id, path.c_str(), H5T_NATIVE_LLONG, data.data() ) < 0)
+        throw std::runtime_error("Unable to read dataset " + path + " of " + filename);
+    return data;
+}
+
+void writeToHDF( std::string filename, const std::vector<hdfOutputFormat> &results , std::map<std::string, double> attributes)
+{
+    hdfFile file( filename );
+    {
+        hdfTableWriter table( file, "table", attributes );
+        for (auto const& record : results) table.append( record );
+    }
+    file.close();
 }
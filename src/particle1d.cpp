@@ -4,134 +4,202 @@
 #include <iostream>
 #include <map>
 #include "particle1d.hpp"
+#include "reweight.hpp"
 
-particle1d::particle1d( double startTime, double startVelocity, std::map<std::string, double> p )
-            : start( p["start"] ), window( p["window"] ), cell( p["cell"] ),
+template<typename generator>
+particle1d<generator>::particle1d( double startTime, const velocityBin &startVelocity, std::map<std::string, double> p )
+            : tally( nullptr ), start( p["start"] ), window( p["window"] ), cell( p["cell"] ),
             source( p["source"] ), cellChance( p["cellChance"] ), lossPerStep( p["lossPerStep"] ),
-            windowLoss( p["windowLoss"] ), stepSize( p["stepSize"] ), stepSize2( p["stepSize2"] ) , fillTime( p["fillTime"] )
+            windowLoss( p["windowLoss"] ), stepSize( p["stepSize"] ), stepSize2( p["stepSize2"] ) , fillTime( p["fillTime"] ),
+            exponentialDwell( p["exponentialDwell"] != 0 ),
+            cellThreshold( bernoulliThreshold( cellChance ) ),
+            cellExitThreshold( stepSize2 != 0 ? bernoulliThreshold( cellEntranceChance( stepSize2, CELL_EXIT_NONSPEC ) ) : 0 ),
+            lossPerStepThreshold( bernoulliThreshold( lossPerStep ) ), windowLossThreshold( bernoulliThreshold( windowLoss ) ),
+            walker( pickWalk( source < cell, stepSize2 != 0, false ) ), prefixWalker( pickWalk( source < cell, stepSize2 != 0, true ) )
 {
     resetState( startTime, startVelocity );
-    sourceLeftCellRight = (source < cell);
 }
 
-void particle1d::resetState(  double startTime, double startVelocity, int num )
+template<typename generator>
+void particle1d<generator>::resetState(  double startTime, const velocityBin &startVelocity, int num )
 {
     particleNum = num;
     windowHits = 0;
     totalSteps = 0;
     cellExits = 0;
-    cellEntranceChance = cellChance;
+    pipeSteps = 0;
+    cellEntranceThreshold = cellThreshold;
     location = start;
     prevLocation = start;
-    status = "alive";
+    status = particleStatus::alive;
     cellRejections = 0;
     tstart = startTime;
     t = startTime;
-    v = startVelocity;
+    v = startVelocity.v;
     mfp = stepSize;
-    cellExitLifetime = 4 / v * CELL_VOLUME / (std::pow(CELL_ENTRANCE_ID/2, 2 ) * M_PI);
+    dt = mfp / v;
+    cellExitLifetime = startVelocity.cellExitLifetime;
 }
 
-std::map<std::string, boost::variant<double, int, std::string> > particle1d::getState()
+template<typename generator>
+void particle1d<generator>::resumeFrom( const particle1d &prefix )
 {
-    std::map<std::string, boost::variant<double, int, std::string>> output = {
-        {"particleNum", particleNum},
-        {"windowHits", windowHits},
-        {"totalSteps", totalSteps},
-        {"location", location},
-        {"status", status},
-        {"cellRejections", cellRejections},
-        {"cellExits", cellExits},
-        {"velocity", v},
-        {"tstart", tstart},
-        {"tend", t},
-        {"mfp", t}
-    };
-    return output;
+    particleNum = prefix.particleNum;
+    windowHits = prefix.windowHits;
+    totalSteps = prefix.totalSteps;
+    cellExits = prefix.cellExits;
+    pipeSteps = prefix.pipeSteps;
+    location = prefix.location;
+    prevLocation = prefix.prevLocation;
+    status = prefix.status;
+    cellRejections = prefix.cellRejections;
+    tstart = prefix.tstart;
+    t = prefix.t;
+    v = prefix.v;
+    cellExitLifetime = prefix.cellExitLifetime;
+
+    // Nothing before the first cell exit depends on stepSize2, so only the exit itself is redone
+    cellEntranceThreshold = cellThreshold;
+    mfp = stepSize;
+    dt = mfp / v;
+    if (cellExits) leaveCell( source < cell, stepSize2 != 0 );
+}
+
+double meanFreePath( const double nonspec )
+{
+    return PIPE_ID * sqrt( 2*(2-nonspec)/nonspec/3 );
 }
 
-float particle1d::getLocation()
+double cellEntranceChance( const double mfp, const double nonspec )
+{
+    return std::pow( (1 - std::pow( 1- std::pow(CELL_ENTRANCE_ID/2 , 2) / PIPE_ID / mfp , 1/nonspec) ) , 2 );
+}
+
+const char* statusName( particleStatus status )
+{
+    switch (status)
+    {
+        case particleStatus::alive:  return "alive";
+        case particleStatus::source: return "source";
+        case particleStatus::pipe:   return "pipe";
+        case particleStatus::window: return "window";
+        case particleStatus::cell:   return "cell";
+    }
+    return "unknown";
+}
+
+template<typename generator>
+particleState particle1d<generator>::getState() const
+{
+    return particleState{ particleNum, windowHits, totalSteps, location, status,
+                          cellRejections, cellExits, pipeSteps, v, tstart, t };
+}
+
+template<typename generator>
+float particle1d<generator>::getLocation()
 {
     return location;
 }
 
-void particle1d::walk( TMCGenerator &mc )
+template<typename generator>
+void particle1d<generator>::setLossTally( lossTally *t )
 {
-    while ( (t < fillTime) && status=="alive" )
+    tally = t;
+}
+
+template<typename generator>
+typename particle1d<generator>::walkFunction particle1d<generator>::pickWalk( bool sourceLeftCellRight, bool changeMfp, bool untilExit )
+{
+    if (untilExit) {
+        if (sourceLeftCellRight) return changeMfp ? &particle1d::walkWith<true, true, true> : &particle1d::walkWith<true, false, true>;
+        return changeMfp ? &particle1d::walkWith<false, true, true> : &particle1d::walkWith<false, false, true>;
+    } else if (sourceLeftCellRight) {
+        return changeMfp ? &particle1d::walkWith<true, true, false> : &particle1d::walkWith<true, false, false>;
+    } else {
+        return changeMfp ? &particle1d::walkWith<false, true, false> : &particle1d::walkWith<false, false, false>;
+    }
+}
+
+template<typename generator>
+template<bool sourceLeftCellRight, bool changeMfp, bool untilExit>
+void particle1d<generator>::walkWith( randomStream<generator> &mc )
+{
+    // The first step ignores the window
+    if ( totalSteps == 0 && (t < fillTime) && status == particleStatus::alive ) step<sourceLeftCellRight, changeMfp, false>( mc );
+    while ( (t < fillTime) && status == particleStatus::alive && !(untilExit && cellExits) )
     {
         // std::cout << totalSteps << "\tt: " << t << "\tloc: " << location << "\n";
-        step( mc );
+        step<sourceLeftCellRight, changeMfp, true>( mc );
     }
 
 }
 
-void particle1d::step( TMCGenerator &mc )
+template<typename generator>
+template<bool sourceLeftCellRight, bool changeMfp, bool checkWindow>
+void particle1d<generator>::step( randomStream<generator> &mc )
 {
     prevLocation = location;
-    location +=  ( 1-(2*zeroOrOne(mc)) )  * mfp;
-    t += mfp / v;
+    location +=  ( 1-(2*mc.bit()) )  * mfp;
+    t += dt;
     totalSteps++;
 
     // Check collisions
-    if (crossedWindow()) {
+    if (checkWindow && crossedWindow()) {
         windowHits++;
-        if (zeroToOne(mc) < windowLoss) status = "window";  //chance for loss on the window
-    } else if ( (location <= source && sourceLeftCellRight) || (location >= source && !sourceLeftCellRight) ) {
-        status = "source"; // neutrons get absorbed by the source
-    } else if ( (location >= cell && sourceLeftCellRight) ||  (location <= cell && !sourceLeftCellRight) ) {
+        if (tally) tally->windowHit( windowHits - 1, pipeSteps );
+        if (mc.bernoulli( windowLossThreshold )) status = particleStatus::window;  //chance for loss on the window
+    } else if ( sourceLeftCellRight ? (location <= source) : (location >= source) ) {
+        status = particleStatus::source; // neutrons get absorbed by the source
+    } else if ( sourceLeftCellRight ? (location >= cell) : (location <= cell) ) {
         // chance for neutrons to get into cell
-        if (zeroToOne(mc) < cellEntranceChance) {
-            if ( (fillTime - t) < cellExitLifetime )
+        if (mc.bernoulli( cellEntranceThreshold )) {
+            const double dwell = exponentialDwell ? cellExitLifetime * mc.exponential() : cellExitLifetime;
+            if ( (fillTime - t) < dwell )
             {
-                // TODO: option for cellExitLifetime to be calculated from exponential curve
-                status = "cell";
+                status = particleStatus::cell;
                 t = fillTime;
             } else {
                 // If neutron exits the cell
-                t += cellExitLifetime;
+                t += dwell;
                 cellExits++;
                 totalSteps++;
-
-                // Change MFP after cell exit
-                if (stepSize2 != 0)
-                {
-                    mfp = stepSize2;
-                    cellEntranceChance = std::pow( (1 - std::pow( 1- std::pow(CELL_ENTRANCE_ID/2 , 2) / (3 * 0.0254) / stepSize2 , 20) ) , 2 );
-
-                }
-
-                location = cell + ( mfp * leavingCellDirection());
+                leaveCell( sourceLeftCellRight, changeMfp );
             }
         } else {
         //neutron rejected from entrance
             location = prevLocation;
             totalSteps++;
             cellRejections++;
-            t += mfp / v;
+            t += dt;
         }
-    } else if (zeroToOne(mc) < lossPerStep ) {
+    } else {
         //chance to be absorbed by pipe
-        status = "pipe";
+        pipeSteps++;
+        if (mc.bernoulli( lossPerStepThreshold )) status = particleStatus::pipe;
     }
 
 
 }
 
-int particle1d::leavingCellDirection()
+template<typename generator>
+inline void particle1d<generator>::leaveCell( bool sourceLeftCellRight, bool changeMfp )
 {
-    if (sourceLeftCellRight) {
-        return -1;
-    } else {
-        return 1;
+    // Change MFP after cell exit
+    if (changeMfp)
+    {
+        mfp = stepSize2;
+        dt = mfp / v;
+        cellEntranceThreshold = cellExitThreshold;
     }
+
+    // Back into the pipe, on the side the source is on
+    location = cell + ( sourceLeftCellRight ? -mfp : mfp );
 }
 
-bool particle1d::crossedWindow()
+template<typename generator>
+bool particle1d<generator>::crossedWindow() const
 {
-    if (totalSteps <= 1) {
-        // Ignore the first step
-        return false;
-    } else if (prevLocation < window &&  window < location) {
+    if (prevLocation < window &&  window < location) {
         return true;
     } else if (prevLocation > window  && window > location) {
         return true;
@@ -141,3 +209,7 @@ bool particle1d::crossedWindow()
         return false;
     }
 }
+
+template class particle1d<std::mt19937_64>;
+template class particle1d<xoshiro256ss>;
+template class particle1d<philox4x32>;
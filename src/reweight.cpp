@@ -0,0 +1,153 @@
+#include <reweight.hpp>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+static uint64_t toFixed( double value, double scale )
+{
+    return static_cast<uint64_t>( std::max(0., value) * scale + 0.5 );
+}
+
+lossTally::lossTally( std::vector<lossPoint> grid )
+                    : grid( grid ), windowLost( grid.size(), 0 ), totals( grid.size(), sums{0, 0, 0, 0, 0, 0} ), particles( 0 )
+{
+    for (auto const& point : grid)
+    {
+        if (point.windowLoss < 0 || point.windowLoss > 1 || point.lossPerStep < 0 || point.lossPerStep > 1)
+            throw std::invalid_argument("Reweighting needs loss chances between 0 and 1");
+        logWindowPass.push_back( std::log1p( -point.windowLoss ) );
+        logPipePass.push_back( std::log1p( -point.lossPerStep ) );
+    }
+}
+
+void lossTally::windowHit( int hitsBefore, int pipeStepsBefore )
+{
+    for (size_t j = 0; j < grid.size(); j++)
+    {
+        windowLost[j] += grid[j].windowLoss * std::exp( hitsBefore * logWindowPass[j] + pipeStepsBefore * logPipePass[j] );
+    }
+}
+
+void lossTally::finish( const particleState &s )
+{
+    particles++;
+    for (size_t j = 0; j < grid.size(); j++)
+    {
+        const double survive = std::exp( s.windowHits * logWindowPass[j] + s.pipeSteps * logPipePass[j] );
+        sums &total = totals[j];
+        total.window += toFixed( windowLost[j], TALLY_SCALE );
+        total.pipe += toFixed( 1 - survive - windowLost[j], TALLY_SCALE );
+        switch (s.status)
+        {
+            case particleStatus::source: total.source += toFixed( survive, TALLY_SCALE ); break;
+            case particleStatus::alive:  total.alive += toFixed( survive, TALLY_SCALE ); break;
+            case particleStatus::cell:
+                total.cell += toFixed( survive, TALLY_SCALE );
+                total.cellWindowHits += toFixed( survive * s.windowHits, HITS_SCALE );
+                break;
+            default: break;     // Lossless walks never end on the pipe or window
+        }
+        windowLost[j] = 0;
+    }
+}
+
+void lossTally::continueFrom( const lossTally &prefix )
+{
+    if (prefix.grid.size() != grid.size()) throw std::logic_error("Continuing a particle on a loss tally of a different grid");
+    windowLost = prefix.windowLost;
+}
+
+void lossTally::merge( const lossTally &other )
+{
+    if (other.grid.size() != grid.size()) throw std::logic_error("Merging loss tallies of different grids");
+    particles += other.particles;
+    for (size_t j = 0; j < grid.size(); j++)
+    {
+        totals[j].source += other.totals[j].source;
+        totals[j].pipe += other.totals[j].pipe;
+        totals[j].window += other.totals[j].window;
+        totals[j].cell += other.totals[j].cell;
+        totals[j].alive += other.totals[j].alive;
+        totals[j].cellWindowHits += other.totals[j].cellWindowHits;
+    }
+}
+
+// Sums are unsigned and wrap on overflow, so they go through long long bit for bit
+void lossTally::merge( const std::vector<long long> &other )
+{
+    if (other.size() != 1 + 6 * grid.size()) throw std::runtime_error("Merging loss sums of a different grid");
+    particles += static_cast<uint64_t>( other[0] );
+    for (size_t j = 0; j < grid.size(); j++)
+    {
+        const long long *s = &other[1 + 6 * j];
+        totals[j].source += static_cast<uint64_t>( s[0] );
+        totals[j].pipe += static_cast<uint64_t>( s[1] );
+        totals[j].window += static_cast<uint64_t>( s[2] );
+        totals[j].cell += static_cast<uint64_t>( s[3] );
+        totals[j].alive += static_cast<uint64_t>( s[4] );
+        totals[j].cellWindowHits += static_cast<uint64_t>( s[5] );
+    }
+}
+
+std::vector<long long> lossTally::rawSums() const
+{
+    std::vector<long long> raw{ static_cast<long long>( particles ) };
+    for (auto const& total : totals)
+        for (uint64_t sum : { total.source, total.pipe, total.window, total.cell, total.alive, total.cellWindowHits })
+            raw.push_back( static_cast<long long>( sum ) );
+    return raw;
+}
+
+const std::vector<lossPoint>& lossTally::points() const
+{
+    return grid;
+}
+
+std::vector<reweightOutputFormat> lossTally::results() const
+{
+    std::vector<reweightOutputFormat> output;
+    const double norm = particles * TALLY_SCALE;
+    for (size_t j = 0; j < grid.size(); j++)
+    {
+        const sums &total = totals[j];
+        output.push_back( reweightOutputFormat{ grid[j].windowLoss, grid[j].lossPerBounce, grid[j].lossPerStep,
+                                                total.source / norm, total.pipe / norm, total.window / norm,
+                                                total.cell / norm, total.alive / norm,
+                                                total.cell ? total.cellWindowHits / HITS_SCALE / (total.cell / TALLY_SCALE) : 0 } );
+    }
+    return output;
+}
+
+// reweight table fields
+static const hsize_t REWEIGHT_FIELDS = 9;
+static const char *reweight_names[REWEIGHT_FIELDS] = { "windowLoss", "lossPerBounce", "lossPerStep",
+                                                       "source", "pipe", "window", "cell", "alive", "cellWindowHits" };
+static const size_t reweight_offset[REWEIGHT_FIELDS] = {  HOFFSET( reweightOutputFormat, windowLoss ),
+                                                          HOFFSET( reweightOutputFormat, lossPerBounce ),
+                                                          HOFFSET( reweightOutputFormat, lossPerStep ),
+                                                          HOFFSET( reweightOutputFormat, source ),
+                                                          HOFFSET( reweightOutputFormat, pipe ),
+                                                          HOFFSET( reweightOutputFormat, window ),
+                                                          HOFFSET( reweightOutputFormat, cell ),
+                                                          HOFFSET( reweightOutputFormat, alive ),
+                                                          HOFFSET( reweightOutputFormat, cellWindowHits ) };
+
+void writeReweight( hdfFile &file, std::string path, const std::vector<reweightOutputFormat> &results,
+                    std::map<std::string, double> attributes )
+{
+    fieldType field_types[REWEIGHT_FIELDS];
+    std::fill( field_types, field_types + REWEIGHT_FIELDS, fieldType::real );
+
+    file.writeTable( path, REWEIGHT_FIELDS, results.size(), sizeof( reweightOutputFormat ),
+                     reweight_names, reweight_offset, field_types, results.data(), attributes );
+}
+
+std::vector<reweightOutputFormat> readReweight( const hdfReader &file, std::string path )
+{
+    size_t field_sizes[REWEIGHT_FIELDS];
+    std::fill( field_sizes, field_sizes + REWEIGHT_FIELDS, sizeof( double ) );
+
+    std::vector<reweightOutputFormat> results( file.records( path ) );
+    file.readTable( path, sizeof( reweightOutputFormat ), reweight_offset, field_sizes, results.data() );
+    return results;
+}
@@ -0,0 +1,332 @@
+#include <serve.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Reads a flat JSON object one character at a time
+class jobLineParser {
+public:
+    explicit jobLineParser( const std::string &line ) : line( line ), at( 0 ) {}
+
+    std::map<std::string, jsonValue> object()
+    {
+        std::map<std::string, jsonValue> values;
+        expect( '{' );
+        if (peek() == '}')
+        {
+            at++;
+            return end( values );
+        }
+        while (true)
+        {
+            skipSpace();
+            if (peek() != '"') fail( "a quoted name" );
+            const std::string name = string();
+            expect( ':' );
+            if (!values.insert( { name, value() } ).second) throw std::invalid_argument("Job line gives " + name + " twice");
+            skipSpace();
+            if (peek() == ',') {
+                at++;
+            } else {
+                expect( '}' );
+                return end( values );
+            }
+        }
+    }
+
+private:
+    const std::string &line;
+    size_t at;
+
+    std::map<std::string, jsonValue> end( std::map<std::string, jsonValue> &values )
+    {
+        skipSpace();
+        if (at != line.size()) fail( "the end of the line" );
+        return values;
+    }
+
+    void skipSpace() { while (at < line.size() && std::isspace( static_cast<unsigned char>( line[at] ) )) at++; }
+    char peek() { skipSpace(); return at < line.size() ? line[at] : '\0'; }
+
+    void fail( const std::string &wanted )
+    {
+        throw std::invalid_argument("Job line is not a flat JSON object: expected " + wanted + " at column " + std::to_string( at + 1 ));
+    }
+
+    void expect( char c )
+    {
+        if (peek() != c) fail( std::string( "'" ) + c + "'" );
+        at++;
+    }
+
+    std::string string()
+    {
+        std::string text;
+        at++;   // Opening quote
+        while (at < line.size() && line[at] != '"')
+        {
+            char c = line[at++];
+            if (c == '\\')
+            {
+                if (at >= line.size()) break;
+                c = line[at++];
+                switch (c)
+                {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'u': fail( "no \\u escapes" ); break;
+                    default: break;     // \" \\ and \/
+                }
+            }
+            text += c;
+        }
+        if (at >= line.size()) fail( "a closing quote" );
+        at++;
+        return text;
+    }
+
+    jsonValue value()
+    {
+        const char c = peek();
+        if (c == '"') return jsonValue{ jsonValue::string, string() };
+        for (const char *word : {"true", "false", "null"})
+            if (line.compare( at, std::strlen( word ), word ) == 0)
+            {
+                at += std::strlen( word );
+                return jsonValue{ word[0] == 'n' ? jsonValue::null : jsonValue::boolean, word };
+            }
+
+        const size_t from = at;
+        while (at < line.size() && std::strchr( "+-.0123456789eE", line[at] )) at++;
+        if (at == from) fail( "a string, number, boolean or null" );
+        const std::string number = line.substr( from, at - from );
+        size_t used = 0;
+        try {
+            std::stod( number, &used );
+        } catch (std::logic_error&) {}
+        if (used != number.size()) fail( "a number" );
+        return jsonValue{ jsonValue::number, number };
+    }
+};
+
+std::map<std::string, jsonValue> parseJobLine( const std::string &line )
+{
+    return jobLineParser( line ).object();
+}
+
+std::string jsonString( const std::string &text )
+{
+    std::string quoted = "\"";
+    for (char c : text)
+    {
+        switch (c)
+        {
+            case '"': quoted += "\\\""; break;
+            case '\\': quoted += "\\\\"; break;
+            case '\n': quoted += "\\n"; break;
+            case '\t': quoted += "\\t"; break;
+            case '\r': quoted += "\\r"; break;
+            default:
+                if (static_cast<unsigned char>( c ) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    quoted += escaped;
+                } else {
+                    quoted += c;
+                }
+        }
+    }
+    return quoted + "\"";
+}
+
+std::string jsonText( const jsonValue &value )
+{
+    return (value.type == jsonValue::string) ? jsonString( value.text ) : value.text;
+}
+
+jobServer::jobServer( jobHandler handle, int jobs ) : handle( handle ), running( 0 ), stopping( false )
+{
+    if (jobs < 1) throw std::invalid_argument("--jobs must be at least 1");
+    for (int i = 0; i < jobs; i++) workers.emplace_back( &jobServer::run, this );
+}
+
+jobServer::~jobServer()
+{
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    for (auto &t : workers) t.join();
+}
+
+void jobServer::submit( job j )
+{
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        queue.push_back( std::move( j ) );
+    }
+    queueChanged.notify_all();
+}
+
+void jobServer::drain()
+{
+    std::unique_lock<std::mutex> lock( mtx );
+    queueChanged.wait( lock, [this]{ return queue.empty() && running == 0; } );
+}
+
+void jobServer::run()
+{
+    std::unique_lock<std::mutex> lock( mtx );
+    while (true)
+    {
+        queueChanged.wait( lock, [this]{ return !queue.empty() || stopping; } );
+        if (queue.empty()) return;
+
+        job next = std::move( queue.front() );
+        queue.pop_front();
+        running++;
+        lock.unlock();
+        next.reply( handle( next.line ) );
+        next = job();
+        lock.lock();
+        running--;
+        queueChanged.notify_all();
+    }
+}
+
+void jobServer::serveStream( std::istream &in, std::ostream &out )
+{
+    std::mutex replies;
+    std::string line;
+    while (std::getline( in, line ))
+    {
+        if (line.find_first_not_of( " \t\r" ) == std::string::npos) continue;
+        submit( job{ line, [&out, &replies]( const std::string &reply ) {
+            std::lock_guard<std::mutex> lock( replies );
+            out << reply << std::endl;
+        } } );
+    }
+    drain();
+}
+
+// One client of serveSocket. Replies of its jobs hold it open after the client stops sending
+struct socketClient
+{
+    explicit socketClient( int fd ) : fd( fd ) {}
+    ~socketClient() { close( fd ); }
+
+    const int fd;
+    std::mutex replies;
+
+    void send( const std::string &reply )
+    {
+        std::lock_guard<std::mutex> lock( replies );
+        const std::string data = reply + "\n";
+        for (size_t sent = 0; sent < data.size();)
+        {
+            const ssize_t n = ::send( fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL );
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;    // The client went away
+            sent += n;
+        }
+    }
+};
+
+void jobServer::serveSocket( const std::string &path )
+{
+    sockaddr_un address;
+    std::memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) throw std::invalid_argument("Socket path " + path + " is too long");
+    std::strcpy( address.sun_path, path.c_str() );
+
+    const int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if (listener < 0) throw std::runtime_error("Unable to create a socket");
+    unlink( path.c_str() );
+    if (bind( listener, reinterpret_cast<sockaddr*>( &address ), sizeof(address) ) < 0 || listen( listener, 16 ) < 0)
+    {
+        close( listener );
+        throw std::runtime_error("Unable to listen on " + path + ": " + std::strerror( errno ));
+    }
+
+    // Each client is read on its own thread. A shutdown line stops new clients and reads
+    std::mutex clientsMutex;
+    std::set<int> open;                     // Sockets of clients still being read
+    std::vector<std::thread> readers;
+    bool shuttingDown = false;
+    auto shutdownAll = [&]{
+        std::lock_guard<std::mutex> lock( clientsMutex );
+        shuttingDown = true;
+        shutdown( listener, SHUT_RDWR );
+        for (int fd : open) shutdown( fd, SHUT_RD );
+    };
+    auto read = [&]( std::shared_ptr<socketClient> client ) {
+        std::string buffer;
+        char chunk[4096];
+        while (true)
+        {
+            const ssize_t n = recv( client->fd, chunk, sizeof(chunk), 0 );
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            buffer.append( chunk, n );
+            size_t newline;
+            while ((newline = buffer.find( '\n' )) != std::string::npos)
+            {
+                const std::string line = buffer.substr( 0, newline );
+                buffer.erase( 0, newline + 1 );
+                if (line.find_first_not_of( " \t\r" ) == std::string::npos) continue;
+
+                bool shutdownLine = false;
+                try {
+                    const std::map<std::string, jsonValue> values = parseJobLine( line );
+                    auto it = values.find( "shutdown" );
+                    shutdownLine = (it != values.end() && it->second.text == "true");
+                } catch (std::exception&) {}    // Reported by the job handler
+                if (shutdownLine)
+                {
+                    client->send( "{\"ok\": true, \"shutdown\": true}" );
+                    shutdownAll();
+                    continue;
+                }
+                submit( job{ line, [client]( const std::string &reply ){ client->send( reply ); } } );
+            }
+        }
+        std::lock_guard<std::mutex> lock( clientsMutex );
+        open.erase( client->fd );
+    };
+
+    while (true)
+    {
+        const int fd = accept( listener, nullptr, nullptr );
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;      // Shut down
+        }
+        std::lock_guard<std::mutex> lock( clientsMutex );
+        if (shuttingDown)
+        {
+            close( fd );
+            break;
+        }
+        open.insert( fd );
+        readers.emplace_back( read, std::make_shared<socketClient>( fd ) );
+    }
+
+    shutdownAll();
+    for (auto &t : readers) t.join();
+    drain();
+    close( listener );
+    unlink( path.c_str() );
+}
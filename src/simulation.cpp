@@ -0,0 +1,466 @@
+#include <simulation.hpp>
+#include <mc.hpp>
+#include <jumpwalker.hpp>
+#include <batchwalker.hpp>
+#include <beamline.hpp>
+#include <summary.hpp>
+#include <metrics.hpp>
+#include <stdexcept>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <boost/progress.hpp>
+
+////////// input parameters ////////////
+const double pipeL  = 12;                                        // Total length of the pipe [m]
+const double gateValve  = 6;                                     // starting position [m]
+const double window = 9.1;                                       // PPM window location
+const double source = 0;                                         // source location
+const double fillTime = 50;                                    // source active time
+////////////////////////////////////////
+
+// Hands finished blocks to the consumer in particle order
+class orderedSink {
+public:
+    orderedSink( particleConsumer consume, int first ) : consume( consume ), nextFirst( first ), failed( false ) {}
+
+    void submit( int first, std::vector<particleState> &block )
+    {
+        if (!consume) return;   // Nothing to put in order
+        std::unique_lock<std::mutex> lock( mtx );
+
+        // Bound memory when one block lags far behind the others. The lagging block itself never waits,
+        // unless it failed, which wakes every waiting block to give up
+        blockDone.wait( lock, [&]{ return failed || first == nextFirst || pending.size() < MAX_PENDING_BLOCKS; } );
+        if (failed) throw std::runtime_error("Particles " + std::to_string( first ) + " on were dropped after an earlier block failed");
+        if (first != nextFirst)
+        {
+            pending[first].swap( block );
+            return;
+        }
+
+        try {
+            for (auto const& state : block) consume( state );
+            nextFirst += block.size();
+            while (!pending.empty() && pending.begin()->first == nextFirst)
+            {
+                for (auto const& state : pending.begin()->second) consume( state );
+                nextFirst += pending.begin()->second.size();
+                pending.erase( pending.begin() );
+            }
+        } catch (...) {
+            failed = true;
+            blockDone.notify_all();
+            throw;
+        }
+        blockDone.notify_all();
+    }
+
+    // A block of the run failed and will never be submitted
+    void fail()
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        failed = true;
+        blockDone.notify_all();
+    }
+
+    bool hasFailed()
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        return failed;
+    }
+
+private:
+    particleConsumer consume;
+    int nextFirst;                                      // First particle not yet consumed
+    bool failed;                                        // Whether a block failed, so nextFirst stops advancing
+    std::map<int, std::vector<particleState>> pending;  // Finished blocks keyed by first particle
+    std::mutex mtx;
+    std::condition_variable blockDone;
+};
+
+// Everything the tasks of one run share
+struct runState
+{
+    runState( std::map<std::string, double> params, int first, int last, uint64_t seed, walkEngine engine, generatorType rng,
+              std::shared_ptr<const velocitySpectrum> spectrum, particleConsumer consume, std::atomic<long> &done,
+              lossTally *tally, summaryStats *summary, std::shared_ptr<const beamline> geometry )
+        : params( params ), last( last ), seed( seed ), engine( engine ), rng( rng ), spectrum( spectrum ), next( first ), sink( consume, first ),
+          done( done ), tally( tally ), summary( summary ), geometry( geometry ) {}
+
+    std::map<std::string, double> params;
+    const int last;                     // One past the last particle of the run
+    const uint64_t seed;
+    const walkEngine engine;
+    const generatorType rng;
+    const std::shared_ptr<const velocitySpectrum> spectrum;
+    std::atomic<long long> next;        // First particle of the next unclaimed block, past last once all are claimed
+    orderedSink sink;
+    std::atomic<long> &done;
+    lossTally *tally;
+    std::mutex tallyMutex;
+    summaryStats *summary;
+    std::mutex summaryMutex;
+    const std::shared_ptr<const beamline> geometry;     // Walked by beamlineWalker if not null
+};
+
+static void walkBlock( workStealingPool &pool, std::shared_ptr<runState> run );
+
+// Hand a walked block of particles, starting at first, to the run's summary and consumer
+static void finishBlock( runState &run, const int first, std::vector<particleState> &block )
+{
+    if (run.summary)
+    {
+        summaryStats summary;
+        for (auto const& state : block) summary.add( state );
+        std::lock_guard<std::mutex> lock( run.summaryMutex );
+        run.summary->merge( summary );
+    }
+    countParticles( block );
+    const int n = block.size();
+    {
+        phaseTimer timer( metricsPhase::output );
+        run.sink.submit( first, block );
+    }
+    run.done += n;
+}
+
+// Walk particles [first, last) of a run with ucn, a walker drawing from a generator of type generator
+template<typename generator, typename walkerType>
+static void walkWith( runState &run, walkerType &ucn, const int first, const int last )
+{
+    const double fillTime = run.params["fillTime"];
+    std::uniform_real_distribution<double> start_time_distribution(0, nextafter(fillTime, std::numeric_limits<double>::max()) ); // Uniform distribution [0,fillTime]
+    randomStream<generator> mc;
+    const velocitySpectrum &spectrum = *run.spectrum;
+    std::vector<particleState> block;
+    block.reserve( last - first );
+
+    std::unique_ptr<lossTally> tally;
+    if (run.tally)
+    {
+        tally.reset( new lossTally( run.tally->points() ) );
+        ucn.setLossTally( tally.get() );
+    }
+
+    {
+        phaseTimer timer( metricsPhase::walk );
+        for (int i = first; i < last; i++)
+        {
+            mc.seed( run.seed, i );
+            const double tstart = start_time_distribution(mc);
+            ucn.resetState( tstart, spectrum.sample( mc ), i );
+            ucn.walk( mc );
+            block.push_back( ucn.getState() );
+            if (tally) tally->finish( block.back() );
+        }
+    }
+    countDraws( mc.draws() );
+
+    if (tally)
+    {
+        std::lock_guard<std::mutex> lock( run.tallyMutex );
+        run.tally->merge( *tally );
+    }
+    finishBlock( run, first, block );
+}
+
+// Walk particles [first, last) of a run with one walker and generator type
+template<template<typename> class walker, typename generator>
+static void walkParticles( runState &run, const int first, const int last )
+{
+    walker<generator> ucn( 0, run.spectrum->fastest(), run.params );     // Lattice tables are sized for the fastest neutron
+    walkWith<generator>( run, ucn, first, last );
+}
+
+template<template<typename> class walker>
+static void walkParticles( runState &run, const int first, const int last )
+{
+    switch (run.rng)
+    {
+        case generatorType::mt19937_64:   walkParticles<walker, std::mt19937_64>( run, first, last ); break;
+        case generatorType::xoshiro256ss: walkParticles<walker, xoshiro256ss>( run, first, last ); break;
+        case generatorType::philox4x32:   walkParticles<walker, philox4x32>( run, first, last ); break;
+    }
+}
+
+// Walk particles [first, last) of a run along its beamline
+template<typename generator>
+static void walkBeamline( runState &run, const int first, const int last )
+{
+    beamlineWalker<generator> ucn( 0, run.spectrum->fastest(), run.params, run.geometry );
+    walkWith<generator>( run, ucn, first, last );
+}
+
+static void walkBeamline( runState &run, const int first, const int last )
+{
+    switch (run.rng)
+    {
+        case generatorType::mt19937_64:   walkBeamline<std::mt19937_64>( run, first, last ); break;
+        case generatorType::xoshiro256ss: walkBeamline<xoshiro256ss>( run, first, last ); break;
+        case generatorType::philox4x32:   walkBeamline<philox4x32>( run, first, last ); break;
+    }
+}
+
+// Walk particles [first, last) of a run with batchWalker
+static void walkBatch( runState &run, const int first, const int last )
+{
+    batchWalker ucn( run.params, run.spectrum );
+    std::vector<particleState> block;
+    {
+        phaseTimer timer( metricsPhase::walk );
+        ucn.walk( run.seed, first, last, block );
+    }
+    finishBlock( run, first, block );
+}
+
+// Claim and walk the next block of a run. Blocks are claimed in order and walked straight away,
+// so the earliest unfinished block is always being walked and orderedSink never waits forever
+static void walkBlock( workStealingPool &pool, std::shared_ptr<runState> run )
+{
+    const long long claimed = run->next.fetch_add(PARTICLE_BLOCK);
+    if (claimed >= run->last || run->sink.hasFailed()) return;
+    const int first = static_cast<int>( claimed );
+    const int last = static_cast<int>( std::min<long long>(claimed + PARTICLE_BLOCK, run->last) );
+
+    // Continuation goes on this worker's deque where idle workers can steal it
+    if (last < run->last) pool.submit( [&pool, run]{ walkBlock( pool, run ); } );
+
+    // A block that throws is never submitted, so blocks waiting behind it are told to give up
+    try {
+        switch (run->engine)
+        {
+            case walkEngine::step:
+                if (run->geometry) {
+                    walkBeamline( *run, first, last );
+                } else {
+                    walkParticles<particle1d>( *run, first, last );
+                }
+                break;
+            case walkEngine::jump: walkParticles<jumpWalker>( *run, first, last ); break;
+            case walkEngine::batch: walkBatch( *run, first, last ); break;
+            case walkEngine::markov: break;     // Not walked, see scheduleRun
+        }
+    } catch (...) {
+        run->sink.fail();
+        throw;
+    }
+}
+
+// Runs that share their walks up to the first cell exit. Blocks are claimed from the first run
+typedef std::vector< std::shared_ptr<runState> > branchedRun;
+
+// Walk particles [first, last) of branched runs, drawing from a generator of type generator
+template<typename generator>
+static void walkBranches( branchedRun &runs, const int first, const int last )
+{
+    runState &run = *runs.front();
+    const double fillTime = run.params["fillTime"];
+    std::uniform_real_distribution<double> start_time_distribution(0, nextafter(fillTime, std::numeric_limits<double>::max()) ); // Uniform distribution [0,fillTime]
+    randomStream<generator> mc;
+    const velocitySpectrum &spectrum = *run.spectrum;
+
+    std::vector< std::unique_ptr< particle1d<generator> > > ucn;
+    std::vector< std::unique_ptr<lossTally> > tallies( runs.size() );
+    std::vector< std::vector<particleState> > blocks( runs.size() );
+    for (size_t b = 0; b < runs.size(); b++)
+    {
+        ucn.emplace_back( new particle1d<generator>( 0, spectrum.fastest(), runs[b]->params ) );
+        blocks[b].reserve( last - first );
+        if (runs[b]->tally)
+        {
+            tallies[b].reset( new lossTally( runs[b]->tally->points() ) );
+            ucn[b]->setLossTally( tallies[b].get() );
+        }
+    }
+
+    auto finish = [&]( size_t b ) {
+        blocks[b].push_back( ucn[b]->getState() );
+        if (tallies[b]) tallies[b]->finish( blocks[b].back() );
+    };
+
+    // The first run walks the shared part, and goes on with the stream itself once the others have copied it
+    uint64_t branchDraws = 0;
+    {
+        phaseTimer timer( metricsPhase::walk );
+        for (int i = first; i < last; i++)
+        {
+            mc.seed( run.seed, i );
+            const double tstart = start_time_distribution(mc);
+            ucn[0]->resetState( tstart, spectrum.sample( mc ), i );
+            ucn[0]->walkToExit( mc );
+            for (size_t b = 1; b < runs.size(); b++)
+            {
+                randomStream<generator> branch( mc );
+                ucn[b]->resumeFrom( *ucn[0] );
+                if (tallies[b]) tallies[b]->continueFrom( *tallies[0] );
+                ucn[b]->walk( branch );
+                branchDraws += branch.draws() - mc.draws();
+                finish( b );
+            }
+            ucn[0]->walk( mc );
+            finish( 0 );
+        }
+    }
+    countDraws( mc.draws() + branchDraws );
+
+    for (size_t b = 0; b < runs.size(); b++)
+    {
+        if (tallies[b])
+        {
+            std::lock_guard<std::mutex> lock( runs[b]->tallyMutex );
+            runs[b]->tally->merge( *tallies[b] );
+        }
+        finishBlock( *runs[b], first, blocks[b] );
+    }
+}
+
+// Claim and walk the next block of branched runs, as walkBlock does
+static void walkBranchedBlock( workStealingPool &pool, std::shared_ptr<branchedRun> runs )
+{
+    runState &run = *runs->front();
+    const long long claimed = run.next.fetch_add(PARTICLE_BLOCK);
+    if (claimed >= run.last || run.sink.hasFailed()) return;
+    const int first = static_cast<int>( claimed );
+    const int last = static_cast<int>( std::min<long long>(claimed + PARTICLE_BLOCK, run.last) );
+
+    if (last < run.last) pool.submit( [&pool, runs]{ walkBranchedBlock( pool, runs ); } );
+
+    try {
+        switch (run.rng)
+        {
+            case generatorType::mt19937_64:   walkBranches<std::mt19937_64>( *runs, first, last ); break;
+            case generatorType::xoshiro256ss: walkBranches<xoshiro256ss>( *runs, first, last ); break;
+            case generatorType::philox4x32:   walkBranches<philox4x32>( *runs, first, last ); break;
+        }
+    } catch (...) {
+        for (auto &r : *runs) r->sink.fail();
+        throw;
+    }
+}
+
+std::map<std::string, double> staticParameters(double nonspec, double lossPerBounce, double windowLoss, double mfp2)
+{
+    const double mfp = meanFreePath( nonspec );
+
+    return std::map<std::string, double> {
+        {"stepSize",  mfp},
+        {"nonspec",  nonspec},
+        {"lossPerBounce",  lossPerBounce},
+        {"cell", pipeL},
+        {"window", window},
+        {"windowLoss", windowLoss},
+        {"start", gateValve},
+        {"source", source},
+        {"fillTime", fillTime},
+        // {"cellChance", 0.35},
+        {"cellChance", cellEntranceChance( mfp, nonspec )},
+        {"stepSize2", mfp2},
+        {"lossPerStep", (1/nonspec) * lossPerBounce},
+    };
+}
+
+walkEngine parseEngine( const std::string &name )
+{
+    if (name == "step") return walkEngine::step;
+    if (name == "jump") return walkEngine::jump;
+    if (name == "batch") return walkEngine::batch;
+    if (name == "markov") return walkEngine::markov;
+    throw std::invalid_argument("Unknown engine '" + name + "' (expected step, jump, batch or markov)");
+}
+
+cellDwell parseCellDwell( const std::string &name )
+{
+    if (name == "constant") return cellDwell::constant;
+    if (name == "exponential") return cellDwell::exponential;
+    throw std::invalid_argument("Unknown cell dwell model '" + name + "' (expected constant or exponential)");
+}
+
+long long stepBound( std::map<std::string, double> params, const velocitySpectrum &spectrum, const beamline *geometry )
+{
+    // Every step takes at least the shortest mfp at the fastest velocity, and adds at most two to totalSteps
+    double mfp = params["stepSize"];
+    if (params["stepSize2"] > 0) mfp = std::min( mfp, params["stepSize2"] );
+    if (geometry) for (auto const& r : geometry->regions) mfp = std::min( mfp, r.mfp );
+    const double steps = 2 * (std::ceil( params["fillTime"] * spectrum.fastest().v / mfp ) + 2);
+    return static_cast<long long>( std::min<double>( steps, std::numeric_limits<long long>::max() / 2 ) );
+}
+
+void scheduleRun( workStealingPool &pool, std::map<std::string, double> params, const int first, const int n,
+                  const uint64_t seed, const walkEngine engine, const generatorType rng,
+                  std::shared_ptr<const velocitySpectrum> spectrum, particleConsumer consume,
+                  std::atomic<long> &done, lossTally *tally, summaryStats *summary,
+                  std::shared_ptr<const beamline> geometry )
+{
+    if (engine == walkEngine::markov)
+        throw std::invalid_argument("--engine markov solves for expected outcomes with markovSolver and has no particles to walk");
+    if (engine == walkEngine::batch && rng != generatorType::xoshiro256ss)
+        throw std::invalid_argument("--engine batch only supports --rng xoshiro256ss");
+    if (engine == walkEngine::batch && tally)
+        throw std::invalid_argument("--engine batch does not support --reweight");
+    if (engine == walkEngine::batch && params["exponentialDwell"] != 0)
+        throw std::invalid_argument("--cell-dwell exponential needs --engine step or jump");
+    if (geometry && engine != walkEngine::step)
+        throw std::invalid_argument("--geometry only works with --engine step");
+    if (geometry && tally)
+        throw std::invalid_argument("--geometry does not support --reweight, since pipe loss differs between sections");
+    if (first < 0 || n < 0 || n > std::numeric_limits<int>::max() - first)
+        throw std::invalid_argument("Particle numbers must be between 0 and " + std::to_string( std::numeric_limits<int>::max() ));
+
+    std::shared_ptr<runState> run = std::make_shared<runState>( params, first, first + n, seed, engine, rng, spectrum, consume, done, tally, summary, geometry );
+    const int blocks = (n + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK;
+    for (int i = 0; i < std::min(pool.size(), blocks); i++)
+        pool.submit( [&pool, run]{ walkBlock( pool, run ); } );
+}
+
+void scheduleBranchedRun( workStealingPool &pool, std::vector< std::map<std::string, double> > params, const int first, const int n,
+                          const uint64_t seed, const generatorType rng, std::shared_ptr<const velocitySpectrum> spectrum,
+                          std::vector<particleConsumer> consume, std::atomic<long> &done,
+                          std::vector<lossTally*> tallies, std::vector<summaryStats*> summaries )
+{
+    if (params.empty() || consume.size() != params.size() || tallies.size() != params.size() || summaries.size() != params.size())
+        throw std::logic_error("Branched runs need the outputs of every run");
+    for (auto const& p : params)
+    {
+        std::map<std::string, double> same( p );
+        same["stepSize2"] = params.front().at("stepSize2");
+        if (same != params.front()) throw std::invalid_argument("Branched runs may only differ in stepSize2");
+    }
+    if (first < 0 || n < 0 || n > std::numeric_limits<int>::max() - first)
+        throw std::invalid_argument("Particle numbers must be between 0 and " + std::to_string( std::numeric_limits<int>::max() ));
+
+    std::shared_ptr<branchedRun> runs = std::make_shared<branchedRun>();
+    for (size_t b = 0; b < params.size(); b++)
+        runs->push_back( std::make_shared<runState>( params[b], first, first + n, seed, walkEngine::step, rng, spectrum,
+                                                     consume[b], done, tallies[b], summaries[b], nullptr ) );
+    const int blocks = (n + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK;
+    for (int i = 0; i < std::min(pool.size(), blocks); i++)
+        pool.submit( [&pool, runs]{ walkBranchedBlock( pool, runs ); } );
+}
+
+void waitForRuns( workStealingPool &pool, const long total, std::atomic<long> &done, const bool progress )
+{
+    // progress_display is not thread safe, so only the calling thread touches it
+    if (progress)
+    {
+        boost::progress_display show_progress( total );
+        while (!pool.waitFor( std::chrono::milliseconds(100) ))
+            show_progress += done - show_progress.count();
+        show_progress += done - show_progress.count();
+    }
+    pool.wait();
+}
+
+void simulate( std::map<std::string, double> params, const int n, const int threads,
+               const uint64_t seed, const walkEngine engine, const generatorType rng,
+               std::shared_ptr<const velocitySpectrum> spectrum, const bool progress, particleConsumer consume )
+{
+    workStealingPool pool( threads );
+    std::atomic<long> done(0);
+    scheduleRun( pool, params, 0, n, seed, engine, rng, spectrum, consume, done );
+    waitForRuns( pool, n, done, progress );
+}
@@ -0,0 +1,155 @@
+#define _USE_MATH_DEFINES
+#include <spectrum.hpp>
+#include <particle1d.hpp>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+const double NEV_TO_V2 = 2 * 1.602176634e-28 / 1.67492749804e-27;   // v^2 [m^2/s^2] of a neutron per neV
+
+aliasTable::aliasTable( const std::vector<double> &weights ) : n( weights.size() ), threshold( n ), alias( n )
+{
+    const double total = std::accumulate( weights.begin(), weights.end(), 0. );
+    if (n == 0 || !(total > 0)) throw std::invalid_argument("Alias table needs a positive total weight");
+
+    // Vose: pair each outcome below the average with one above it
+    std::vector<double> scaled( n );
+    std::vector<int> small, large;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (weights[i] < 0) throw std::invalid_argument("Alias table weights must not be negative");
+        scaled[i] = weights[i] * n / total;
+        alias[i] = i;
+        (scaled[i] < 1 ? small : large).push_back( i );
+    }
+    while (!small.empty() && !large.empty())
+    {
+        const int s = small.back(), l = large.back();
+        small.pop_back();
+        threshold[s] = static_cast<uint64_t>( std::ldexp( scaled[s], 32 ) );
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+        {
+            large.pop_back();
+            small.push_back( l );
+        }
+    }
+    // Whatever is left is 1 up to rounding
+    for (int i : small) threshold[i] = 1ULL << 32;
+    for (int i : large) threshold[i] = 1ULL << 32;
+}
+
+static velocityBin makeBin( double v )
+{
+    return velocityBin{ v, 4 / v * CELL_VOLUME / (std::pow(CELL_ENTRANCE_ID/2, 2 ) * M_PI) };
+}
+
+velocitySpectrum::velocitySpectrum( const std::vector<double> &velocities, const std::vector<double> &weights )
+                    : weights( weights ), table( weights )
+{
+    if (velocities.size() != weights.size()) throw std::invalid_argument("Spectrum needs one weight per velocity");
+    for (double v : velocities)
+    {
+        if (!(v > 0)) throw std::invalid_argument("Spectrum velocities must be positive");
+        bins.push_back( makeBin( v ) );
+    }
+}
+
+const velocityBin &velocitySpectrum::fastest() const
+{
+    return *std::max_element( bins.begin(), bins.end(), []( const velocityBin &a, const velocityBin &b ){ return a.v < b.v; } );
+}
+
+double velocitySpectrum::mean() const
+{
+    double sum = 0, total = 0;
+    for (size_t i = 0; i < bins.size(); i++)
+    {
+        sum += weights[i] * bins[i].v;
+        total += weights[i];
+    }
+    return sum / total;
+}
+
+size_t velocitySpectrum::size() const
+{
+    return bins.size();
+}
+
+const velocityBin &velocitySpectrum::bin( size_t i ) const
+{
+    return bins[i];
+}
+
+double velocitySpectrum::probability( size_t i ) const
+{
+    return weights[i] / std::accumulate( weights.begin(), weights.end(), 0. );
+}
+
+// SPECTRUM_BINS bins between the velocities of UCN_E_MIN and UCN_E_MAX, weighted by the trapezoid rule
+template<typename UnaryFunction>
+static velocitySpectrum binSpectrum( UnaryFunction f )
+{
+    const double vmin = std::sqrt( UCN_E_MIN * NEV_TO_V2 );
+    const double vmax = std::sqrt( UCN_E_MAX * NEV_TO_V2 );
+    const double width = (vmax - vmin) / SPECTRUM_BINS;
+    std::vector<double> velocities, weights;
+    for (int i = 0; i < SPECTRUM_BINS; i++)
+    {
+        const double lo = vmin + i * width;
+        velocities.push_back( lo + width / 2 );
+        weights.push_back( (f( lo ) + f( lo + width )) / 2 * width );
+    }
+    return velocitySpectrum( velocities, weights );
+}
+
+static velocitySpectrum readSpectrum( const std::string &path )
+{
+    std::ifstream file( path );
+    if (!file) throw std::runtime_error("Unable to open spectrum file " + path);
+
+    std::vector<double> velocities, weights;
+    std::string line;
+    while (std::getline( file, line ))
+    {
+        line = line.substr( 0, line.find('#') );
+        std::stringstream items( line );
+        double v, w;
+        if (!(items >> v)) continue;    // blank or comment line
+        if (!(items >> w)) throw std::runtime_error("Spectrum line '" + line + "' needs a velocity and a weight");
+        velocities.push_back( v );
+        weights.push_back( w );
+    }
+    return velocitySpectrum( velocities, weights );
+}
+
+std::shared_ptr<const velocitySpectrum> makeSpectrum( const std::string &name, const std::string &path )
+{
+    // Function statics are built on first use, and C++11 makes that thread safe
+    if (name == "mono")
+    {
+        static std::shared_ptr<const velocitySpectrum> mono =
+            std::make_shared<const velocitySpectrum>( std::vector<double>{ v2_average }, std::vector<double>{ 1 } );
+        return mono;
+    }
+    if (name == "v2")
+    {
+        static std::shared_ptr<const velocitySpectrum> v2 = std::make_shared<const velocitySpectrum>( binSpectrum( v2Spectrum ) );
+        return v2;
+    }
+    if (name == "v3")
+    {
+        static std::shared_ptr<const velocitySpectrum> v3 = std::make_shared<const velocitySpectrum>( binSpectrum( v3Spectrum ) );
+        return v3;
+    }
+    if (name == "file")
+    {
+        if (path.empty()) throw std::invalid_argument("--spectrum file needs --spectrum-file");
+        return std::make_shared<const velocitySpectrum>( readSpectrum( path ) );
+    }
+    throw std::invalid_argument("Unknown spectrum '" + name + "' (expected mono, v2, v3 or file)");
+}
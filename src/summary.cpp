@@ -0,0 +1,186 @@
+#include <summary.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <limits>
+
+void runningStat::add( long long x )
+{
+    n++;
+    sum += x;
+    sumSquares += x * x;
+}
+
+void runningStat::merge( const runningStat &other )
+{
+    n += other.n;
+    sum += other.sum;
+    sumSquares += other.sumSquares;
+}
+
+double runningStat::mean() const
+{
+    return (n > 0) ? static_cast<double>( static_cast<long double>(sum) / n ) : 0;
+}
+
+double runningStat::variance() const
+{
+    if (n < 2) return 0;
+    const long double total = sum;
+    return static_cast<double>( (sumSquares - total * total / n) / (n - 1) );
+}
+
+double runningStat::stdError() const
+{
+    return (n > 1) ? std::sqrt( variance() / n ) : 0;
+}
+
+void summaryStats::add( const particleState &s )
+{
+    statusCounts[static_cast<int>(s.status)]++;
+    if (s.status != particleStatus::cell) return;
+
+    windowHits.add( s.windowHits );
+    cellRejections.add( s.cellRejections );
+    totalSteps.add( s.totalSteps );
+    if (windowHitsHistogram.size() <= static_cast<size_t>(s.windowHits)) windowHitsHistogram.resize( s.windowHits + 1, 0 );
+    windowHitsHistogram[s.windowHits]++;
+}
+
+void summaryStats::merge( const summaryStats &other )
+{
+    for (int i = 0; i < STATUS_COUNT; i++) statusCounts[i] += other.statusCounts[i];
+    windowHits.merge( other.windowHits );
+    cellRejections.merge( other.cellRejections );
+    totalSteps.merge( other.totalSteps );
+    if (windowHitsHistogram.size() < other.windowHitsHistogram.size()) windowHitsHistogram.resize( other.windowHitsHistogram.size(), 0 );
+    for (size_t i = 0; i < other.windowHitsHistogram.size(); i++) windowHitsHistogram[i] += other.windowHitsHistogram[i];
+}
+
+// cellStats fields
+static const hsize_t STAT_FIELDS = 7;
+static const char *stat_names[STAT_FIELDS] = { "observable", "count", "sum", "sumSquares", "mean", "variance", "stdError" };
+static const size_t stat_offset[STAT_FIELDS] = {  HOFFSET( statOutputFormat, observable ),
+                                                  HOFFSET( statOutputFormat, count ),
+                                                  HOFFSET( statOutputFormat, sum ),
+                                                  HOFFSET( statOutputFormat, sumSquares ),
+                                                  HOFFSET( statOutputFormat, mean ),
+                                                  HOFFSET( statOutputFormat, variance ),
+                                                  HOFFSET( statOutputFormat, stdError ) };
+static const size_t stat_sizes[STAT_FIELDS] = {  sizeof( statOutputFormat::observable ),
+                                                 sizeof( statOutputFormat::count ),
+                                                 sizeof( statOutputFormat::sum ),
+                                                 sizeof( statOutputFormat::sumSquares ),
+                                                 sizeof( statOutputFormat::mean ),
+                                                 sizeof( statOutputFormat::variance ),
+                                                 sizeof( statOutputFormat::stdError ) };
+
+static statOutputFormat statRow( const char *name, const runningStat &stat )
+{
+    statOutputFormat row{ {0}, stat.n, stat.sum, stat.sumSquares, stat.mean(), stat.variance(), stat.stdError() };
+    std::memcpy( row.observable, name, strnlen( name, CHAR_COUNT - 1 ) );   // Zero initialised, so always terminated
+    return row;
+}
+
+void summaryStats::write( hdfFile &file, std::string group, std::map<std::string, double> attributes ) const
+{
+    // Status counts as group attributes
+    std::map<std::string, long long> counts;
+    for (int i = 0; i < STATUS_COUNT; i++) counts[statusName( static_cast<particleStatus>(i) )] = statusCounts[i];
+    counts["particles"] = particles();
+    file.createGroup( group, attributes );
+    file.setAttributes( group, counts );
+
+    // Means of particles that reach the cell
+    const statOutputFormat rows[3] = { statRow( "windowHits", windowHits ),
+                                       statRow( "cellRejections", cellRejections ),
+                                       statRow( "totalSteps", totalSteps ) };
+    const fieldType field_types[STAT_FIELDS] = { fieldType::text, fieldType::integer, fieldType::integer, fieldType::integer,
+                                                 fieldType::real, fieldType::real, fieldType::real };
+    file.writeTable( group + "/cellStats", STAT_FIELDS, 3, sizeof( statOutputFormat ),
+                     stat_names, stat_offset, field_types, rows, std::map<std::string, double>() );
+
+    file.writeArray( group + "/windowHitsHistogram", windowHitsHistogram );
+}
+
+void summaryStats::merge( const hdfReader &file, std::string group )
+{
+    const std::map<std::string, long long> counts = file.integerAttributes( group );
+    for (int i = 0; i < STATUS_COUNT; i++)
+    {
+        auto count = counts.find( statusName( static_cast<particleStatus>(i) ) );
+        if (count == counts.end()) throw std::runtime_error(group + " has no " + statusName( static_cast<particleStatus>(i) ) + " count");
+        statusCounts[i] += count->second;
+    }
+
+    std::vector<statOutputFormat> rows( file.records( group + "/cellStats" ) );
+    if (rows.size() != 3) throw std::runtime_error(group + "/cellStats does not have 3 rows");
+    file.readTable( group + "/cellStats", sizeof( statOutputFormat ), stat_offset, stat_sizes, rows.data() );
+    runningStat *stats[3] = { &windowHits, &cellRejections, &totalSteps };
+    for (int i = 0; i < 3; i++)
+    {
+        stats[i]->n += rows[i].count;
+        stats[i]->sum += rows[i].sum;
+        stats[i]->sumSquares += rows[i].sumSquares;
+    }
+
+    const std::vector<long long> histogram = file.readArray( group + "/windowHitsHistogram" );
+    if (windowHitsHistogram.size() < histogram.size()) windowHitsHistogram.resize( histogram.size(), 0 );
+    for (size_t i = 0; i < histogram.size(); i++) windowHitsHistogram[i] += histogram[i];
+}
+
+long long summaryStats::particles() const
+{
+    long long particles = 0;
+    for (int i = 0; i < STATUS_COUNT; i++) particles += statusCounts[i];
+    return particles;
+}
+
+double summaryStats::relativeError( const std::string &observable ) const
+{
+    const runningStat *stat = nullptr;
+    if (observable == "cell") {
+        const long long n = particles();
+        const double cell = statusCounts[static_cast<int>(particleStatus::cell)];
+        if (cell == 0) return std::numeric_limits<double>::infinity();
+        const double p = cell / n;
+        return CONFIDENCE_Z * std::sqrt( p * (1 - p) / n ) / p;
+    } else if (observable == "windowHits") {
+        stat = &windowHits;
+    } else if (observable == "cellRejections") {
+        stat = &cellRejections;
+    } else if (observable == "totalSteps") {
+        stat = &totalSteps;
+    } else {
+        throw std::invalid_argument("Unknown observable '" + observable + "' (expected cell, windowHits, cellRejections or totalSteps)");
+    }
+    if (stat->n < 2 || stat->sum == 0) return std::numeric_limits<double>::infinity();
+    return CONFIDENCE_Z * stat->stdError() / std::fabs( stat->mean() );
+}
+
+void summaryStats::print( std::ostream &out ) const
+{
+    out << "Total neutrons simulated: " << particles() << '\n';
+    out << "Neutrons lost at source: " << statusCounts[static_cast<int>(particleStatus::source)] << '\n';
+    out << "Neutrons lost in pipe: " << statusCounts[static_cast<int>(particleStatus::pipe)] << '\n';
+    out << "Neutrons lost on window: " << statusCounts[static_cast<int>(particleStatus::window)] << '\n';
+    out << "Total neutrons in cell: " << statusCounts[static_cast<int>(particleStatus::cell)] << '\n';
+    char line[128];
+    snprintf(line, sizeof(line), "Av window hits = %.4f +/- %.4f\n", windowHits.mean(), windowHits.stdError());
+    out << line;
+    snprintf(line, sizeof(line), "Av cell rejections = %.4f +/- %.4f\n", cellRejections.mean(), cellRejections.stdError());
+    out << line;
+    snprintf(line, sizeof(line), "Av total bounces = %.4f +/- %.4f\n", totalSteps.mean(), totalSteps.stdError());
+    out << line;
+}
+
+long long summaryStats::count( particleStatus status ) const
+{
+    return statusCounts[static_cast<int>(status)];
+}
+
+double summaryStats::meanWindowHits() const
+{
+    return windowHits.mean();
+}
@@ -0,0 +1,180 @@
+#include <threadpool.hpp>
+#include <stdexcept>
+
+// Pool and deque index of the calling thread, if it is a pool worker
+static thread_local workStealingPool* currentPool = nullptr;
+static thread_local int currentIndex = -1;
+
+// Group that tasks submitted by the calling thread join
+static thread_local taskGroup* currentGroup = nullptr;
+
+taskGroup::taskGroup() : unfinished( 0 ) {}
+
+taskGroup::~taskGroup()
+{
+    std::unique_lock<std::mutex> lock( mtx );
+    allDone.wait( lock, [this]{ return unfinished == 0; } );
+}
+
+taskGroup::scope::scope( taskGroup &group ) : previous( currentGroup )
+{
+    currentGroup = &group;
+}
+
+taskGroup::scope::~scope()
+{
+    currentGroup = previous;
+}
+
+workStealingPool::workStealingPool( int threads )
+                : queued( 0 ), unfinished( 0 ), nextQueue( 0 ), stopping( false )
+{
+    if (threads < 1) throw std::invalid_argument("Thread pool needs at least one thread");
+    for (int i = 0; i < threads; i++) queues.emplace_back( new taskQueue );
+    for (int i = 0; i < threads; i++) workers.emplace_back( &workStealingPool::run, this, i );
+}
+
+workStealingPool::~workStealingPool()
+{
+    {
+        std::unique_lock<std::mutex> lock( mtx );
+        allDone.wait( lock, [this]{ return unfinished == 0; } );
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (auto &t : workers) t.join();
+}
+
+int workStealingPool::size() const
+{
+    return workers.size();
+}
+
+void workStealingPool::submit( task t )
+{
+    int index;
+    if (currentPool == this) {
+        index = currentIndex;
+    } else {
+        std::lock_guard<std::mutex> lock( mtx );
+        index = nextQueue++ % queues.size();
+    }
+
+    if (currentGroup)
+    {
+        std::lock_guard<std::mutex> lock( currentGroup->mtx );
+        currentGroup->unfinished++;
+    }
+    {
+        std::lock_guard<std::mutex> lock( queues[index]->mtx );
+        queues[index]->tasks.push_back( groupTask{ std::move(t), currentGroup } );
+    }
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        queued++;
+        unfinished++;
+    }
+    workAvailable.notify_one();
+}
+
+void workStealingPool::wait()
+{
+    if (currentGroup)
+    {
+        taskGroup &group = *currentGroup;
+        std::unique_lock<std::mutex> lock( group.mtx );
+        group.allDone.wait( lock, [&group]{ return group.unfinished == 0; } );
+        if (group.error)
+        {
+            std::exception_ptr err = group.error;
+            group.error = nullptr;
+            std::rethrow_exception( err );
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock( mtx );
+    allDone.wait( lock, [this]{ return unfinished == 0; } );
+    if (error)
+    {
+        std::exception_ptr err = error;
+        error = nullptr;
+        std::rethrow_exception( err );
+    }
+}
+
+bool workStealingPool::waitFor( std::chrono::milliseconds timeout )
+{
+    if (currentGroup)
+    {
+        taskGroup &group = *currentGroup;
+        std::unique_lock<std::mutex> lock( group.mtx );
+        return group.allDone.wait_for( lock, timeout, [&group]{ return group.unfinished == 0; } );
+    }
+
+    std::unique_lock<std::mutex> lock( mtx );
+    return allDone.wait_for( lock, timeout, [this]{ return unfinished == 0; } );
+}
+
+bool workStealingPool::take( int index, groupTask &t )
+{
+    const int n = queues.size();
+    for (int i = 0; i < n; i++)
+    {
+        taskQueue &q = *queues[(index + i) % n];
+        std::lock_guard<std::mutex> lock( q.mtx );
+        if (q.tasks.empty()) continue;
+        if (i == 0) {
+            t = std::move( q.tasks.back() );
+            q.tasks.pop_back();
+        } else {
+            t = std::move( q.tasks.front() );
+            q.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void workStealingPool::run( int index )
+{
+    currentPool = this;
+    currentIndex = index;
+
+    while (true)
+    {
+        groupTask t;
+        if (take( index, t ))
+        {
+            {
+                std::lock_guard<std::mutex> lock( mtx );
+                queued--;
+            }
+            // Tasks submitted by this task join its group
+            currentGroup = t.group;
+            std::exception_ptr failure;
+            try {
+                t.t();
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            currentGroup = nullptr;
+            t.t = nullptr;      // What the task holds goes before its group counts it finished
+
+            if (t.group)
+            {
+                std::lock_guard<std::mutex> lock( t.group->mtx );
+                if (failure && !t.group->error) t.group->error = failure;
+                if (--t.group->unfinished == 0) t.group->allDone.notify_all();
+            }
+            std::lock_guard<std::mutex> lock( mtx );
+            if (failure && !t.group && !error) error = failure;
+            if (--unfinished == 0) allDone.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock( mtx );
+        workAvailable.wait( lock, [this]{ return queued > 0 || stopping; } );
+        if (stopping && queued == 0) return;
+    }
+}